@@ -0,0 +1,179 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checkpoint.h"
+
+// Checkpoints
+//
+// Checkpoint n is a snapshot taken at the first instruction boundary at or
+// after cycle n * interval. Seeking to a cycle restores the latest
+// checkpoint before it and runs forward, so a seek never runs more than
+// interval cycles however long the session is.
+//
+// Slots are indexed by n. In memory they live in one growing array; on
+// disk slot n is at offset n * size in a scratch file, and only the cycle
+// each slot was taken at is kept in memory. Debugger edits invalidate the slots
+// after the current cycle, since the session no longer leads to them.
+
+unsigned checkpoint_due = ~0u;
+
+static unsigned interval = 0;
+static FILE *file = NULL;
+static u8 *mem = NULL;
+static unsigned *at = NULL;         // cycle of each slot, ~0 if empty
+static unsigned slots = 0;          // allocated
+static unsigned taken = 0;
+static size_t size = 0;
+static u8 *scratch = NULL;
+
+
+////////////////////////////////
+// snapshots
+//
+
+// buffers need only be malloc aligned: the machine state is copied through
+// an aligned local
+size_t snapshot_size(void) {
+    return sizeof(sm5_state_t) + backend->state_size;
+}
+
+void snapshot_take(void *buf) {
+    sm5_state_t state;
+
+    sm5_snapshot(sm, &state);
+    memcpy(buf, &state, sizeof(state));
+    if (backend->save)
+        backend->save((u8 *)buf + sizeof(sm5_state_t));
+}
+
+void snapshot_load(const void *buf) {
+    sm5_state_t state;
+
+    memcpy(&state, buf, sizeof(state));
+    sm5_restore(sm, &state);
+    if (backend->restore)
+        backend->restore((const u8 *)buf + sizeof(sm5_state_t));
+    finished = 0;
+}
+
+
+////////////////////////////////
+// checkpoints
+//
+
+void checkpoint_open(unsigned cycles, const char *name) {
+    interval = cycles;
+    // keeps every slot as aligned as the first
+    size = (snapshot_size() + 63) & ~(size_t)63;
+    scratch = malloc(size);
+    if (scratch == NULL)
+        err(1, "Can't allocate checkpoint");
+
+    if (name != NULL) {
+        file = fopen(name, "w+");
+        if (file == NULL)
+            err(1, "Can't open %s", name);
+    }
+    checkpoint_reset();
+}
+
+static void grow(unsigned n) {
+    unsigned want = slots ? slots : 64;
+
+    while (want <= n)
+        want *= 2;
+    at = realloc(at, want * sizeof(*at));
+    if (at == NULL)
+        err(1, "Can't allocate checkpoints");
+    memset(at + slots, 0xff, (want - slots) * sizeof(*at));
+    if (file == NULL) {
+        mem = realloc(mem, want * size);
+        if (mem == NULL)
+            err(1, "Can't allocate checkpoints");
+    }
+    slots = want;
+}
+
+void checkpoint_take(void) {
+    unsigned n = cpu->cycle / interval;
+
+    if (n >= slots)
+        grow(n);
+
+    if (at[n] == ~0u) {
+        if (file == NULL) {
+            snapshot_take(mem + n * size);
+        } else {
+            snapshot_take(scratch);
+            if (fseek(file, (long)n * size, SEEK_SET) != 0
+                    || fwrite(scratch, size, 1, file) != 1)
+                err(1, "Can't write checkpoint");
+        }
+        at[n] = cpu->cycle;
+        ++taken;
+    }
+    checkpoint_due = (n + 1) * interval;
+}
+
+void checkpoint_reset(void) {
+    if (interval == 0)
+        return;
+    if (slots)
+        memset(at, 0xff, slots * sizeof(*at));
+    taken = 0;
+    checkpoint_due = 0;
+}
+
+void checkpoint_truncate(void) {
+    unsigned n;
+
+    if (interval == 0)
+        return;
+    for (n = cpu->cycle / interval + 1; n < slots; ++n)
+        if (at[n] != ~0u) {
+            at[n] = ~0u;
+            --taken;
+        }
+    checkpoint_due = (cpu->cycle / interval + 1) * interval;
+}
+
+int checkpoint_restore(unsigned cycle) {
+    int here = cycle >= cpu->cycle;
+    unsigned n;
+
+    if (interval == 0 || slots == 0)
+        return here;
+
+    n = cycle / interval;
+    if (n >= slots)
+        n = slots - 1;
+    while (n > 0 && at[n] > cycle)
+        --n;
+    if (at[n] > cycle)
+        return here;
+    // running on from the current state is nearer
+    if (here && at[n] <= cpu->cycle)
+        return 1;
+
+    if (file == NULL) {
+        snapshot_load(mem + n * size);
+    } else {
+        if (fseek(file, (long)n * size, SEEK_SET) != 0
+                || fread(scratch, size, 1, file) != 1)
+            err(1, "Can't read checkpoint");
+        snapshot_load(scratch);
+    }
+    checkpoint_due = (cpu->cycle / interval + 1) * interval;
+    return 1;
+}
+
+void checkpoint_report(void) {
+    if (interval == 0) {
+        printf("Checkpoints are off\n");
+        return;
+    }
+    printf("%u checkpoints every %u cycles, %zu bytes each, %s\n",
+            taken, interval, size, file ? "on disk" : "in memory");
+}
@@ -0,0 +1,26 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include "emu.h"
+
+// a snapshot is the machine state followed by the port backend's state
+size_t snapshot_size(void);
+void snapshot_take(void *buf);
+void snapshot_load(const void *buf);
+
+// cycle of the next checkpoint, ~0 when checkpoints are off
+extern unsigned checkpoint_due;
+
+// checkpoint every interval cycles, to a file or in memory if name is NULL
+void checkpoint_open(unsigned interval, const char *name);
+void checkpoint_take(void);
+// drop every checkpoint, for a new session
+void checkpoint_reset(void);
+// drop checkpoints after the current cycle, when the state has been edited
+void checkpoint_truncate(void);
+// restore the latest checkpoint at or before cycle unless the current state
+// is nearer, returns 0 if neither is
+int checkpoint_restore(unsigned cycle);
+void checkpoint_report(void);
+
+#endif
@@ -4,43 +4,47 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-typedef uint8_t u8;
+#include <time.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "emu.h"
+#include "replay.h"
+#include "romcov.h"
+#include "ips.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
+#include "tui.h"
+#include "validate.h"
 
 int debugger(u8 op, u8 arg);
 void decode(u8 op, u8 arg);
-void save_state(void);
-void restore_state(void);
-
-// ROM
-u8 ROM[0x10][0x40];
-#define FETCH(X) do { (X) = ROM[pc.page][pc.addr]; ++pc.addr; } while (0)
-
-u8 RAM[0x100]; // A-series chips have 2x the RAM of non-A chips
-u8 REG[0x10];
-
-typedef struct _pc_t {
-    u8 page;
-    u8 addr;
-} pc_t;
-
-pc_t pc = { 0, 0 };
-pc_t frame_pc = { 0, 0 };
-pc_t stack[4] = { { 0, }, };
-unsigned sp = 0;
-int interrupt = 0;
-
-u8 A = 0, X = 0;
-u8 BL = 0, BM = 0, SB = 0;
-#define B ((BM << 4) | BL)
-u8 C = 0;
-int skip = 0;
-int port[3] = { 0, 0, 0 };
-int port2_hiz = 1;
+void memo_report(void);
+void fusion_report(void);
+
+sm5_t *sm;
+sm5_state_t *cpu;
+pif_t pif;
+port_backend_t *backend = &toggle_backend;
 
 // debugger control
 int run = 0;
 int trace = 0;
+int batch = 0;      // no debugger, HALT ends the session
+int verbose = 1;    // print port activity
+int finished = 0;   // set by a port backend when the session is over
+unsigned cycle_limit = 0;
+int loop_detect = 0;
+int memo_enabled = 0;
+static int fusion_enabled = 1;
+static int fusion_stats = 0;
+static int tracing = 0;  // writing a binary trace
+static char *romcov_name = NULL;
+static unsigned checkpoint_interval = 1000000;
+static unsigned stats_interval = 1000;
+static int looped = 0;  // the session ended in a state loop
+static int failed = 0;  // the session ended in an error
 
 int do_break = 0;
 pc_t breakpoint = { 0, 0 };
@@ -51,8 +55,6 @@ u8 mem_break_end = 0;
 int hiz_break = 0;
 
 // input data
-unsigned cycle = 0;
-
 int have_data = 0;
 typedef struct _sample_t {
     unsigned ts;
@@ -61,7 +63,7 @@ typedef struct _sample_t {
 sample_t sample[100];
 unsigned total_samples = 0;
 
-static void hexdump(u8 *ptr, unsigned len) {
+static void hexdump_nibbles(u8 (*peek)(const sm5_state_t *, u8), unsigned len) {
     int i;
 
     printf("   ");
@@ -73,507 +75,195 @@ static void hexdump(u8 *ptr, unsigned len) {
     for (i = 0; i < len; ++i) {
         if ((i & 15) == 0)
             printf("%x: ", i / 16);
-        printf("%x ", ptr[i]);
+        printf("%x ", peek(cpu, i));
         if ((i & 15) == 15)
             printf("\n");
     }
 }
 
+static void taint_dump(const u8 *tags, unsigned len) {
+    int i;
 
-////////////////////////////////
-// instruction emulation
-//
-
-
-//////////////////
-// address control
-
-void op_TR(u8 op, u8 arg) {
-    pc.addr = op & 0b111111;
-}
-
-void op_TL(u8 op, u8 arg) {
-    pc.page = ((op & 0xf) << 2) | (arg >> 6);
-    pc.addr = arg & 0b111111;
-}
-
-void op_TRS(u8 op, u8 arg) {
-    if (sp == 4) {
-        printf("overflow!\n");
-        exit(1);
-    }
-    stack[sp] = pc;
-    ++sp;
-    pc.page = 0x1;
-    pc.addr = (op & 0b11111) << 1;
-}
-
-void op_CALL(u8 op, u8 arg) {
-    if (sp == 4) {
-        printf("overflow!\n");
-        exit(1);
-    }
-    stack[sp] = pc;
-    ++sp;
-    pc.page = ((op & 0xf) << 2) | (arg >> 6);
-    pc.addr = arg & 0b111111;
-}
-
-void op_RTN(u8 op, u8 arg) {
-    if (sp == 0) {
-        printf("underflow!\n");
-        exit(1);
+    for (i = 0; i < len; ++i) {
+        if ((i & 15) == 0)
+            printf("%x: ", i / 16);
+        printf("%02x ", tags[i]);
+        if ((i & 15) == 15)
+            printf("\n");
     }
-    --sp;
-    pc = stack[sp];
-}
-
-void op_RTNS(u8 op, u8 arg) {
-    op_RTN(op, arg);
-    skip = 1;
-}
-
-
-////////////////
-// data transfer
-
-void op_LAX(u8 op, u8 arg) {
-    A = op & 0b1111;
-}
-
-void op_LBMX(u8 op, u8 arg) {
-    BM = op & 0b1111;
-}
-
-void op_LBLX(u8 op, u8 arg) {
-    BL = op & 0b1111;
 }
 
-void op_LDA(u8 op, u8 arg) {
-    A = RAM[B];
-    BM ^= op & 0b11;
-}
-
-void op_EXC(u8 op, u8 arg) {
-    u8 tmp = RAM[B];
-
-    RAM[B] = A;
-    A = tmp;
-    BM ^= op & 0b11;
-}
-
-void op_EXCI(u8 op, u8 arg) {
-    u8 tmp = RAM[B];
+// where a RAM (3c) or REG (r5) nibble came from, or everything as masks
+static void taint_report(const char *arg) {
+    const sm5_taint_t *t = sm5_taint(sm);
+    char buf[64];
+    unsigned i;
 
-    RAM[B] = A;
-    A = tmp;
-    if (BL == 0x0F) {
-        BL = 0;
-        skip = 1;
-    } else {
-        ++BL;
+    if (t == NULL) {
+        printf("Error: built without TAINT=1\n");
+        return;
     }
-    BM ^= op & 0b11;
-}
-
-void op_EXCD(u8 op, u8 arg) {
-    u8 tmp = RAM[B];
-
-    RAM[B] = A;
-    A = tmp;
-    if (BL == 0) {
-        BL = 0xF;
-        skip = 1;
-    } else {
-        --BL;
+    if (arg != NULL) {
+        if (strcmp(arg, "clear") == 0) {
+            sm5_taint_clear(sm);
+        } else if (arg[0] == 'r') {
+            i = strtoul(arg + 1, NULL, 16) & 0xf;
+            printf("REG %x: %s\n", i, sm5_taint_name(t->reg[i], buf, sizeof(buf)));
+        } else {
+            i = strtoul(arg, NULL, 16) & 0xff;
+            printf("RAM %02x: %s\n", i, sm5_taint_name(t->ram[i], buf, sizeof(buf)));
+        }
+        return;
     }
-    BM ^= op & 0b11;
-}
-
-void op_EXAX(u8 op, u8 arg) {
-    u8 tmp = X;
-    X = A;
-    A = tmp;
-}
 
-void op_ATX(u8 op, u8 arg) {
-    X = A;
+    printf("A  %s\n", sm5_taint_name(t->A, buf, sizeof(buf)));
+    printf("X  %s\n", sm5_taint_name(t->X, buf, sizeof(buf)));
+    printf("BM %s\n", sm5_taint_name(t->BM, buf, sizeof(buf)));
+    printf("BL %s\n", sm5_taint_name(t->BL, buf, sizeof(buf)));
+    printf("SB %s\n", sm5_taint_name(t->SB, buf, sizeof(buf)));
+    printf("C  %s\n", sm5_taint_name(t->C, buf, sizeof(buf)));
+    printf("flow %s\n", sm5_taint_name(t->flow, buf, sizeof(buf)));
+    printf("masks: %02x port  %02x dta  %02x pat  %02x const  %02x host\n",
+            SM5_TAINT_PORT, SM5_TAINT_DTA, SM5_TAINT_PAT, SM5_TAINT_CONST, SM5_TAINT_HOST);
+    printf("RAM\n");
+    taint_dump(t->ram, sm5_variant(sm)->ram_size);
+    printf("REG\n");
+    taint_dump(t->reg, 0x10);
 }
 
-void op_EXBM(u8 op, u8 arg) {
-    u8 tmp = A;
-    A = BM;
-    BM = tmp;
-}
-
-void op_EXBL(u8 op, u8 arg) {
-    u8 tmp = A;
-    A = BL;
-    BL = tmp;
-}
-
-void op_EX(u8 op, u8 arg) {
-    u8 tmp = SB;
-    SB = B;
-    BM = tmp >> 4;
-    BL = tmp & 0xf;
-}
 
+////////////////////////////////
+// emulation
+//
 
-/////////////
-// arithmetic
-
-void op_ADX(u8 op, u8 arg) {
-    A = A + (op & 0b1111);
-    if (A >= 0x10) {
-        A %= 0x10;
-        skip = 1;
-    }
-}
-
-void op_ADD(u8 op, u8 arg) {
-    A = (A + RAM[B]) % 0x10;
+// the core reports port activity here
+static int port_read(void *ctx, sm5_t *s, unsigned num) {
+    if (verbose)
+        printf("%8u checking port %d [%d]\n", cpu->cycle, num, cpu->port[num]);
+    return backend->read(num);
 }
 
-void op_ADC(u8 op, u8 arg) {
-    A = A + RAM[B] + C;
-    if (A >= 0x10) {
-        A %= 0x10;
-        C = 1;
-        skip = 1;
+static void port_write(void *ctx, sm5_t *s, u8 reg, u8 val) {
+    if (reg == SM5_OUTL) {
+        if (verbose)
+            printf("setting port0 to %x\n", val);
     } else {
-        C = 0;
+        if (verbose && reg == 0xf) {
+            printf("%8u port write hiz\n", cpu->cycle);
+            printf("%8u port 2 write %x\n", cpu->cycle, cpu->port2_hiz ? 1 : cpu->port[0]);
+        } else if (verbose && reg == 2 && !cpu->port2_hiz) {
+            printf("%8u port 2 write %x\n", cpu->cycle, cpu->port[0]);
+        }
+        if (tui_on)
+            tui_port_write(reg);
     }
+    if (backend->write)
+        backend->write(reg, val);
 }
 
-void op_COMA(u8 op, u8 arg) {
-    A = (~A) & 0xf;
+// end the session from a port backend
+void finish(void) {
+    finished = 1;
+    sm5_stop(sm);
 }
 
-void op_INCB(u8 op, u8 arg) {
-    ++BL;
-    if (BL == 0x10) {
-        BL = 0;
-        skip = 1;
-    }
-}
+static void end_session(int status) {
+    sm5_loop_t loop;
 
-void op_DECB(u8 op, u8 arg) {
-    --BL;
-    if (BL == 0xFF) {
-        BL = 0xF;
-        skip = 1; // FIXME test
+    if (status == SM5_LOOP) {
+        looped = 1;
+        sm5_loop_info(sm, &loop);
+        printf("State loop: period %llu instructions (%u cycles), entered %s cycle %u\n",
+                loop.period, loop.period_cycles, loop.entry_exact ? "at" : "by", loop.entry_cycle);
+    } else if (status < 0) {
+        failed = 1;
+        printf("%x.%02x: %s\n", cpu->pc.page, cpu->pc.addr, sm5_strerror(status));
+    } else if (status == SM5_HALT && !batch) {
+        printf("Halted\n");
     }
-}
-
-
-///////
-// test
 
-void op_TC(u8 op, u8 arg) {
-    if (C)
-        skip = 1;
+    if (batch)
+        finished = 1;
+    else
+        run = 0;
 }
 
-void op_TAM(u8 op, u8 arg) {
-    if (A == RAM[B])
-        skip = 1;
-}
-
-void op_TM(u8 op, u8 arg) {
-    if (RAM[B] & (1 << (op & 0b11)))
-        skip = 1;
-}
-
-void op_TABL(u8 op, u8 arg) {
-    if (A == BL)
-        skip = 1;
-}
-
-void op_TPB(u8 op, u8 arg) {
-    u8 num = op & 0b11;
-
-    printf("%8u checking port %d [%d]\n", cycle, num, port[num]);
-
-    if (num == 1) {
-        if (have_data) {
-            int i;
-            for (i = 0; i < total_samples-1; ++i)
-                if (sample[i+1].ts > cycle)
-                    break;
-            printf("using sample %d / %d\n", i+1, total_samples);
-            port[1] = sample[i].in;
-        } else { // flip bit on each call
-            port[1] = 1 - port[1];
+void emulate(void) {
+    u8 op, arg;
+    unsigned len;
+    int status;
+
+    while (!finished) {
+        if (cpu->cycle >= checkpoint_due)
+            checkpoint_take();
+        if (stats_on)
+            stats_poll();
+
+        if (batch && !tracing) {
+            // the cycle limit is the only reason to come back between events
+            status = sm5_run(sm, cycle_limit ? cycle_limit - cpu->cycle : 0);
+            if (status == SM5_OK)
+                finished = 1;
+        } else {
+            // the debugger shows the instruction about to run
+            cpu->frame_pc = cpu->pc;
+            len = sm5_fetch(sm, &op, &arg);
+            if (!batch && !debugger(op, arg)) {
+                printf("skipping\n");
+                continue;
+            }
+            if (tracing)
+                trace_step(cpu, op, arg, len);
+            status = sm5_step(sm);
         }
-    }
-
-    if (num == 0) {
-        skip = 1;
-        return;
-    }
-
-    if (port[num])
-        skip = 1;
-}
-
-
-///////////////////
-// bit manipulation
 
-void op_RM(u8 op, u8 arg) {
-    u8 mask = 1 << (op & 0b11);
-    RAM[B] &= ~mask;
-}
-
-void op_SM(u8 op, u8 arg) {
-    u8 mask = 1 << (op & 0b11);
-    RAM[B] |= mask;
-}
-
-void op_SC(u8 op, u8 arg) {
-    C = 1;
-}
-
-void op_RC(u8 op, u8 arg) {
-    C = 0;
-}
-
-void op_ID(u8 op, u8 arg) {
-    // TODO
-}
+        if (status != SM5_OK && status != SM5_STOPPED)
+            end_session(status);
 
-void op_IE(u8 op, u8 arg) {
-    // TODO
-}
-
-
-/////////////
-// IO control
-
-void op_OUTL(u8 op, u8 arg) {
-    printf("setting port0 to %x\n", A);
-}
-
-void op_OUT(u8 op, u8 arg) {
-    REG[BL] = A;
-    if (BL == 0xf) {
-        port2_hiz = A ? 0 : 1;
-        printf("%8u port write hiz\n", cycle);
-        printf("%8u port 2 write %x\n", cycle, port2_hiz ? 1 : port[0]);
-    } else if (BL == 2) {
-        port[0] = A;
-        if (!port2_hiz)
-            printf("%8u port 2 write %x\n", cycle, port[0]);
+        if (cycle_limit && cpu->cycle >= cycle_limit)
+            finished = 1;
     }
 }
 
-
-/////////
-// others
-
-// load from ROM
-void op_PAT(u8 op, u8 arg) {
-    pc_t load;
-    u8 romval;
-
-    load.page = 4;
-    load.addr = ((X & 0b11) << 4) | A;
-
-    romval = ROM[load.page][load.addr];
-    X = romval >> 4;
-    A = romval & 0xf;
-}
-
-// read from secret ROM
-void op_DTA(u8 op, u8 arg) {
-    static u8 secret[8] = { 0xFC, 0xFC, 0xA5, 0x6C, 0x03, 0x8F, 0x1B, 0x9A };
-    u8 offset, BL_t;
-
-    if (BM >= 4 && BM <= 7) {
-        offset = (BM - 4) * 2;
-        if (BL < 8) {
-            BL_t = BL;
-        } else {
-            BL_t = BL - 8;
-            ++offset;
+// run quietly up to cycle, taking checkpoints on the way
+static void run_to(unsigned target) {
+    int saved_verbose = verbose;
+    FILE *saved_log = pif.log;
+    unsigned budget;
+    int status;
+
+    verbose = 0;
+    pif.log = NULL;
+    while (!finished && cpu->cycle < target) {
+        if (cpu->cycle >= checkpoint_due)
+            checkpoint_take();
+        budget = target - cpu->cycle;
+        if (checkpoint_due - cpu->cycle < budget)
+            budget = checkpoint_due - cpu->cycle;
+        status = sm5_run(sm, budget);
+        if (status != SM5_OK && status != SM5_STOPPED) {
+            end_session(status);
+            break;
         }
-
-        skip = (secret[offset] >> BL_t) & 1;
     }
+    verbose = saved_verbose;
+    pif.log = saved_log;
 }
 
-// halt
-void op_HALT(u8 op, u8 arg) {
-    printf("Halted\n");
-    run = 0;
-}
-
-
-typedef void (*op_handler_t)(u8 op, u8 arg);
-
-void op_NOP(u8 op, u8 arg) {
-    // do nuttin
-}
-
-void emulate(void) {
-    u8 op = 0, arg = 0;
-    op_handler_t handler = op_NOP;
-    int execute = 1;
-
-    while (1) {
-        // FIXME this is a nasty, ugly hack
-        if (execute)
-            frame_pc = pc;
-        else
-            --pc.addr;
-        FETCH(op);
-        // TODO check overflow
-
-        // NOP
-        if (op == 0x00) {
-            handler = op_NOP;
-        }
-
-        // address control
-        else if (op >= 0x80 && op <= 0xBF) {
-            handler = op_TR;
-        } else if (op >= 0xE0 && op <= 0xEF) {
-            FETCH(arg);
-            handler = op_TL;
-        } else if (op >= 0xC0 && op <= 0xDF) {
-            handler = op_TRS;
-        } else if (op >= 0xF0 && op <= 0xFF) {
-            FETCH(arg);
-            handler = op_CALL;
-        } else if (op == 0x7D) {
-            handler = op_RTN;
-        } else if (op == 0x7E) {
-            handler = op_RTNS;
-        } else if (op == 0x7F) {
-            handler = op_RTN; // XXX does this need any other side effects?
-        }
-
-        // data transfer
-        else if (op >= 0x10 && op <= 0x1F) {
-            handler = op_LAX;
-        } else if (op >= 0x30 && op <= 0x3F) {
-            handler = op_LBMX;
-        } else if (op >= 0x20 && op <= 0x2F) {
-            handler = op_LBLX;
-        } else if (op >= 0x50 && op <= 0x53) {
-            handler = op_LDA;
-        } else if (op >= 0x54 && op <= 0x57) {
-            handler = op_EXC;
-        } else if (op >= 0x58 && op <= 0x5B) {
-            handler = op_EXCI;
-        } else if (op >= 0x5C && op <= 0x5F) {
-            handler = op_EXCD;
-        } else if (op == 0x64) {
-            handler = op_EXAX;
-        } else if (op == 0x65) {
-            handler = op_ATX;
-        } else if (op == 0x66) {
-            handler = op_EXBM;
-        } else if (op == 0x67) {
-            handler = op_EXBL;
-        } else if (op == 0x68) {
-            handler = op_EX;
-        }
-
-        // arithmetic
-        else if (op >= 0x00 && op <= 0x0F) {
-            handler = op_ADX;
-        } else if (op == 0x7A) {
-            handler = op_ADD;
-        } else if (op == 0x7B) {
-            handler = op_ADC;
-        } else if (op == 0x79) {
-            handler = op_COMA;
-        } else if (op == 0x78) {
-            handler = op_INCB;
-        } else if (op == 0x7C) {
-            handler = op_DECB;
-        }
-
-        // test
-        else if (op == 0x6E) {
-            handler = op_TC;
-        } else if (op == 0x6F) {
-            handler = op_TAM;
-        } else if (op >= 0x48 && op <= 0x4B) {
-            handler = op_TM;
-        } else if (op == 0x6B) {
-            handler = op_TABL;
-        } else if (op >= 0x4C && op <= 0x4F) {
-            handler = op_TPB;
-        }
-
-        // bit manip
-        else if (op >= 0x40 && op <= 0x43) {
-            handler = op_RM;
-        } else if (op >= 0x44 && op <= 0x47) {
-            handler = op_SM;
-        } else if (op == 0x61) {
-            handler = op_SC;
-        } else if (op == 0x60) {
-            handler = op_RC;
-        } else if (op == 0x62) {
-            handler = op_ID;
-        } else if (op == 0x63) {
-            handler = op_IE;
-        }
-
-        // io control
-        else if (op == 0x71) {
-            handler = op_OUTL;
-        } else if (op == 0x75) {
-            handler = op_OUT;
-        }
-
-
-        // unknown
-        else if (op == 0x6A) {
-            FETCH(arg);
-            handler = op_PAT;
-        } else if (op == 0x69) {
-            FETCH(arg);
-            handler = op_DTA;
-        }
-
-        // special
-        else if (op == 0x77) {
-            handler = op_HALT;
-        }
-
-
-        else {
-            printf("nope %02x\n", op);
-            abort();
-        }
-
-        execute = debugger(op, arg);
-        if (!execute) {
-            printf("skipping\n");
-            continue;
-        }
-
-        if (interrupt) {
-            stack[sp] = pc;
-            ++sp;
-            pc.page = 0x2;
-            pc.addr = 0;
-            interrupt = 0;
-        } else {
-            cycle += pc.addr - frame_pc.addr;
-
-            if (!skip) {
-                handler(op, arg);
-            } else {
-                skip = 0;
-            }
-        }
+// returns 0 if the state is unchanged
+static int seek(unsigned target) {
+    if (tracing) {
+        printf("Error: can't seek while writing a trace\n");
+        return 0;
+    }
+    if (!checkpoint_restore(target)) {
+        printf("Error: no checkpoint before cycle %u\n", target);
+        return 0;
     }
+    run_to(target);
+    if (finished)
+        printf("Session ended at cycle %u\n", cpu->cycle);
+    return 1;
 }
 
 
@@ -583,16 +273,20 @@ void emulate(void) {
 
 
 
+void print_state(void) {
+    printf("  PC=%x.%02x A=%x X=%x BM=%x BL=%x SB=%02x C=%d SP=%d skip=%d\n",
+            cpu->frame_pc.page, cpu->frame_pc.addr, cpu->A, cpu->X, cpu->BM, cpu->BL, cpu->SB, cpu->C, cpu->sp, cpu->skip);
+    printf("  P0=%x P1=%x P2=%x hiz=%d   cycle=%u div=%u\n", cpu->port[0], cpu->port[1], cpu->port[2], cpu->port2_hiz, cpu->cycle, (cpu->cycle / 2) & 0x7fff);
+}
+
 int debugger(u8 op, u8 arg) {
     char buf[4096];
     char *tokens[16], *token;
     int i = 0, num = 0;
 
     while (1) {
-        // TODO detect goto self condition and break execution
-
         // breakpoint
-        if (do_break && frame_pc.page == breakpoint.page && frame_pc.addr == breakpoint.addr) {
+        if (do_break && cpu->frame_pc.page == breakpoint.page && cpu->frame_pc.addr == breakpoint.addr) {
             run = 0;
             printf("Breakpoint\n");
         }
@@ -609,7 +303,7 @@ int debugger(u8 op, u8 arg) {
         }
 
         // break on Hi-Z
-        if (hiz_break && op == 0x75 && BL == 0xF) {
+        if (hiz_break && op == 0x75 && cpu->BL == 0xF) {
             run = 0;
         }
 
@@ -617,12 +311,9 @@ int debugger(u8 op, u8 arg) {
         if (run && !trace)
             break;
 
-        printf("%x.%02x : ", frame_pc.page, frame_pc.addr);
+        printf("%x.%02x : ", cpu->frame_pc.page, cpu->frame_pc.addr);
         decode(op, arg);
-
-        printf("  PC=%x.%02x A=%x X=%x BM=%x BL=%x SB=%02x C=%d SP=%d skip=%d\n",
-                frame_pc.page, frame_pc.addr, A, X, BM, BL, SB, C, sp, skip);
-        printf("  P0=%x P1=%x P2=%x hiz=%d   cycle=%u div=%u\n", port[0], port[1], port[2], port2_hiz, cycle, (cycle / 2) & 0x7fff);
+        print_state();
 
         if (run)
             break;
@@ -665,12 +356,14 @@ int debugger(u8 op, u8 arg) {
                 else if (val > 0xf)
                     printf("Error: value must be between 0 and f\n");
                 else
-                    port[portnum] = val;
+                    cpu->port[portnum] = val;
+                sm5_invalidate(sm);
+                checkpoint_truncate();
             }
         } else if (strcmp(tokens[0], "q") == 0 || strcmp(tokens[0], "quit") == 0) {
             exit(0);
         } else if (strcmp(tokens[0], "m") == 0) {
-            hexdump(RAM, 0x100);
+            hexdump_nibbles(sm5_ram_peek, 0x100);
         } else if (strcmp(tokens[0], "r") == 0) {
             run = 1;
             break;
@@ -679,7 +372,7 @@ int debugger(u8 op, u8 arg) {
                 printf("Error: b requires one or two args\n");
                 do_break = 0;
             } else if (num < 3) {
-                breakpoint.page = pc.page;
+                breakpoint.page = cpu->pc.page;
                 breakpoint.addr = strtoul(tokens[1], NULL, 16);
                 do_break = 1;
             } else {
@@ -692,8 +385,8 @@ int debugger(u8 op, u8 arg) {
         } else if (strcmp(tokens[0], "cb") == 0) {
             do_break = 0;
         } else if (strcmp(tokens[0], "sp") == 0) {
-            for (i = 0; i < sp; ++i)
-                printf("  SP[%d] %x.%02x\n", i, stack[i].page, stack[i].addr);
+            for (i = 0; i < cpu->sp; ++i)
+                printf("  SP[%d] %x.%02x\n", i, cpu->stack[i].page, cpu->stack[i].addr);
         } else if (strcmp(tokens[0], "mb") == 0) {
             if (num < 2) {
                 printf("Error: mb requires one or two args\n");
@@ -713,7 +406,9 @@ int debugger(u8 op, u8 arg) {
             trace = 1 - trace;
             printf("Trace %sabled\n", trace ? "en" : "dis");
         } else if (strcmp(tokens[0], "skip") == 0) {
-            skip = 1 - skip;
+            cpu->skip = 1 - cpu->skip;
+            sm5_invalidate(sm);
+            checkpoint_truncate();
         } else if (strcmp(tokens[0], "hiz") == 0) {
             hiz_break = 1 - hiz_break;
             printf("Hi-Z break %sabled\n", hiz_break ? "en" : "dis");
@@ -721,141 +416,76 @@ int debugger(u8 op, u8 arg) {
             if (num < 3) {
                 printf("Error: poke requires two args\n");
             } else {
-                RAM[strtoul(tokens[1], NULL, 16)] = strtoul(tokens[2], NULL, 16);
+                sm5_poke(sm, strtoul(tokens[1], NULL, 16), strtoul(tokens[2], NULL, 16));
+                checkpoint_truncate();
+            }
+        } else if (strcmp(tokens[0], "rpoke") == 0) {
+            if (num < 4) {
+                printf("Error: rpoke requires three args\n");
+            } else {
+                int status = sm5_rom_poke(sm, strtoul(tokens[1], NULL, 16),
+                        strtoul(tokens[2], NULL, 16), strtoul(tokens[3], NULL, 16));
+                if (status != SM5_OK) {
+                    printf("Error: %s\n", sm5_strerror(status));
+                } else {
+                    // the instruction about to run may have changed
+                    checkpoint_truncate();
+                    return 0;
+                }
+            }
+        } else if (strcmp(tokens[0], "ips") == 0) {
+            if (num < 2) {
+                printf("Error: ips requires one arg\n");
+            } else {
+                long n = ips_apply(sm, tokens[1]);
+                if (n >= 0) {
+                    printf("patched %ld bytes\n", n);
+                    checkpoint_truncate();
+                    return 0;
+                }
             }
         } else if (strcmp(tokens[0], "save") == 0) {
             save_state();
         } else if (strcmp(tokens[0], "restore") == 0) {
             restore_state();
+            checkpoint_truncate();
             return 0;
+        } else if (strcmp(tokens[0], "seek") == 0) {
+            if (num < 2)
+                printf("Error: seek requires one arg\n");
+            else if (seek(strtoul(tokens[1], NULL, 0)))
+                return 0;
+        } else if (strcmp(tokens[0], "checkpoints") == 0) {
+            checkpoint_report();
         } else if (strcmp(tokens[0], "interrupt") == 0) {
-            interrupt = 1;
+            cpu->interrupt = 1;
+            checkpoint_truncate();
         } else if (strcmp(tokens[0], "reg") == 0) {
-            hexdump(REG, 0x10);
+            hexdump_nibbles(sm5_reg_peek, 0x10);
+        } else if (strcmp(tokens[0], "loop") == 0) {
+            loop_detect = 1 - loop_detect;
+            sm5_loop_detect(sm, loop_detect);
+            printf("Loop detection %sabled\n", loop_detect ? "en" : "dis");
+        } else if (strcmp(tokens[0], "taint") == 0) {
+            taint_report(num > 1 ? tokens[1] : NULL);
+        } else if (strcmp(tokens[0], "hash") == 0) {
+            printf("state hash %016llx\n", (unsigned long long)sm5_hash(sm));
+        } else if (strcmp(tokens[0], "stats") == 0) {
+            stats_report();
         }
     }
     return 1;
 }
 
 void decode(u8 op, u8 arg) {
-    // NOP
-    if (op == 0x00) {
-        printf("nop\n");
-    }
-
-    // control
-    else if (op >= 0x80 && op <= 0xBF) {
-        printf("tr %02x\n", op & 0b111111);
-    } else if (op >= 0xE0 && op <= 0xEF) {
-        printf("tl %x.%02x\n", ((op & 0xf) << 2) | (arg >> 6), arg & 0b111111);
-    } else if (op >= 0xC0 && op <= 0xDF) {
-        printf("trs %x\n", op & 0b11111);
-    } else if (op >= 0xF0 && op <= 0xFF) {
-        printf("call %x.%02x\n", ((op & 0xf) << 2) | (arg >> 6), arg & 0b111111);
-    } else if (op == 0x7D) {
-        printf("rtn\n");
-    } else if (op == 0x7E) {
-        printf("rtns\n");
-    } else if (op == 0x7F) {
-        printf("rtni\n");
-    }
-
-    // data transfer
-    else if (op >= 0x10 && op <= 0x1F) {
-        printf("lax %x\n", op & 0b1111);
-    } else if (op >= 0x30 && op <= 0x3F) {
-        printf("lbmx %x\n", op & 0b1111);
-    } else if (op >= 0x20 && op <= 0x2F) {
-        printf("lblx %x\n", op & 0b1111);
-    } else if (op >= 0x50 && op <= 0x53) {
-        printf("lda %x\n", op & 0b11);
-    } else if (op >= 0x54 && op <= 0x57) {
-        printf("exc %x\n", op & 0b11);
-    } else if (op >= 0x58 && op <= 0x5B) {
-        printf("exci %x\n", op & 0b11);
-    } else if (op >= 0x5C && op <= 0x5F) {
-        printf("excd %d\n", op & 0b11);
-    } else if (op == 0x64) {
-        printf("exax\n");
-    } else if (op == 0x65) {
-        printf("atx\n");
-    } else if (op == 0x66) {
-        printf("exbm\n");
-    } else if (op == 0x67) {
-        printf("exbl\n");
-    } else if (op == 0x68) {
-        printf("ex\n");
-    }
-
-    // arithmetic
-    else if (op >= 0x00 && op <= 0x0F) {
-        printf("adx %x\n", op & 0b1111);
-    } else if (op == 0x7A) {
-        printf("add\n");
-    } else if (op == 0x7B) {
-        printf("adc\n");
-    } else if (op == 0x79) {
-        printf("coma\n");
-    } else if (op == 0x78) {
-        printf("incb\n");
-    } else if (op == 0x7C) {
-        printf("decb\n");
-    }
-
-    // test
-    else if (op == 0x6E) {
-        printf("tc\n");
-    } else if (op == 0x6F) {
-        printf("tam\n");
-    } else if (op >= 0x48 && op <= 0x4B) {
-        printf("tm %x\n", op & 0b11);
-    } else if (op == 0x6B) {
-        printf("tabl\n");
-    } else if (op >= 0x4C && op <= 0x4F) {
-        printf("tpb %x\n", op & 0b11);
-    }
-
-    // bit manip
-    else if (op >= 0x40 && op <= 0x43) {
-        printf("rm %x\n", op & 0b11);
-    } else if (op >= 0x44 && op <= 0x47) {
-        printf("sm %x\n", op & 0b11);
-    } else if (op == 0x61) {
-        printf("sc\n");
-    } else if (op == 0x60) {
-        printf("rc\n");
-    } else if (op == 0x62) {
-        printf("id\n");
-    } else if (op == 0x63) {
-        printf("ie\n");
-    }
-
-    // io control
-    else if (op == 0x71) {
-        printf("outl\n");
-    } else if (op == 0x75) {
-        printf("out\n");
-    }
+    char buf[32];
 
-    // unknown
-    else if (op == 0x6A) {
-        printf("pat %x\n", arg);
-    } else if (op == 0x69) {
-        printf("dta\n");
-    }
-
-    // special
-    else if (op == 0x77) {
-        printf("halt\n");
-    }
-
-
-    else {
-        printf("unknown\n");
-    }
+    sm5_disasm(op, arg, buf, sizeof(buf));
+    printf("%s\n", buf);
 }
 
 void save_state(void) {
+    u8 buf[snapshot_size()];
     FILE *file;
     char *name = "state";
 
@@ -863,50 +493,35 @@ void save_state(void) {
     if (file == NULL)
         err(1, "Can't open %s", name);
 
-#define DUMP(X) fwrite(&X, sizeof(X), 1, file)
-
-    fwrite(RAM, sizeof(RAM), 1, file);
-    fwrite(REG, sizeof(REG), 1, file);
-    DUMP(pc);
-    DUMP(frame_pc);
-    DUMP(stack);
-    DUMP(sp);
-    DUMP(A);
-    DUMP(X);
-    DUMP(BM);
-    DUMP(BL);
-    DUMP(SB);
-    DUMP(C);
-    DUMP(skip);
-    DUMP(cycle);
+    snapshot_take(buf);
+    fwrite(buf, sizeof(buf), 1, file);
 
     fclose(file);
 }
 
 void restore_state(void) {
+    u8 buf[snapshot_size()];
+    sm5_state_t state;
     FILE *file;
     char *name = "state";
+    size_t len;
 
     file = fopen(name, "r");
     if (file == NULL)
         err(1, "Can't open %s", name);
 
-#define LOAD(X) fread(&X, sizeof(X), 1, file)
-
-    fread(RAM, sizeof(RAM), 1, file);
-    fread(REG, sizeof(REG), 1, file);
-    LOAD(pc);
-    LOAD(frame_pc);
-    LOAD(stack);
-    LOAD(sp);
-    LOAD(A);
-    LOAD(X);
-    LOAD(BM);
-    LOAD(BL);
-    LOAD(SB);
-    LOAD(C);
-    LOAD(skip);
-    LOAD(cycle);
+    // a state saved under another port backend still has the machine state
+    len = fread(buf, 1, sizeof(buf), file);
+    if (len == sizeof(buf)) {
+        snapshot_load(buf);
+    } else if (len >= sizeof(state)) {
+        warnx("%s was saved with another port backend", name);
+        memcpy(&state, buf, sizeof(state));
+        sm5_restore(sm, &state);
+        finished = 0;
+    } else {
+        warnx("%s is short", name);
+    }
 
     fclose(file);
 }
@@ -920,7 +535,7 @@ void load_data(char *name) {
         err(1, "Can't open %s", name);
 
     while (fscanf(file, "%u,%u,%u,%u", &ts, &cic_in, &foo, &foo2) == 4) {
-        sample[total_samples].ts = (ts - 10240625) / 1250; // nanoseconds -> cycles
+        sample[total_samples].ts = NS_TO_CYCLES(ts);
         sample[total_samples].in = cic_in;
         ++total_samples;
     }
@@ -928,46 +543,458 @@ void load_data(char *name) {
     fclose(file);
 }
 
+// port 1 replays the logic analyzer capture
+static int capture_read(unsigned num) {
+    int i;
+
+    if (num != 1)
+        return cpu->port[num];
+
+    for (i = 0; i < total_samples-1; ++i)
+        if (sample[i+1].ts > cpu->cycle)
+            break;
+    if (verbose)
+        printf("using sample %d / %d\n", i+1, total_samples);
+    return sample[i].in;
+}
+
+port_backend_t capture_backend = {
+    .name = "capture",
+    .read = capture_read,
+};
+
+// port 1 flips on each call
+static int toggle_read(unsigned num) {
+    if (num != 1)
+        return cpu->port[num];
+    return 1 - cpu->port[1];
+}
+
+port_backend_t toggle_backend = {
+    .name = "toggle",
+    .read = toggle_read,
+};
+
+// the PIF model drives port 1 and senses port 2
+static void pif_backend_reset(void) {
+    pif.log = verbose ? stdout : NULL;
+    pif_reset(&pif);
+}
+
+static void pif_backend_save(void *buf) {
+    memcpy(buf, &pif, sizeof(pif));
+}
+
+static void pif_backend_restore(const void *buf) {
+    FILE *log = pif.log;
+
+    memcpy(&pif, buf, sizeof(pif));
+    pif.log = log;
+}
+
+static int pif_backend_read(unsigned num) {
+    int level = pif_read(&pif, sm, num);
+
+    if (pif.result.state == PIF_DONE || pif.result.state == PIF_FAIL)
+        finish();
+    return level;
+}
+
+port_backend_t pif_backend = {
+    .name = "pif",
+    .reset = pif_backend_reset,
+    .read = pif_backend_read,
+    .state_size = sizeof(pif_t),
+    .save = pif_backend_save,
+    .restore = pif_backend_restore,
+};
+
+void reset_state(void) {
+    sm5_reset(sm);
+    checkpoint_reset();
+    finished = 0;
+    looped = 0;
+    failed = 0;
+    ++stats_sessions;
+
+    if (backend->reset)
+        backend->reset();
+}
+
+// run back-to-back PIF sessions with no debugger
+void soak(unsigned sessions) {
+    pif_result_t first;
+    unsigned i, ok = 0, fail = 0, timeout = 0, hang = 0, error = 0, mismatch = 0;
+    unsigned long long total_cycles = 0;
+    struct timespec start, end;
+    double secs;
+
+    batch = 1;
+    verbose = 0;
+    run = 1;
+    if (memo_enabled)
+        sm5_memo_enable(sm, 1);
+    if (cycle_limit == 0)
+        cycle_limit = 10000000;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < sessions; ++i) {
+        reset_state();
+        emulate();
+        total_cycles += cpu->cycle;
+
+        if (pif.result.state == PIF_DONE)
+            ++ok;
+        else if (pif.result.state == PIF_FAIL)
+            ++fail;
+        else if (looped)
+            ++hang;
+        else if (failed)
+            ++error;
+        else
+            ++timeout;
+
+        if (i == 0)
+            first = pif.result;
+        else if (first.hello != pif.result.hello
+                || memcmp(first.seed, pif.result.seed, sizeof(first.seed)) != 0
+                || memcmp(first.checksum, pif.result.checksum, sizeof(first.checksum)) != 0)
+            ++mismatch;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("sessions %u ok %u fail %u timeout %u hang %u error %u mismatch %u\n",
+            sessions, ok, fail, timeout, hang, error, mismatch);
+    if (sessions > 0) {
+        printf("hello %x seed ", first.hello);
+        for (i = 0; i < 6; ++i)
+            printf("%x", first.seed[i]);
+        printf(" checksum ");
+        for (i = 0; i < 16; ++i)
+            printf("%x", first.checksum[i]);
+        printf("\n");
+        printf("%.1f cycles/session, %.0f sessions/s, %.0f sessions/h\n",
+                (double)total_cycles / sessions, sessions / secs, sessions / secs * 3600);
+    }
+    if (memo_enabled)
+        memo_report();
+    if (fusion_stats)
+        fusion_report();
+}
+
+void memo_report(void) {
+    sm5_memo_stats_t stats;
+
+    sm5_memo_stats(sm, &stats);
+    printf("memo: %u entries, %llu hits, %llu misses, %llu cycles skipped\n",
+            stats.entries, stats.hits, stats.misses, stats.saved_cycles);
+}
+
+void fusion_report(void) {
+    sm5_fusion_stat_t stats[32];
+    unsigned i, n;
+
+    if (!fusion_enabled) {
+        printf("fusion: off\n");
+        return;
+    }
+    n = sm5_fusion_stats(sm, stats, 32);
+    for (i = 0; i < n && i < 32; ++i)
+        if (stats[i].sites > 0)
+            printf("fusion: %-14s %3u sites %12llu fired\n",
+                    stats[i].name, stats[i].sites, stats[i].fired);
+}
+
+static void trace_end(void) {
+    trace_close(cpu);
+}
+
+static void romcov_end(void) {
+    sm5_romcov_t cov;
+
+    memset(&cov, 0, sizeof(cov));
+    sm5_romcov_merge(sm, &cov);
+    switch (romcov_merge_file(romcov_name, &cov, romcov_rom_id(sm))) {
+        case 0:
+            warn("Can't write %s", romcov_name);
+            break;
+        case -1:
+            warnx("%s is coverage of another ROM, not updated", romcov_name);
+            break;
+    }
+}
+
 void stop_run(int signum) {
     run = 0;
 }
 
+static void usage(char *prog) {
+    const sm5_variant_t *const *v;
+
+    printf("Usage: %s [options] <rom.bin> [<data.csv>]\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("    -p <capture|toggle|pif>  port backend\n");
+    printf("    -n <sessions>            soak test: run PIF sessions without debugger\n");
+    printf("    -c <rounds>              PIF challenge/response rounds per session\n");
+    printf("    -l <cycles>              cycle limit per session\n");
+    printf("    -w <log>                 record port I/O to log\n");
+    printf("    -t <trace>               write a binary execution trace (see sm5trace)\n");
+    printf("    -C <coverage>            merge ROM coverage into a file (see sm5cov)\n");
+    printf("    -R <log>                 replay and check port I/O from log\n");
+    printf("    -V <trace>               validate port 2 output against a capture\n");
+    printf("    -T <cycles>              timing tolerance for -V\n");
+    printf("    -L                       stop on state loops\n");
+    printf("    -M                       memoize pure subroutines (no debugger)\n");
+    printf("    -F                       report superinstructions fired (no debugger)\n");
+    printf("    -f                       don't fuse superinstructions\n");
+    printf("    -m <variant>             SM5 variant (default %s)\n", sm5_variants()[0]->name);
+    printf("    -I <patch.ips>           patch the ROM after loading it\n");
+    printf("    -k <cycles>              checkpoint interval for seek, 0 for none (default %u)\n", checkpoint_interval);
+    printf("    -K <file>                keep checkpoints in file instead of memory\n");
+    printf("    -u                       full screen UI instead of the debugger\n");
+    printf("    -s                       answer 6105 challenges on stdin/stdout\n");
+    printf("    -S <socket>              answer 6105 challenges on a Unix socket\n");
+    printf("    -P <instances>           instances answering challenges (default one per CPU)\n");
+    printf("    -j <fd>                  write counters to fd as JSON lines\n");
+    printf("    -J <ms>                  interval between -j lines, 0 for the last only (default %u)\n", stats_interval);
+    printf("\n");
+    printf("Variants:");
+    for (v = sm5_variants(); *v != NULL; ++v)
+        printf(" %s", (*v)->name);
+    printf("\n");
+    printf("\n");
+    printf("sm5emu was written by Mike Ryan\n");
+    printf("See README for usage details\n");
+}
+
 int main(int argc, char **argv) {
-    FILE *rom_file = NULL;
-    int i;
-    size_t r;
+    sm5_image_t *image;
+    int opt;
+    char *backend_name = NULL, *variant_name = NULL;
+    char *record_name = NULL, *replay_name = NULL, *validate_name = NULL;
+    char *trace_name = NULL, *checkpoint_name = NULL, *patch_name = NULL;
+    unsigned tolerance = 0;
+    int sessions = -1, stats_fd = -1, pif_session, ok, use_tui = 0, server = 0;
+    char *socket_name = NULL;
+    unsigned instances = 0;
+    struct timespec start, end;
+
+    pif_init(&pif);
+
+    while ((opt = getopt(argc, argv, "p:n:c:l:w:t:C:R:V:T:LMFfm:k:K:j:J:usS:P:I:")) != -1) {
+        switch (opt) {
+            case 'p':
+                backend_name = optarg;
+                break;
+            case 'n':
+                sessions = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                pif.rounds = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                cycle_limit = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                record_name = optarg;
+                break;
+            case 't':
+                trace_name = optarg;
+                break;
+            case 'C':
+                romcov_name = optarg;
+                break;
+            case 'R':
+                replay_name = optarg;
+                break;
+            case 'V':
+                validate_name = optarg;
+                break;
+            case 'T':
+                tolerance = strtoul(optarg, NULL, 0);
+                break;
+            case 'L':
+                loop_detect = 1;
+                break;
+            case 'M':
+                memo_enabled = 1;
+                break;
+            case 'F':
+                fusion_stats = 1;
+                break;
+            case 'f':
+                fusion_enabled = 0;
+                break;
+            case 'm':
+                variant_name = optarg;
+                break;
+            case 'k':
+                checkpoint_interval = strtoul(optarg, NULL, 0);
+                break;
+            case 'K':
+                checkpoint_name = optarg;
+                break;
+            case 'j':
+                stats_fd = strtoul(optarg, NULL, 0);
+                break;
+            case 'J':
+                stats_interval = strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                use_tui = 1;
+                break;
+            case 's':
+                server = 1;
+                break;
+            case 'S':
+                server = 1;
+                socket_name = optarg;
+                break;
+            case 'P':
+                instances = strtoul(optarg, NULL, 0);
+                break;
+            case 'I':
+                patch_name = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if (argc < 2) {
-        printf("Usage: %s <rom.bin> [<data.csv>]\n", argv[0]);
-        printf("\n");
-        printf("sm5emu was written by Mike Ryan\n");
-        printf("See README for usage details\n");
+        usage(argv[0]);
         return 1;
     }
 
-    rom_file = fopen(argv[1], "r");
-    if (rom_file == NULL) {
-        err(1, "Can't open ROM");
-    }
+    sm = variant_name ? sm5_create_variant(variant_name) : sm5_create();
+    if (sm == NULL)
+        errx(1, "Can't create emulator for variant %s", variant_name);
+    cpu = sm5_state(sm);
+    sm5_fusion_enable(sm, fusion_enabled);
 
-    for (i = 0; i < 0x10; ++i) {
-        r = fread(ROM[i], 1, 0x40, rom_file);
-        if (r != 0x40)
-            warnx("File too short");
-        if (r == 0)
-            break;
+    // shared with any other instance running the same ROM
+    image = sm5_image_load(argv[1], sm5_variant(sm)->name);
+    if (image == NULL)
+        err(1, "Can't open ROM");
+    if (sm5_image_size(image) < sm5_variant(sm)->rom_pages * 0x40)
+        warnx("File too short");
+    sm5_set_image(sm, image);
+    sm5_image_release(image);
+    if (patch_name != NULL && ips_apply(sm, patch_name) < 0)
+        return 1;
+    sm5_set_io(sm, port_read, port_write, NULL);
+    if (romcov_name != NULL) {
+        // replayed calls would skip the coverage of their instructions
+        if (memo_enabled)
+            warnx("Not memoizing while collecting coverage");
+        memo_enabled = 0;
+        atexit(romcov_end);
     }
-    fclose(rom_file);
+    if (stats_fd >= 0)
+        stats_open(stats_fd, stats_interval);
 
     if (argc > 2) {
         have_data = 1;
         load_data(argv[2]);
+        backend = &capture_backend;
     }
 
-    signal(SIGINT, stop_run);
+    if (backend_name != NULL) {
+        if (strcmp(backend_name, "capture") == 0) {
+            if (!have_data)
+                errx(1, "capture backend needs a CSV file");
+            backend = &capture_backend;
+        }
+        else if (strcmp(backend_name, "toggle") == 0)
+            backend = &toggle_backend;
+        else if (strcmp(backend_name, "pif") == 0)
+            backend = &pif_backend;
+        else
+            errx(1, "Unknown port backend %s", backend_name);
+    }
+
+    if (replay_name != NULL)
+        replay_open(replay_name);
+    if (validate_name != NULL)
+        validate_open(validate_name, tolerance);
+
+    if (trace_name != NULL) {
+        if (sessions >= 0)
+            errx(1, "Can't trace a soak test");
+        if (!trace_open(trace_name, sm5_variant(sm)->name))
+            err(1, "Can't open %s", trace_name);
+        tracing = 1;
+        atexit(trace_end);
+    }
+
+    if (loop_detect && sm5_loop_detect(sm, 1) != SM5_OK)
+        errx(1, "Can't enable loop detection");
+
+    if (replay_name != NULL || validate_name != NULL) {
+        batch = 1;
+        verbose = 0;
+        run = 1;
+        if (memo_enabled)
+            sm5_memo_enable(sm, 1);
+        reset_state();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        emulate();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ok = validate_report();
+        if (replay_name != NULL)
+            ok &= replay_report((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        if (memo_enabled)
+            memo_report();
+        if (fusion_stats)
+            fusion_report();
+        return ok ? 0 : 1;
+    }
+
+    if (server) {
+        // the CLI's image, so -I patches are served too
+        serve(sm5_get_image(sm), socket_name, instances);
+        return 0;
+    }
+
+    if (sessions >= 0) {
+        if (record_name != NULL)
+            errx(1, "Can't record a soak test");
+        backend = &pif_backend;
+        soak(sessions);
+        return 0;
+    }
+
+    pif_session = backend == &pif_backend;
+    if (record_name != NULL) {
+        record_open(record_name);
+        atexit(record_close);
+    }
+    if (checkpoint_interval > 0)
+        checkpoint_open(checkpoint_interval, checkpoint_name);
+
+    // the debugger can change state behind the memo's back
+    memo_enabled = 0;
+
     srand(0);
 
-    emulate();
+    if (use_tui) {
+        if (tracing)
+            errx(1, "Can't trace under the UI");
+        tui_run();
+    } else {
+        signal(SIGINT, stop_run);
+        reset_state();
+        emulate();
+    }
+
+    if (pif_session)
+        printf("PIF session %s after %u cycles\n",
+                pif.result.state == PIF_DONE ? "complete" : "failed", cpu->cycle);
 
     return 0;
 }
@@ -0,0 +1,63 @@
+#ifndef __EMU_H__
+#define __EMU_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pif.h"
+#include "sm5.h"
+
+typedef uint8_t u8;
+typedef sm5_pc_t pc_t;
+
+// the CLI runs a single instance of the core
+extern sm5_t *sm;
+extern sm5_state_t *cpu;
+extern pif_t pif;
+
+#define B ((cpu->BM << 4) | cpu->BL)
+
+// logic analyzer captures are timestamped in ns from an arbitrary origin
+#define CAPTURE_T0          10240625
+#define CAPTURE_NS_PER_CYCLE 1250
+#define NS_TO_CYCLES(ts)    (((ts) - CAPTURE_T0) / CAPTURE_NS_PER_CYCLE)
+
+// ports
+//
+// Port 1 and port 2 inputs (as tested by TPB) and writes to the REG file
+// (OUT) reach the CLI through the core's port callbacks, which hand them
+// to a port backend. The capture backend replays a
+// logic-analyzer CSV, the toggle backend flips port 1 on every check,
+// and the PIF backend runs the host side of the CIC protocol live.
+//
+// A backend with state of its own (a position in a log, the PIF's place in
+// the protocol) saves it into state_size bytes for snapshots and
+// checkpoints. Wrappers append the state of the backend they wrap.
+typedef struct _port_backend_t {
+    const char *name;
+    void (*reset)(void);
+    int (*read)(unsigned num);      // level of port num, called from TPB
+    void (*write)(u8 reg, u8 val);  // called from OUT after REG is updated
+    size_t state_size;
+    void (*save)(void *buf);
+    void (*restore)(const void *buf);
+} port_backend_t;
+
+extern port_backend_t capture_backend;
+extern port_backend_t toggle_backend;
+extern port_backend_t pif_backend;
+extern port_backend_t *backend;
+
+extern int verbose;
+extern int finished;
+extern unsigned cycle_limit;
+extern int batch;
+extern int run;
+
+void finish(void);
+void print_state(void);
+void save_state(void);
+void restore_state(void);
+void reset_state(void);
+
+#endif
@@ -0,0 +1,475 @@
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sm5.h"
+
+// Coverage-guided fuzzer for SM5 ROMs
+//
+// Every execution restores one emulator instance from a starting state,
+// applies the input and runs for a cycle budget; nothing forks. An input
+// is:
+//
+//   byte 0         number of RAM pokes (low 3 bits)
+//   2 bytes each   poke: RAM address, value
+//   the rest       port levels, one bit per TPB of port 1-3, LSB first
+//
+// The run ends when the ROM asks for a port level past the end of the
+// input, or when the budget runs out. Inputs that reach new edges or new
+// hit counts join the queue; stack errors and unknown opcodes are findings.
+
+#define MAX_LEN 4096
+#define MAX_QUEUE 65536
+#define MAX_FINDINGS 256
+
+typedef struct _input_t {
+    uint8_t *data;
+    size_t len;
+} input_t;
+
+static sm5_t *sm;
+static sm5_state_t start;
+static unsigned budget = 20000;
+
+static uint8_t map[SM5_MAP_SIZE] __attribute__((aligned(64)));
+static uint8_t virgin[SM5_MAP_SIZE] __attribute__((aligned(64)));
+
+// port input for the current execution
+static const uint8_t *bits;
+static size_t bit, nbits;
+
+static input_t queue[MAX_QUEUE];
+static unsigned queued = 0;
+
+// one finding per kind of error at each PC
+static struct {
+    int status;
+    sm5_pc_t pc;
+} found[MAX_FINDINGS];
+static unsigned findings = 0;
+
+static const char *out_dir = NULL;
+static unsigned long long execs = 0;
+static volatile int stop = 0;
+static uint64_t rng = 0x2545f4914f6cdd1dull;
+
+
+////////////////////////////////
+// execution
+//
+
+static int fuzz_read(void *ctx, sm5_t *s, unsigned port) {
+    int level;
+
+    if (bit >= nbits) {
+        sm5_stop(s);
+        return 0;
+    }
+    level = (bits[bit >> 3] >> (bit & 7)) & 1;
+    ++bit;
+    return level;
+}
+
+// run one input from the starting state, leaving its coverage in map
+static int fuzz_exec(const uint8_t *data, size_t len) {
+    unsigned pokes = 0, i;
+
+    memset(map, 0, sizeof(map));
+    sm5_restore(sm, &start);
+
+    if (len > 0)
+        pokes = data[0] & 7;
+    for (i = 0; i < pokes && 2 + i * 2 < len; ++i)
+        sm5_poke(sm, data[1 + i * 2], data[2 + i * 2] & 0xf);
+    i = 1 + i * 2;
+    if (i > len)
+        i = len;
+    bits = data + i;
+    bit = 0;
+    nbits = (len - i) * 8;
+
+    sm5_coverage(sm, map);
+    ++execs;
+    return sm5_run(sm, budget);
+}
+
+// hit counts to AFL's buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+static uint8_t bucket[256];
+
+static void bucket_init(void) {
+    unsigned i;
+
+    for (i = 0; i < 256; ++i)
+        bucket[i] = i == 0 ? 0 : i == 1 ? 1 : i == 2 ? 2 : i == 3 ? 4 :
+                    i < 8 ? 8 : i < 16 ? 16 : i < 32 ? 32 : i < 128 ? 64 : 128;
+}
+
+// 2 for a new edge, 1 for a new hit count on a known edge
+static int new_coverage(void) {
+    uint64_t *m = (uint64_t *)map;
+    unsigned i, j;
+    uint8_t b;
+    int ret = 0;
+
+    for (i = 0; i < SM5_MAP_SIZE / 8; ++i) {
+        if (m[i] == 0)
+            continue;
+        for (j = i * 8; j < i * 8 + 8; ++j) {
+            if (map[j] == 0)
+                continue;
+            b = bucket[map[j]];
+            if (b & virgin[j]) {
+                if (virgin[j] == 0xff)
+                    ret = 2;
+                else if (ret == 0)
+                    ret = 1;
+                virgin[j] &= ~b;
+            }
+        }
+    }
+    return ret;
+}
+
+static unsigned edges(void) {
+    unsigned i, n = 0;
+
+    for (i = 0; i < SM5_MAP_SIZE; ++i)
+        if (virgin[i] != 0xff)
+            ++n;
+    return n;
+}
+
+
+////////////////////////////////
+// corpus and findings
+//
+
+static void save(const char *dir, const char *name, const uint8_t *data, size_t len) {
+    char path[4096];
+    FILE *file;
+
+    if (out_dir == NULL)
+        return;
+    snprintf(path, sizeof(path), "%s/%s/%s", out_dir, dir, name);
+    file = fopen(path, "w");
+    if (file == NULL)
+        err(1, "Can't open %s", path);
+    fwrite(data, 1, len, file);
+    fclose(file);
+}
+
+static void enqueue(const uint8_t *data, size_t len, int save_it) {
+    char name[32];
+    uint8_t *copy;
+
+    if (queued == MAX_QUEUE)
+        return;
+    copy = malloc(len ? len : 1);
+    if (copy == NULL)
+        err(1, "Can't allocate input");
+    memcpy(copy, data, len);
+    queue[queued].data = copy;
+    queue[queued].len = len;
+    if (save_it) {
+        snprintf(name, sizeof(name), "id_%06u", queued);
+        save("queue", name, data, len);
+    }
+    ++queued;
+}
+
+static const char *status_name(int status) {
+    switch (status) {
+        case SM5_ERR_OVERFLOW:  return "overflow";
+        case SM5_ERR_UNDERFLOW: return "underflow";
+        case SM5_ERR_OPCODE:    return "opcode";
+    }
+    return "error";
+}
+
+static void finding(int status, const uint8_t *data, size_t len) {
+    const sm5_state_t *c = sm5_state(sm);
+    char name[64];
+    unsigned i;
+
+    for (i = 0; i < findings; ++i)
+        if (found[i].status == status && found[i].pc.page == c->pc.page && found[i].pc.addr == c->pc.addr)
+            return;
+    if (findings == MAX_FINDINGS)
+        return;
+    found[findings].status = status;
+    found[findings].pc = c->pc;
+    ++findings;
+
+    snprintf(name, sizeof(name), "%s-%x.%02x", status_name(status), c->pc.page, c->pc.addr);
+    save("findings", name, data, len);
+    printf("finding: %s at %x.%02x, cycle %u, exec %llu\n",
+            sm5_strerror(status), c->pc.page, c->pc.addr, c->cycle, execs);
+}
+
+// run an input and keep it if it found something
+static void try_input(const uint8_t *data, size_t len) {
+    int status = fuzz_exec(data, len);
+
+    if (status < 0)
+        finding(status, data, len);
+    if (new_coverage())
+        enqueue(data, len, 1);
+}
+
+
+////////////////////////////////
+// mutation
+//
+
+static uint64_t next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static unsigned rand_below(unsigned n) {
+    return next_rand() % n;
+}
+
+// a stack of random edits, as in AFL's havoc stage
+static size_t mutate(uint8_t *buf, size_t len) {
+    unsigned edits = 1 << (1 + rand_below(4)), i, from, to, n;
+    uint8_t block[MAX_LEN];
+
+    for (i = 0; i < edits; ++i) {
+        switch (rand_below(len > 1 ? 7 : 4)) {
+            case 0:     // flip a bit
+                if (len)
+                    buf[rand_below(len)] ^= 1 << rand_below(8);
+                break;
+            case 1:     // random byte
+                if (len)
+                    buf[rand_below(len)] = next_rand();
+                break;
+            case 2:     // poke count
+                if (len)
+                    buf[0] = (buf[0] & ~7) | rand_below(8);
+                break;
+            case 3:     // append port levels
+                n = 1 + rand_below(16);
+                while (n-- && len < MAX_LEN)
+                    buf[len++] = next_rand();
+                break;
+            case 4:     // delete a block
+                n = 1 + rand_below(len / 2 + 1);
+                from = rand_below(len - n + 1);
+                memmove(buf + from, buf + from + n, len - from - n);
+                len -= n;
+                break;
+            case 5:     // duplicate a block
+                n = 1 + rand_below(len / 2 + 1);
+                if (len + n > MAX_LEN)
+                    break;
+                from = rand_below(len - n + 1);
+                to = rand_below(len + 1);
+                memcpy(block, buf + from, n);
+                memmove(buf + to + n, buf + to, len - to);
+                memcpy(buf + to, block, n);
+                len += n;
+                break;
+            case 6:     // constant run of levels
+                n = 1 + rand_below(len / 2 + 1);
+                from = rand_below(len - n + 1);
+                memset(buf + from, rand_below(2) ? 0xff : 0, n);
+                break;
+        }
+    }
+    return len;
+}
+
+
+////////////////////////////////
+// setup
+//
+
+static int read_file(const char *name, uint8_t *buf, size_t *len) {
+    FILE *file = fopen(name, "r");
+
+    if (file == NULL)
+        return 0;
+    *len = fread(buf, 1, MAX_LEN, file);
+    fclose(file);
+    return 1;
+}
+
+static void load_seeds(const char *dir) {
+    uint8_t buf[MAX_LEN];
+    char path[4096];
+    struct dirent *ent;
+    size_t len;
+    DIR *d;
+
+    d = opendir(dir);
+    if (d == NULL)
+        err(1, "Can't open %s", dir);
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (read_file(path, buf, &len))
+            try_input(buf, len);
+    }
+    closedir(d);
+}
+
+static void make_dir(const char *dir, const char *sub) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s%s%s", dir, sub ? "/" : "", sub ? sub : "");
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+        err(1, "Can't create %s", path);
+}
+
+static void load_state(const char *name) {
+    FILE *file = fopen(name, "r");
+
+    if (file == NULL)
+        err(1, "Can't open %s", name);
+    // a debugger save: the machine state, then port backend state
+    if (fread(&start, sizeof(start), 1, file) != 1)
+        errx(1, "%s is short", name);
+    fclose(file);
+}
+
+static void report(double secs) {
+    printf("%llu execs, %.0f execs/s, %u inputs, %u edges, %u findings\n",
+            execs, secs > 0 ? execs / secs : 0, queued, edges(), findings);
+    fflush(stdout);
+}
+
+static void stop_fuzz(int signum) {
+    stop = 1;
+}
+
+static void usage(char *prog) {
+    printf("Usage: %s [options] <rom.bin>\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("    -m <variant>     SM5 variant\n");
+    printf("    -l <cycles>      cycle budget per execution (default %u)\n", budget);
+    printf("    -S <state>       start from a state saved in the debugger\n");
+    printf("    -i <dir>         seed inputs\n");
+    printf("    -o <dir>         write the queue and findings here\n");
+    printf("    -n <execs>       stop after this many executions\n");
+    printf("    -r <input>       run one input and print how it ended\n");
+}
+
+int main(int argc, char **argv) {
+    uint8_t buf[MAX_LEN];
+    char *variant_name = NULL, *seed_dir = NULL, *state_name = NULL, *repro = NULL;
+    unsigned long long limit = 0;
+    struct timespec begin, now, last;
+    size_t len;
+    input_t *parent;
+    int opt, status;
+
+    while ((opt = getopt(argc, argv, "m:l:S:i:o:n:r:")) != -1) {
+        switch (opt) {
+            case 'm':
+                variant_name = optarg;
+                break;
+            case 'l':
+                budget = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                state_name = optarg;
+                break;
+            case 'i':
+                seed_dir = optarg;
+                break;
+            case 'o':
+                out_dir = optarg;
+                break;
+            case 'n':
+                limit = strtoull(optarg, NULL, 0);
+                break;
+            case 'r':
+                repro = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    sm = variant_name ? sm5_create_variant(variant_name) : sm5_create();
+    if (sm == NULL)
+        errx(1, "Can't create emulator for variant %s", variant_name);
+    if (sm5_load_rom(sm, argv[optind]) != SM5_OK)
+        errx(1, "Can't read ROM %s", argv[optind]);
+    sm5_set_io(sm, fuzz_read, NULL, NULL);
+    sm5_snapshot(sm, &start);
+    if (state_name != NULL)
+        load_state(state_name);
+
+    bucket_init();
+    memset(virgin, 0xff, sizeof(virgin));
+
+    if (repro != NULL) {
+        if (!read_file(repro, buf, &len))
+            err(1, "Can't open %s", repro);
+        status = fuzz_exec(buf, len);
+        new_coverage();
+        printf("%s at %x.%02x, cycle %u, %zu of %zu port levels used, %u edges\n",
+                sm5_strerror(status), sm5_state(sm)->pc.page, sm5_state(sm)->pc.addr,
+                sm5_state(sm)->cycle, bit, nbits, edges());
+        return status < 0 ? 1 : 0;
+    }
+
+    if (out_dir != NULL) {
+        make_dir(out_dir, NULL);
+        make_dir(out_dir, "queue");
+        make_dir(out_dir, "findings");
+    }
+
+    if (seed_dir != NULL)
+        load_seeds(seed_dir);
+    if (queued == 0) {
+        // no pokes, alternating port levels
+        memset(buf, 0xaa, 64);
+        buf[0] = 0;
+        fuzz_exec(buf, 64);
+        new_coverage();
+        enqueue(buf, 64, 1);
+    }
+
+    signal(SIGINT, stop_fuzz);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    last = begin;
+    while (!stop && (limit == 0 || execs < limit)) {
+        parent = &queue[rand_below(queued)];
+        memcpy(buf, parent->data, parent->len);
+        len = mutate(buf, parent->len);
+        try_input(buf, len);
+
+        if ((execs & 0xff) == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec - last.tv_sec >= 2) {
+                report((now.tv_sec - begin.tv_sec) + (now.tv_nsec - begin.tv_nsec) / 1e9);
+                last = now;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    report((now.tv_sec - begin.tv_sec) + (now.tv_nsec - begin.tv_nsec) / 1e9);
+
+    return 0;
+}
@@ -0,0 +1,400 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sm5int.h"
+
+// State hashing
+//
+// RAM and REG are hashed incrementally: every cell/value pair has a random
+// key, the hash is the XOR of the keys for the current contents, and a
+// write XORs out the old key and XORs in the new one. The registers are
+// few enough to mix in whenever a full state hash is needed.
+
+#define LOOP_HISTORY 4096
+
+uint64_t zobrist_ram[0x100][0x10];
+uint64_t zobrist_reg[0x10][0x10];
+
+static pthread_once_t zobrist_once = PTHREAD_ONCE_INIT;
+
+static uint64_t splitmix(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t mix(uint64_t x) {
+    return splitmix(&x);
+}
+
+static void zobrist_init(void) {
+    uint64_t seed = 0x534d35;
+    int i, j;
+
+    for (i = 0; i < 0x100; ++i)
+        for (j = 0; j < 0x10; ++j)
+            zobrist_ram[i][j] = splitmix(&seed);
+    for (i = 0; i < 0x10; ++i)
+        for (j = 0; j < 0x10; ++j)
+            zobrist_reg[i][j] = splitmix(&seed);
+}
+
+void hash_init(void) {
+    pthread_once(&zobrist_once, zobrist_init);
+}
+
+static void loop_reset(sm5_t *s);
+static void rec_clear(sm5_t *s);
+
+void hash_reset(sm5_t *s) {
+    int i;
+
+    s->mem_hash = 0;
+    for (i = 0; i < 0x100; ++i)
+        s->mem_hash ^= zobrist_ram[i][sm5_ram_peek(&s->cpu, i)];
+    for (i = 0; i < 0x10; ++i)
+        s->mem_hash ^= zobrist_reg[i][sm5_reg_peek(&s->cpu, i)];
+
+    // history from before the change no longer applies
+    loop_reset(s);
+    if (s->memo_recording)
+        rec_clear(s);
+}
+
+// everything but the cycle counter
+uint64_t sm5_hash(sm5_t *s) {
+    sm5_state_t *c = &s->cpu;
+    uint64_t regs, stk = 0;
+    unsigned i;
+
+    regs = (uint64_t)c->A | c->X << 4 | c->BL << 8 | c->BM << 12 | c->SB << 16 | c->C << 24
+        | (uint64_t)(c->skip & 1) << 25 | (uint64_t)c->sp << 26
+        | (uint64_t)c->pc.page << 29 | (uint64_t)c->pc.addr << 33
+        | (uint64_t)(c->port[0] & 0xf) << 40 | (uint64_t)(c->port[1] & 0xf) << 44
+        | (uint64_t)(c->port[2] & 0xf) << 48 | (uint64_t)c->port2_hiz << 52
+        | (uint64_t)(c->port[3] & 0xf) << 53;
+    for (i = 0; i < c->sp; ++i)
+        stk = stk << 12 | c->stack[i].page << 6 | c->stack[i].addr;
+
+    return s->mem_hash ^ mix(regs) ^ mix(stk ^ 0x5354414bULL);
+}
+
+
+////////////////////////////////
+// loop detection
+//
+// Brent's algorithm finds the period: the state saved at each power of two
+// step is compared with every later state. The last LOOP_HISTORY state
+// hashes are kept so the point where the loop was entered can be found by
+// walking back while states keep repeating one period apart.
+
+struct loop {
+    struct {
+        uint64_t hash;
+        unsigned cycle;
+    } history[LOOP_HISTORY];
+    unsigned long long steps;
+    uint64_t saved_hash;
+    unsigned long long saved_step, power;
+    int found;
+    sm5_loop_t info;
+};
+
+static void loop_reset(sm5_t *s) {
+    if (s->loop == NULL)
+        return;
+    s->loop->steps = 0;
+    s->loop->found = 0;
+}
+
+int sm5_loop_detect(sm5_t *s, int enable) {
+    if (!enable) {
+        loop_free(s);
+        return SM5_OK;
+    }
+    if (s->loop == NULL) {
+        s->loop = calloc(1, sizeof(*s->loop));
+        if (s->loop == NULL)
+            return SM5_ERR_NOMEM;
+    }
+    loop_reset(s);
+    return SM5_OK;
+}
+
+void loop_free(sm5_t *s) {
+    free(s->loop);
+    s->loop = NULL;
+}
+
+void sm5_loop_info(sm5_t *s, sm5_loop_t *info) {
+    if (s->loop == NULL || !s->loop->found)
+        memset(info, 0, sizeof(*info));
+    else
+        *info = s->loop->info;
+}
+
+int loop_step(sm5_t *s) {
+    struct loop *l = s->loop;
+    uint64_t h = sm5_hash(s);
+    unsigned long long period, entry, oldest;
+    int status = SM5_OK;
+
+    if (!l->found && l->steps > 0 && h == l->saved_hash) {
+        period = l->steps - l->saved_step;
+        oldest = l->steps >= LOOP_HISTORY ? l->steps - LOOP_HISTORY + 1 : 0;
+
+        entry = l->saved_step;
+        if (period < LOOP_HISTORY)
+            while (entry > oldest && entry - 1 + period < l->steps
+                    && l->history[(entry - 1) % LOOP_HISTORY].hash
+                        == l->history[(entry - 1 + period) % LOOP_HISTORY].hash)
+                --entry;
+
+        l->found = 1;
+        l->info.period = period;
+        l->info.period_cycles = s->cpu.cycle - l->history[l->saved_step % LOOP_HISTORY].cycle;
+        l->info.entry_cycle = l->history[entry % LOOP_HISTORY].cycle;
+        l->info.entry_exact = entry > oldest || oldest == 0;
+        status = SM5_LOOP;
+    }
+
+    l->history[l->steps % LOOP_HISTORY].hash = h;
+    l->history[l->steps % LOOP_HISTORY].cycle = s->cpu.cycle;
+
+    if (l->steps == 0 || l->steps - l->saved_step == l->power) {
+        l->saved_hash = h;
+        l->saved_step = l->steps;
+        l->power = l->steps == 0 ? 1 : l->power * 2;
+    }
+    ++l->steps;
+
+    return status;
+}
+
+
+////////////////////////////////
+// memoization
+//
+// A subroutine that does no port I/O is a pure function of the registers
+// it is called with and of the RAM cells it reads before writing them. The
+// first time a routine runs those reads are recorded, along with the cells
+// it writes and the registers, skip flag and cycle count it returns with.
+// Later calls with the same registers and the same values in the read
+// cells jump straight to the return. Routines that turn out to do I/O are
+// never recorded again.
+
+#define MEMO_WAYS   8
+#define MEMO_CELLS  32
+
+typedef struct _memo_t {
+    uint32_t key;           // registers at entry, 0 = unused
+    uint32_t exit_key;
+    int exit_skip;
+    u8 depth;               // stack slots it pushed, the call's included
+    pc_t stack[4];          // what it left in them, from sp up
+    unsigned cycles;
+    u8 reads, writes;
+    u8 read_addr[MEMO_CELLS], read_val[MEMO_CELLS];
+    u8 write_addr[MEMO_CELLS], write_val[MEMO_CELLS];
+} memo_t;
+
+struct memo {
+    memo_t table[0x400][MEMO_WAYS];
+    u8 next[0x400];
+    u8 impure[0x400];
+
+    // routine being recorded
+    unsigned target;
+    unsigned sp;
+    unsigned deepest;
+    unsigned start;
+    memo_t entry;
+    u8 flags[0x100];
+
+    sm5_memo_stats_t stats;
+};
+
+#define TOUCH_READ  1
+#define TOUCH_WRITE 2
+
+int sm5_memo_enable(sm5_t *s, int enable) {
+#ifdef SM5_TAINT
+    // a replayed call would leave the tags behind
+    enable = 0;
+#endif
+    if (!enable) {
+        memo_free(s);
+        return SM5_OK;
+    }
+    if (s->memo == NULL) {
+        s->memo = calloc(1, sizeof(*s->memo));
+        if (s->memo == NULL)
+            return SM5_ERR_NOMEM;
+    }
+    return SM5_OK;
+}
+
+void memo_free(sm5_t *s) {
+    s->memo_recording = 0;
+    free(s->memo);
+    s->memo = NULL;
+}
+
+void sm5_memo_stats(sm5_t *s, sm5_memo_stats_t *stats) {
+    if (s->memo == NULL)
+        memset(stats, 0, sizeof(*stats));
+    else
+        *stats = s->memo->stats;
+}
+
+static uint32_t regs_key(sm5_state_t *c, unsigned depth) {
+    return 1 | c->A << 1 | c->X << 5 | c->BL << 9 | c->BM << 13 | c->SB << 17 | c->C << 25 | depth << 26;
+}
+
+static void set_regs(sm5_state_t *c, uint32_t key) {
+    c->A = (key >> 1) & 0xf;
+    c->X = (key >> 5) & 0xf;
+    c->BL = (key >> 9) & 0xf;
+    c->BM = (key >> 13) & 0xf;
+    c->SB = (key >> 17) & 0xff;
+    c->C = (key >> 25) & 1;
+}
+
+static void rec_clear(sm5_t *s) {
+    struct memo *m = s->memo;
+    unsigned i;
+
+    for (i = 0; i < m->entry.reads; ++i)
+        m->flags[m->entry.read_addr[i]] = 0;
+    for (i = 0; i < m->entry.writes; ++i)
+        m->flags[m->entry.write_addr[i]] = 0;
+    s->memo_recording = 0;
+}
+
+void memo_abort(sm5_t *s) {
+    s->memo->impure[s->memo->target] = 1;
+    rec_clear(s);
+}
+
+u8 memo_read(sm5_t *s, u8 addr) {
+    struct memo *m = s->memo;
+
+    if (m->flags[addr] == 0) {
+        if (m->entry.reads == MEMO_CELLS) {
+            memo_abort(s);
+            return sm5_ram_peek(&s->cpu, addr);
+        }
+        m->flags[addr] = TOUCH_READ;
+        m->entry.read_addr[m->entry.reads] = addr;
+        m->entry.read_val[m->entry.reads] = sm5_ram_peek(&s->cpu, addr);
+        ++m->entry.reads;
+    }
+    return sm5_ram_peek(&s->cpu, addr);
+}
+
+void memo_write(sm5_t *s, u8 addr) {
+    struct memo *m = s->memo;
+
+    if (!(m->flags[addr] & TOUCH_WRITE)) {
+        if (m->entry.writes == MEMO_CELLS) {
+            memo_abort(s);
+            return;
+        }
+        m->flags[addr] |= TOUCH_WRITE;
+        m->entry.write_addr[m->entry.writes] = addr;
+        ++m->entry.writes;
+    }
+}
+
+// called before a CALL or TRS executes, returns 1 if the call was replayed
+int memo_call(sm5_t *s, u8 op, u8 arg) {
+    struct memo *m = s->memo;
+    unsigned target, i, way;
+    uint32_t key;
+    memo_t *e;
+
+    if (s->memo_recording || s->cpu.interrupt)
+        return 0;
+
+    if (op >= 0xF0)
+        target = ((op & 0xf) << 8) | arg;
+    else
+        target = (s->core->variant.trs_page << 6) | ((op & 0b11111) << 1);
+    // the page wraps within ROM, as in the core
+    target &= s->core->variant.rom_pages * 0x40 - 1;
+
+    if (m->impure[target])
+        return 0;
+
+    key = regs_key(&s->cpu, s->cpu.sp);
+    for (way = 0; way < MEMO_WAYS; ++way) {
+        e = &m->table[target][way];
+        if (e->key != key)
+            continue;
+        for (i = 0; i < e->reads; ++i)
+            if (sm5_ram_peek(&s->cpu, e->read_addr[i]) != e->read_val[i])
+                break;
+        if (i < e->reads)
+            continue;
+
+        for (i = 0; i < e->writes; ++i)
+            RAM_SET(s, e->write_addr[i], e->write_val[i]);
+        set_regs(&s->cpu, e->exit_key);
+        // the PC is already at the return address, which is what the
+        // routine's own return slot holds; deeper slots hold addresses in
+        // the routine
+        s->cpu.stack[s->cpu.sp] = s->cpu.pc;
+        for (i = 1; i < e->depth; ++i)
+            s->cpu.stack[s->cpu.sp + i] = e->stack[i];
+        if (s->cpu.sp + e->depth > s->stats.stack_max)
+            s->stats.stack_max = s->cpu.sp + e->depth;
+        s->cpu.skip = e->exit_skip;
+        s->cpu.cycle += e->cycles;
+        ++m->stats.hits;
+        m->stats.saved_cycles += e->cycles;
+        return 1;
+    }
+
+    ++m->stats.misses;
+    memset(&m->entry, 0, sizeof(m->entry));
+    m->entry.key = key;
+    m->target = target;
+    m->sp = s->cpu.sp;
+    m->deepest = s->cpu.sp;
+    m->start = s->cpu.cycle;
+    s->memo_recording = 1;
+    return 0;
+}
+
+// called after every instruction while recording
+void memo_after(sm5_t *s, int returned) {
+    struct memo *m = s->memo;
+    unsigned i;
+    memo_t *e;
+
+    if (s->cpu.sp < m->sp) {
+        memo_abort(s);
+        return;
+    }
+    if (s->cpu.sp > m->deepest)
+        m->deepest = s->cpu.sp;
+    if (!returned || s->cpu.sp != m->sp)
+        return;
+
+    for (i = 0; i < m->entry.writes; ++i)
+        m->entry.write_val[i] = sm5_ram_peek(&s->cpu, m->entry.write_addr[i]);
+    m->entry.exit_key = regs_key(&s->cpu, s->cpu.sp);
+    m->entry.exit_skip = s->cpu.skip;
+    m->entry.depth = m->deepest - m->sp;
+    for (i = 0; i < m->entry.depth; ++i)
+        m->entry.stack[i] = s->cpu.stack[m->sp + i];
+    m->entry.cycles = s->cpu.cycle - m->start;
+
+    e = &m->table[m->target][m->next[m->target]++ % MEMO_WAYS];
+    if (e->key == 0)
+        ++m->stats.entries;
+    *e = m->entry;
+    rec_clear(s);
+}
@@ -0,0 +1,256 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sm5int.h"
+
+// ROM image registry
+//
+// Every distinct ROM is decoded once per core, into its own anonymous
+// mapping that is then made read-only. Instances point at the decoded
+// image, so an instance costs no ROM memory of its own and switching ROMs
+// is a pointer assignment. Images are found by a hash of the zero-filled
+// ROM, checked with a compare, and freed with their last reference.
+
+struct sm5_image {
+    const sm5_rom_image_t *img;
+    unsigned refs;
+    struct sm5_image *next;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sm5_image *registry = NULL;
+static unsigned images = 0;
+
+// FNV-1a
+static uint64_t rom_hash(const u8 *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static sm5_image_t *intern(const u8 *rom, size_t len, const sm5_core_t *core) {
+    u8 buf[sizeof(((sm5_rom_image_t *)0)->rom)];
+    sm5_rom_image_t *img;
+    sm5_image_t *e;
+    uint64_t hash;
+
+    if (len > core->variant.rom_pages * 0x40)
+        len = core->variant.rom_pages * 0x40;
+    memset(buf, 0, sizeof(buf));
+    if (len > 0)
+        memcpy(buf, rom, len);
+    hash = rom_hash(buf, sizeof(buf));
+
+    pthread_mutex_lock(&registry_lock);
+    for (e = registry; e != NULL; e = e->next)
+        if (e->img->core == core && e->img->hash == hash && e->img->len == len
+                && memcmp(e->img->rom, buf, sizeof(buf)) == 0) {
+            ++e->refs;
+            pthread_mutex_unlock(&registry_lock);
+            return e;
+        }
+
+    e = malloc(sizeof(*e));
+    img = mmap(NULL, sizeof(*img), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (e == NULL || img == MAP_FAILED) {
+        free(e);
+        if (img != MAP_FAILED)
+            munmap(img, sizeof(*img));
+        pthread_mutex_unlock(&registry_lock);
+        return NULL;
+    }
+    memcpy(img->rom, buf, sizeof(buf));
+    img->core = core;
+    img->hash = hash;
+    img->len = len;
+    core->decode(img);
+    mprotect(img, sizeof(*img), PROT_READ);
+
+    e->img = img;
+    e->refs = 1;
+    e->next = registry;
+    registry = e;
+    ++images;
+    pthread_mutex_unlock(&registry_lock);
+    return e;
+}
+
+sm5_image_t *sm5_image_mem(const u8 *rom, size_t len, const char *variant) {
+    const sm5_core_t *core = core_find(variant);
+
+    if (core == NULL)
+        return NULL;
+    return intern(rom, len, core);
+}
+
+// the file is mapped only long enough to hash and copy it
+sm5_image_t *sm5_image_load(const char *path, const char *variant) {
+    const sm5_core_t *core = core_find(variant);
+    sm5_image_t *e;
+    struct stat st;
+    size_t len;
+    void *p;
+    int fd;
+
+    if (core == NULL)
+        return NULL;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    len = st.st_size;
+    if (len > core->variant.rom_pages * 0x40)
+        len = core->variant.rom_pages * 0x40;
+    p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    e = intern(p, len, core);
+    munmap(p, len);
+    return e;
+}
+
+void sm5_image_release(sm5_image_t *image) {
+    sm5_image_t **p;
+
+    if (image == NULL)
+        return;
+    pthread_mutex_lock(&registry_lock);
+    if (--image->refs == 0) {
+        for (p = &registry; *p != image; p = &(*p)->next)
+            ;
+        *p = image->next;
+        munmap((void *)image->img, sizeof(*image->img));
+        free(image);
+        --images;
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+uint64_t sm5_image_hash(const sm5_image_t *image) {
+    return image->img->hash;
+}
+
+size_t sm5_image_size(const sm5_image_t *image) {
+    return image->img->len;
+}
+
+unsigned sm5_image_count(void) {
+    unsigned n;
+
+    pthread_mutex_lock(&registry_lock);
+    n = images;
+    pthread_mutex_unlock(&registry_lock);
+    return n;
+}
+
+int sm5_set_image(sm5_t *s, sm5_image_t *image) {
+    sm5_image_t *old = s->image;
+
+    if (image->img->core != s->core)
+        return SM5_ERR_VARIANT;
+    pthread_mutex_lock(&registry_lock);
+    ++image->refs;
+    pthread_mutex_unlock(&registry_lock);
+
+    s->image = image;
+    s->img = image->img;
+    memset(s->fusion_fired, 0, sizeof(s->fusion_fired));
+    // recordings are of the old ROM
+    if (s->memo) {
+        memo_free(s);
+        sm5_memo_enable(s, 1);
+    }
+    sm5_image_release(old);
+    return SM5_OK;
+}
+
+sm5_image_t *sm5_get_image(sm5_t *s) {
+    pthread_mutex_lock(&registry_lock);
+    ++s->image->refs;
+    pthread_mutex_unlock(&registry_lock);
+    return s->image;
+}
+
+// An instance patches its image in place only while it holds the one
+// reference. Otherwise its reference moves to a copy of the decoded image,
+// registered like any other, and the original stays as it was for the
+// rest. Either way the image is writable only for the patch, under the
+// registry lock so a lookup never sees it half done.
+int sm5_rom_patch(sm5_t *s, unsigned offset, const u8 *data, size_t len) {
+    size_t size = s->core->variant.rom_pages * 0x40;
+    sm5_image_t *e = s->image, *copy;
+    sm5_rom_image_t *img;
+    unsigned i, page, addr;
+
+    if (offset > size || len > size - offset)
+        return SM5_ERR_RANGE;
+    if (len == 0)
+        return SM5_OK;
+
+    pthread_mutex_lock(&registry_lock);
+    if (e->refs > 1) {
+        copy = malloc(sizeof(*copy));
+        img = mmap(NULL, sizeof(*img), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy == NULL || img == MAP_FAILED) {
+            free(copy);
+            if (img != MAP_FAILED)
+                munmap(img, sizeof(*img));
+            pthread_mutex_unlock(&registry_lock);
+            return SM5_ERR_NOMEM;
+        }
+        memcpy(img, e->img, sizeof(*img));
+        --e->refs;
+        copy->img = img;
+        copy->refs = 1;
+        copy->next = registry;
+        registry = copy;
+        ++images;
+        s->image = copy;
+        s->img = img;
+    } else {
+        img = (sm5_rom_image_t *)e->img;
+        mprotect(img, sizeof(*img), PROT_READ | PROT_WRITE);
+    }
+
+    for (i = 0; i < len; ++i) {
+        page = (offset + i) >> 6;
+        addr = (offset + i) & 0x3f;
+        if (img->rom[page][addr] == data[i])
+            continue;
+        img->rom[page][addr] = data[i];
+        s->core->patch(img, page, addr);
+    }
+    if (offset + len > img->len)
+        img->len = offset + len;
+    img->hash = rom_hash(&img->rom[0][0], sizeof(img->rom));
+    mprotect(img, sizeof(*img), PROT_READ);
+    pthread_mutex_unlock(&registry_lock);
+
+    // recordings and state history are of the old ROM
+    if (s->memo) {
+        memo_free(s);
+        sm5_memo_enable(s, 1);
+    }
+    hash_reset(s);
+    return SM5_OK;
+}
+
+int sm5_rom_poke(sm5_t *s, u8 page, u8 addr, u8 val) {
+    if (page >= s->core->variant.rom_pages || addr >= 0x40)
+        return SM5_ERR_RANGE;
+    return sm5_rom_patch(s, page << 6 | addr, &val, 1);
+}
@@ -0,0 +1,91 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ips.h"
+
+// IPS patches
+//
+// "PATCH", then records of a 3 byte offset and a 2 byte size, both big
+// endian, followed by size bytes of data. A size of 0 is a run: a 2 byte
+// count and the byte to repeat. "EOF" in place of an offset ends the file.
+
+#define IPS_MAX     0x10000     // a ROM is 1 KiB at most, a patch is small
+
+typedef uint8_t u8;
+
+static unsigned be(const u8 *p, unsigned n) {
+    unsigned v = 0;
+
+    while (n--)
+        v = v << 8 | *p++;
+    return v;
+}
+
+// walk the records, writing them if apply is set. -1 if malformed.
+static long ips_walk(sm5_t *s, const u8 *p, size_t len, int apply, unsigned rom_size) {
+    u8 run[0x400];
+    unsigned offset, size;
+    size_t at = 5;
+    long written = 0;
+    int status;
+
+    while (1) {
+        if (at + 3 <= len && memcmp(p + at, "EOF", 3) == 0)
+            return written;
+        if (at + 5 > len)
+            return -1;
+        offset = be(p + at, 3);
+        size = be(p + at + 3, 2);
+        at += 5;
+        if (size == 0) {
+            if (at + 3 > len)
+                return -1;
+            size = be(p + at, 2);
+            if (size > sizeof(run) || offset + size > rom_size)
+                return -1;
+            memset(run, p[at + 2], size);
+            at += 3;
+            status = apply ? sm5_rom_patch(s, offset, run, size) : SM5_OK;
+        } else {
+            if (at + size > len || offset + size > rom_size)
+                return -1;
+            status = apply ? sm5_rom_patch(s, offset, p + at, size) : SM5_OK;
+            at += size;
+        }
+        if (status != SM5_OK)
+            return -1;
+        written += size;
+    }
+}
+
+long ips_apply(sm5_t *s, const char *name) {
+    unsigned rom_size = sm5_variant(s)->rom_pages * 0x40;
+    FILE *file;
+    u8 *buf;
+    size_t len;
+    long written;
+
+    file = fopen(name, "r");
+    if (file == NULL) {
+        warn("Can't open %s", name);
+        return -1;
+    }
+    buf = malloc(IPS_MAX);
+    if (buf == NULL)
+        err(1, "Can't allocate patch buffer");
+    len = fread(buf, 1, IPS_MAX, file);
+    fclose(file);
+
+    if (len < 5 || memcmp(buf, "PATCH", 5) != 0 || ips_walk(s, buf, len, 0, rom_size) < 0) {
+        warnx("%s isn't an IPS patch for this ROM", name);
+        free(buf);
+        return -1;
+    }
+    written = ips_walk(s, buf, len, 1, rom_size);
+    if (written < 0)
+        warnx("Can't apply %s", name);
+    free(buf);
+    return written;
+}
@@ -0,0 +1,12 @@
+#ifndef __IPS_H__
+#define __IPS_H__
+
+#include "sm5.h"
+
+// Apply an IPS patch to the instance's ROM, offsets being page << 6 | addr.
+// The whole file is checked before anything is written. Returns the number
+// of bytes written, or -1 with a warning if the file can't be read, isn't a
+// patch or reaches past the end of ROM.
+long ips_apply(sm5_t *s, const char *name);
+
+#endif
@@ -0,0 +1,57 @@
+#include "cic.h"
+
+void fn_22b(uint8_t *mem, int start) {
+    int i;
+    uint8_t A;
+
+    A = mem[start];
+    for (i = start+1; i < 16; ++i) {
+        A = (A + 1) % 16;
+        A = (A + mem[i]) % 16;
+        mem[i] = A;
+    }
+}
+
+void inverse_22b(uint8_t *mem, int start) {
+    int i;
+    uint8_t A, nextA;
+
+    A = mem[start];
+    nextA = A;
+    for (i = start+1; i < 16; ++i) {
+        nextA = mem[i];
+        mem[i] -= (A + 1);
+        if (mem[i] > 16)
+            mem[i] += 16;
+        A = nextA;
+    }
+}
+
+void algo_6105(uint8_t *mem, int len) {
+    int i;
+    uint8_t A = 5;
+    int carry = 1;
+
+    for (i = 0; i < len; ++i) {
+        if (!(mem[i] & 1))
+            A += 8;
+        if (!(A & 2))
+            A += 4;
+        A = (A + mem[i]) & 0xf;
+        mem[i] = A;
+
+        if (!carry)
+            A += 7;
+
+        A = (A + mem[i]) & 0xF;
+        A = A + mem[i] + carry;
+        if (A >= 0x10) {
+            carry = 1;
+            A -= 0x10;
+        } else {
+            carry = 0;
+        }
+        mem[i] = (~A) & 0xf;
+        A = mem[i];
+    }
+}
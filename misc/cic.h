@@ -0,0 +1,13 @@
+#ifndef __CIC_H__
+#define __CIC_H__
+
+#include <stdint.h>
+
+// CIC <-> PIF encoding ("encraption") and its inverse
+void fn_22b(uint8_t *mem, int start);
+void inverse_22b(uint8_t *mem, int start);
+
+// 6105 challenge/response algorithm, in place on len nibbles
+void algo_6105(uint8_t *mem, int len);
+
+#endif
@@ -2,32 +2,7 @@
 #include <stdio.h>
 #include <stdint.h>
 
-void fn_22b(uint8_t *mem, int start) {
-    int i;
-    uint8_t A;
-
-    A = mem[start];
-    for (i = start+1; i < 16; ++i) {
-        A = (A + 1) % 16;
-        A = (A + mem[i]) % 16;
-        mem[i] = A;
-    }
-}
-
-void inverse_22b(uint8_t *mem, int start) {
-    int i;
-    uint8_t A, nextA;
-
-    A = mem[start];
-    nextA = A;
-    for (i = start+1; i < 16; ++i) {
-        nextA = mem[i];
-        mem[i] -= (A + 1);
-        if (mem[i] > 16)
-            mem[i] += 16;
-        A = nextA;
-    }
-}
+#include "cic.h"
 
 void dump(uint8_t *mem, size_t len) {
     int i;
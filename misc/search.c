@@ -0,0 +1,573 @@
+#include <ctype.h>
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cic.h"
+
+// Exhaustive search through the encraption functions
+//
+// The space is a pattern of up to 16 nibbles, each a hex digit or ? for
+// all 16 values. Every candidate is run through fn_22b (or inverse_22b
+// with -i) and kept if the result matches a second pattern, where ? is
+// don't care. As in the PIF, a vector of n nibbles sits at the end of the
+// 16 nibble buffer and the transform starts at 16 - n.
+//
+// A candidate is a uint64_t with one nibble per lane. fn_22b is a running
+// sum mod 16, which is four shifted nibble-wise adds; inverse_22b is a
+// difference of neighbours. Candidates go through in batches with simple
+// loops over arrays, which the compiler vectorizes.
+//
+// The space is cut into chunks. Threads own a range of chunks each and
+// take from its front; a thread that runs out steals the back half of the
+// largest remaining range. The ranges still to do are written to the
+// checkpoint file every few seconds and on SIGINT, and a search started
+// with the same file and patterns carries on from them. Work done since the
+// last checkpoint is done again, so its matches can repeat.
+
+typedef uint8_t u8;
+
+#define LO      0x7777777777777777ull
+#define HI      0x8888888888888888ull
+#define ONES    0x1111111111111111ull
+
+#define BATCH   256
+#define CHUNK   0x10000
+#define NONE    UINT64_MAX
+
+// per nibble a + b and a - b mod 16
+static inline uint64_t nadd(uint64_t a, uint64_t b) {
+    return ((a & LO) + (b & LO)) ^ ((a ^ b) & HI);
+}
+
+static inline uint64_t nsub(uint64_t a, uint64_t b) {
+    return ((a | HI) - (b & LO)) ^ ((a ^ ~b) & HI);
+}
+
+// the transform, set up for the vector's start nibble
+static uint64_t upper;      // nibbles from start up
+static uint64_t steps;      // 0, 1, 2... from start up
+static uint64_t after;      // 1 in each nibble after start
+
+static void transform_init(unsigned start) {
+    unsigned i;
+
+    upper = start ? ~0ull << (start * 4) : ~0ull;
+    steps = 0;
+    for (i = start; i < 16; ++i)
+        steps |= (uint64_t)(i - start) << (i * 4);
+    after = ONES & upper & ~(0xfull << (start * 4));
+}
+
+static inline uint64_t forward(uint64_t x) {
+    uint64_t p = x & upper;
+
+    p = nadd(p, p << 4);
+    p = nadd(p, p << 8);
+    p = nadd(p, p << 16);
+    p = nadd(p, p << 32);
+    return nadd(p, steps) | (x & ~upper);
+}
+
+static inline uint64_t inverse(uint64_t y) {
+    uint64_t p = y & upper;
+
+    return nsub(nsub(p, p << 4), after) | (y & ~upper);
+}
+
+static void forward_batch(uint64_t *v, unsigned n, unsigned rounds) {
+    unsigned i, r;
+
+    for (r = 0; r < rounds; ++r)
+        for (i = 0; i < n; ++i)
+            v[i] = forward(v[i]);
+}
+
+static void inverse_batch(uint64_t *v, unsigned n, unsigned rounds) {
+    unsigned i, r;
+
+    for (r = 0; r < rounds; ++r)
+        for (i = 0; i < n; ++i)
+            v[i] = inverse(v[i]);
+}
+
+static uint64_t pack(const u8 *mem) {
+    uint64_t v = 0;
+    unsigned i;
+
+    for (i = 0; i < 16; ++i)
+        v |= (uint64_t)(mem[i] & 0xf) << (i * 4);
+    return v;
+}
+
+static void unpack(uint64_t v, u8 *mem) {
+    unsigned i;
+
+    for (i = 0; i < 16; ++i)
+        mem[i] = (v >> (i * 4)) & 0xf;
+}
+
+// the packed transforms must agree with cic.c
+static void self_test(unsigned start) {
+    u8 mem[16];
+    uint64_t v, w;
+    unsigned i, j;
+
+    srand(1);
+    for (i = 0; i < 10000; ++i) {
+        memset(mem, 0, sizeof(mem));
+        for (j = start; j < 16; ++j)
+            mem[j] = rand() & 0xf;
+        v = pack(mem);
+
+        fn_22b(mem, start);
+        w = v;
+        forward_batch(&w, 1, 1);
+        if (w != pack(mem))
+            errx(1, "fn_22b mismatch on %016llx", (unsigned long long)v);
+
+        inverse_22b(mem, start);
+        inverse_batch(&w, 1, 1);
+        if (w != pack(mem) || w != v)
+            errx(1, "inverse_22b mismatch on %016llx", (unsigned long long)v);
+    }
+}
+
+
+////////////////////////////////
+// the search
+//
+
+static unsigned len, start, rounds = 0;
+static int backward = 0;
+static char *from_pattern, *to_pattern;
+static uint64_t fixed;          // fixed nibbles of the space
+static uint64_t wild;           // bits of its ? nibbles
+static unsigned wild_pos[16], wild_count = 0;
+static uint64_t want, care;     // the match
+static uint64_t space;          // candidates
+static unsigned long long max_matches = 0;
+
+// one worker's range of candidate indexes
+typedef struct _worker_t {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    uint64_t next, end;         // still to do
+    uint64_t cur, cur_end;      // being done, cur is NONE if nothing
+} worker_t;
+
+static worker_t *workers;
+static unsigned nworkers;
+
+// ranges no worker has taken, from a checkpoint. Taking work from here or
+// from another worker and writing a checkpoint hold work_lock, so no range
+// is ever in flight between two places while a checkpoint is written.
+typedef struct _range_t {
+    uint64_t lo, hi;
+} range_t;
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static range_t *pool;
+static unsigned pool_len;
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *out;
+static unsigned long long matches = 0;
+static volatile sig_atomic_t stop = 0;
+static uint64_t searched = 0;
+
+static int parse_pattern(const char *s, uint64_t *val, uint64_t *mask) {
+    unsigned i, n = strlen(s), p;
+    char c;
+
+    if (n == 0 || n > 16)
+        return 0;
+    *val = *mask = 0;
+    for (i = 0; i < n; ++i) {
+        p = 16 - n + i;
+        c = tolower(s[i]);
+        if (c == '?')
+            continue;
+        else if (c >= '0' && c <= '9')
+            *val |= (uint64_t)(c - '0') << (p * 4);
+        else if (c >= 'a' && c <= 'f')
+            *val |= (uint64_t)(c - 'a' + 0xa) << (p * 4);
+        else
+            return 0;
+        *mask |= 0xfull << (p * 4);
+    }
+    return 1;
+}
+
+// the candidate at an index, its low nibble in the first ? from the right
+static uint64_t candidate(uint64_t index) {
+    uint64_t v = fixed;
+    unsigned i;
+
+    for (i = 0; i < wild_count; ++i) {
+        v |= (index & 0xf) << (wild_pos[i] * 4);
+        index >>= 4;
+    }
+    return v;
+}
+
+static void print_match(uint64_t in, uint64_t res) {
+    u8 a[16], b[16];
+    unsigned i;
+
+    unpack(in, a);
+    unpack(res, b);
+    pthread_mutex_lock(&out_lock);
+    if (max_matches == 0 || matches < max_matches) {
+        for (i = start; i < 16; ++i)
+            fprintf(out, "%x", a[i]);
+        fprintf(out, " -> ");
+        for (i = start; i < 16; ++i)
+            fprintf(out, "%x", b[i]);
+        fprintf(out, "\n");
+        fflush(out);
+        if (++matches == max_matches)
+            stop = 1;
+    }
+    pthread_mutex_unlock(&out_lock);
+}
+
+static void search_chunk(uint64_t lo, uint64_t hi) {
+    uint64_t in[BATCH], res[BATCH], x, count = hi - lo;
+    unsigned i, n;
+
+    // counting through the ? bits alone steps to the next candidate
+    x = candidate(lo) & wild;
+    while (lo < hi) {
+        n = hi - lo < BATCH ? hi - lo : BATCH;
+        for (i = 0; i < n; ++i) {
+            in[i] = res[i] = fixed | x;
+            x = ((x | ~wild) + 1) & wild;
+        }
+        if (backward)
+            inverse_batch(res, n, rounds);
+        else
+            forward_batch(res, n, rounds);
+        for (i = 0; i < n; ++i)
+            if (((res[i] ^ want) & care) == 0)
+                print_match(in[i], res[i]);
+        lo += n;
+    }
+    __atomic_add_fetch(&searched, count, __ATOMIC_RELAXED);
+}
+
+// refill an empty worker from the pool or the fullest worker
+static int take_work(worker_t *w) {
+    worker_t *victim = NULL;
+    uint64_t most = 0, left, half;
+    unsigned i;
+    int found = 0;
+
+    pthread_mutex_lock(&work_lock);
+    if (pool_len > 0) {
+        --pool_len;
+        pthread_mutex_lock(&w->lock);
+        w->next = pool[pool_len].lo;
+        w->end = pool[pool_len].hi;
+        pthread_mutex_unlock(&w->lock);
+        found = 1;
+    } else {
+        for (i = 0; i < nworkers; ++i) {
+            pthread_mutex_lock(&workers[i].lock);
+            left = workers[i].end - workers[i].next;
+            pthread_mutex_unlock(&workers[i].lock);
+            if (left > most) {
+                most = left;
+                victim = &workers[i];
+            }
+        }
+        if (victim != NULL) {
+            pthread_mutex_lock(&victim->lock);
+            left = victim->end - victim->next;
+            if (left > 0) {
+                half = left - left / 2;
+                victim->end -= half;
+                pthread_mutex_lock(&w->lock);
+                w->next = victim->end;
+                w->end = victim->end + half;
+                pthread_mutex_unlock(&w->lock);
+                found = 1;
+            }
+            pthread_mutex_unlock(&victim->lock);
+        }
+    }
+    pthread_mutex_unlock(&work_lock);
+    return found;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    uint64_t lo, hi;
+
+    while (!stop) {
+        pthread_mutex_lock(&w->lock);
+        if (w->next == w->end) {
+            pthread_mutex_unlock(&w->lock);
+            if (!take_work(w))
+                break;
+            continue;
+        }
+        lo = w->cur = w->next;
+        hi = w->cur_end = w->end - lo > CHUNK ? lo + CHUNK : w->end;
+        w->next = hi;
+        pthread_mutex_unlock(&w->lock);
+
+        search_chunk(lo, hi);
+
+        pthread_mutex_lock(&w->lock);
+        w->cur = NONE;
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+
+////////////////////////////////
+// checkpoints
+//
+
+static char *checkpoint_name = NULL;
+
+static void checkpoint_header(char *buf, size_t size) {
+    snprintf(buf, size, "search 1 %s %u %s %s\n", backward ? "inverse" : "forward",
+            rounds, from_pattern, to_pattern);
+}
+
+// the pending ranges, 0 if the file is missing
+static int checkpoint_load(void) {
+    char header[128], line[128];
+    unsigned long long lo, hi;
+    unsigned alloc = 0;
+    FILE *file;
+
+    file = fopen(checkpoint_name, "r");
+    if (file == NULL)
+        return 0;
+    checkpoint_header(header, sizeof(header));
+    if (fgets(line, sizeof(line), file) == NULL || strcmp(line, header) != 0)
+        errx(1, "%s is a checkpoint of another search", checkpoint_name);
+    while (fscanf(file, "%llx %llx", &lo, &hi) == 2) {
+        if (lo >= hi || hi > space)
+            errx(1, "%s is corrupt", checkpoint_name);
+        if (pool_len == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            pool = realloc(pool, alloc * sizeof(*pool));
+            if (pool == NULL)
+                err(1, "Can't allocate ranges");
+        }
+        pool[pool_len].lo = lo;
+        pool[pool_len].hi = hi;
+        searched -= hi - lo;
+        ++pool_len;
+    }
+    fclose(file);
+    return 1;
+}
+
+// written to a temporary file and renamed over the last one
+static void checkpoint_save(void) {
+    char header[128], tmp[4096];
+    worker_t *w;
+    FILE *file;
+    unsigned i;
+
+    if (checkpoint_name == NULL)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_name);
+    file = fopen(tmp, "w");
+    if (file == NULL)
+        err(1, "Can't write %s", tmp);
+    checkpoint_header(header, sizeof(header));
+    fputs(header, file);
+
+    pthread_mutex_lock(&work_lock);
+    for (i = 0; i < pool_len; ++i)
+        fprintf(file, "%llx %llx\n", (unsigned long long)pool[i].lo, (unsigned long long)pool[i].hi);
+    for (i = 0; i < nworkers; ++i) {
+        w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        if (w->cur != NONE)
+            fprintf(file, "%llx %llx\n", (unsigned long long)w->cur, (unsigned long long)w->cur_end);
+        if (w->next < w->end)
+            fprintf(file, "%llx %llx\n", (unsigned long long)w->next, (unsigned long long)w->end);
+        pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_unlock(&work_lock);
+
+    if (fclose(file) != 0 || rename(tmp, checkpoint_name) != 0)
+        err(1, "Can't write %s", checkpoint_name);
+}
+
+static void interrupt(int signum) {
+    stop = 1;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(char *prog) {
+    printf("Usage: %s [options] <space> <match>\n", prog);
+    printf("\n");
+    printf("Runs every nibble vector in <space> through the encraption and prints\n");
+    printf("those whose result matches <match>. Both are up to 16 hex digits, with\n");
+    printf("? for any value.\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("    -i               run the inverse (decode) instead\n");
+    printf("    -r <rounds>      rounds of the transform (default 2, 4 for 16 nibbles)\n");
+    printf("    -t <threads>     worker threads (default one per CPU)\n");
+    printf("    -c <file>        checkpoint file, resumed from if it exists\n");
+    printf("    -k <seconds>     checkpoint interval (default 10)\n");
+    printf("    -o <file>        write matches to file\n");
+    printf("    -m <count>       stop after count matches\n");
+    printf("\n");
+    printf("Example: the seeds that encode to b53f3f\n");
+    printf("    %s '\?\?\?\?\?\?' b53f3f\n", prog);
+}
+
+int main(int argc, char **argv) {
+    uint64_t total, mask;
+    unsigned i, interval = 10;
+    double begin, last, t;
+    int opt, threads = 0, resumed;
+    char *out_name = NULL;
+
+    while ((opt = getopt(argc, argv, "ir:t:c:k:o:m:")) != -1) {
+        switch (opt) {
+            case 'i':
+                backward = 1;
+                break;
+            case 'r':
+                rounds = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                checkpoint_name = optarg;
+                break;
+            case 'k':
+                interval = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                out_name = optarg;
+                break;
+            case 'm':
+                max_matches = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    from_pattern = argv[optind];
+    to_pattern = argv[optind + 1];
+
+    len = strlen(from_pattern);
+    if (strlen(to_pattern) != len)
+        errx(1, "The patterns differ in length");
+    if (!parse_pattern(from_pattern, &fixed, &mask) || !parse_pattern(to_pattern, &want, &care))
+        errx(1, "Patterns are 1 to 16 hex digits or ?");
+    start = 16 - len;
+    if (rounds == 0)
+        rounds = len == 16 ? 4 : 2;
+
+    for (i = start; i < 16; ++i)
+        if (((mask >> (i * 4)) & 0xf) == 0)
+            wild_pos[wild_count++] = i;
+    if (wild_count > 15)
+        errx(1, "At most 15 nibbles can be ?");
+    transform_init(start);
+    wild = ~mask & upper;
+    space = 1ull << (wild_count * 4);
+
+    self_test(start);
+
+    out = stdout;
+    if (out_name != NULL) {
+        out = fopen(out_name, "a");
+        if (out == NULL)
+            err(1, "Can't open %s", out_name);
+    }
+
+    searched = space;
+    resumed = checkpoint_name != NULL && checkpoint_load();
+    if (!resumed) {
+        pool = malloc(sizeof(*pool));
+        if (pool == NULL)
+            err(1, "Can't allocate ranges");
+        pool[0].lo = 0;
+        pool[0].hi = space;
+        pool_len = 1;
+        searched = 0;
+    }
+    total = space - searched;
+    if (resumed)
+        fprintf(stderr, "resuming: %llu of %llu candidates left\n",
+                (unsigned long long)total, (unsigned long long)space);
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    nworkers = threads;
+    workers = calloc(nworkers, sizeof(*workers));
+    if (workers == NULL)
+        err(1, "Can't allocate workers");
+
+    signal(SIGINT, interrupt);
+    signal(SIGTERM, interrupt);
+
+    begin = last = now();
+    for (i = 0; i < nworkers; ++i) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].cur = NONE;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+            err(1, "Can't start worker");
+    }
+
+    // checkpoint until every worker is out of work
+    while (1) {
+        usleep(100000);
+        if (__atomic_load_n(&searched, __ATOMIC_RELAXED) == space || stop)
+            break;
+        t = now();
+        if (interval > 0 && t - last >= interval) {
+            checkpoint_save();
+            fprintf(stderr, "%.1f%% searched, %.0f candidates/s, %llu matches\n",
+                    100.0 * searched / space, (searched - (space - total)) / (t - begin), matches);
+            last = t;
+        }
+    }
+    for (i = 0; i < nworkers; ++i)
+        pthread_join(workers[i].thread, NULL);
+    checkpoint_save();
+
+    t = now() - begin;
+    fprintf(stderr, "%s: %llu candidates in %.1f s (%.0f/s) on %u threads, %llu matches\n",
+            searched == space ? "done" : "stopped",
+            (unsigned long long)(searched - (space - total)), t,
+            (searched - (space - total)) / t, nworkers, matches);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
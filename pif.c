@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "misc/cic.h"
+#include "pif.h"
+#include "sm5int.h"
+
+// Host (PIF) side of the CIC protocol
+//
+// The PIF is the clock master. DCLK (port 1) toggles every time the CIC
+// tests it, so any wait-for-level loop finishes within two checks. A
+// falling edge starts a bit period and the following rising edge ends it.
+//
+// DIO (port 2) is open drain: the CIC drives it with OUT (REG 2 holds the
+// level, REG f enables the driver) and the PIF pulls it low to send a 0.
+// When receiving, the PIF samples DIO on the rising edge.
+//
+// A session is the hello nibble, the encoded seed (6 nibbles) and the
+// encoded checksum (16 nibbles) from the CIC, followed by pif->rounds rounds
+// of the 6105 command: 2 command bits and 30 challenge nibbles to the CIC,
+// then 30 response nibbles back. Nibbles go MSB first.
+
+#define CMD_6105        2
+#define CHALLENGE_LEN   PIF_CHALLENGE_LEN
+
+
+static unsigned state_bits(int state) {
+    switch (state) {
+        case PIF_HELLO:     return 4;
+        case PIF_SEED:      return 6 * 4;
+        case PIF_CHECKSUM:  return 16 * 4;
+        case PIF_COMMAND:   return 2;
+        case PIF_CHALLENGE: return CHALLENGE_LEN * 4;
+        case PIF_RESPONSE:  return CHALLENGE_LEN * 4;
+    }
+    return 0;
+}
+
+static int sending(int state) {
+    return state == PIF_COMMAND || state == PIF_CHALLENGE;
+}
+
+static uint32_t xorshift(pif_t *pif) {
+    pif->rng ^= pif->rng << 13;
+    pif->rng ^= pif->rng >> 17;
+    pif->rng ^= pif->rng << 5;
+    return pif->rng;
+}
+
+static void new_challenge(pif_t *pif) {
+    int i;
+    for (i = 0; i < CHALLENGE_LEN; ++i)
+        pif->challenge[i] = xorshift(pif) & 0xf;
+}
+
+static int out_bit(pif_t *pif) {
+    if (pif->result.state == PIF_COMMAND)
+        return (CMD_6105 >> (1 - pif->bits)) & 1;
+    return (pif->challenge[pif->bits / 4] >> (3 - pif->bits % 4)) & 1;
+}
+
+static void in_bit(pif_t *pif, int bit) {
+    u8 *nibble = &pif->buf[pif->bits / 4];
+
+    if (pif->bits % 4 == 0)
+        *nibble = 0;
+    *nibble = (*nibble << 1) | bit;
+}
+
+static void dump_nibbles(pif_t *pif, sm5_t *s, const char *name, u8 *mem, unsigned len) {
+    unsigned i;
+
+    fprintf(pif->log, "%8u pif %s ", s->cpu.cycle, name);
+    for (i = 0; i < len; ++i)
+        fprintf(pif->log, "%x", mem[i]);
+    fprintf(pif->log, "\n");
+}
+
+static void next_state(pif_t *pif, sm5_t *s) {
+    u8 mem[CHALLENGE_LEN];
+
+    switch (pif->result.state) {
+        case PIF_HELLO:
+            pif->result.hello = pif->buf[0];
+            if (pif->log)
+                fprintf(pif->log, "%8u pif hello %x\n", s->cpu.cycle, pif->result.hello);
+            pif->result.state = PIF_SEED;
+            break;
+
+        case PIF_SEED:
+            memset(mem, 0, 16);
+            memcpy(mem + 0xa, pif->buf, 6);
+            inverse_22b(mem, 0xa);
+            inverse_22b(mem, 0xa);
+            memcpy(pif->result.seed, mem + 0xa, 6);
+            if (pif->log)
+                dump_nibbles(pif, s, "seed", pif->result.seed, 6);
+            pif->result.state = PIF_CHECKSUM;
+            break;
+
+        case PIF_CHECKSUM:
+            memcpy(pif->result.checksum, pif->buf, 16);
+            inverse_22b(pif->result.checksum, 0);
+            inverse_22b(pif->result.checksum, 0);
+            inverse_22b(pif->result.checksum, 0);
+            inverse_22b(pif->result.checksum, 0);
+            if (pif->log)
+                dump_nibbles(pif, s, "checksum", pif->result.checksum, 16);
+            if (pif->rounds == 0) {
+                pif->result.state = PIF_DONE;
+                break;
+            }
+            if (pif->serve) {
+                pif->result.state = PIF_READY;
+                break;
+            }
+            new_challenge(pif);
+            pif->result.state = PIF_COMMAND;
+            break;
+
+        case PIF_COMMAND:
+            pif->result.state = PIF_CHALLENGE;
+            break;
+
+        case PIF_CHALLENGE:
+            pif->result.state = PIF_RESPONSE;
+            break;
+
+        case PIF_RESPONSE:
+            if (pif->serve) {
+                pif->result.state = PIF_READY;
+                break;
+            }
+            memcpy(mem, pif->challenge, CHALLENGE_LEN);
+            algo_6105(mem, CHALLENGE_LEN);
+            if (pif->log) {
+                dump_nibbles(pif, s, "challenge", pif->challenge, CHALLENGE_LEN);
+                dump_nibbles(pif, s, "response", pif->buf, CHALLENGE_LEN);
+            }
+            if (memcmp(mem, pif->buf, CHALLENGE_LEN) != 0) {
+                ++pif->result.rounds_bad;
+                pif->result.state = PIF_FAIL;
+                break;
+            }
+            ++pif->result.rounds_ok;
+            if (pif->result.rounds_ok == pif->rounds) {
+                pif->result.state = PIF_DONE;
+                break;
+            }
+            new_challenge(pif);
+            pif->result.state = PIF_COMMAND;
+            break;
+    }
+
+    pif->bits = 0;
+    if (pif->result.state == PIF_DONE || pif->result.state == PIF_FAIL
+            || pif->result.state == PIF_READY)
+        sm5_stop(s);
+}
+
+static int dio(pif_t *pif, sm5_t *s) {
+    int cic = s->cpu.port2_hiz ? 1 : s->cpu.port[0] != 0;
+    return cic & pif->drive;
+}
+
+void pif_init(pif_t *pif) {
+    memset(pif, 0, sizeof(*pif));
+    pif->rounds = 1;
+    pif->seed = 1;
+}
+
+// call with sm5_reset at the start of each session
+void pif_reset(pif_t *pif) {
+    memset(&pif->result, 0, sizeof(pif->result));
+    pif->clk = 1;
+    pif->drive = 1;
+    pif->bits = 0;
+    pif->rng = pif->seed ? pif->seed : 1;
+    ++pif->seed;
+}
+
+// from PIF_READY: the command and challenge go out where the next round
+// would have started
+void pif_ask(pif_t *pif, const uint8_t *challenge) {
+    unsigned i;
+
+    for (i = 0; i < CHALLENGE_LEN; ++i)
+        pif->challenge[i] = challenge[i] & 0xf;
+    pif->result.state = PIF_COMMAND;
+    pif->bits = 0;
+}
+
+int pif_read(void *ctx, sm5_t *s, unsigned num) {
+    pif_t *pif = ctx;
+    int state = pif->result.state;
+
+    if (num == 2)
+        return dio(pif, s);
+    if (num != 1)
+        return s->cpu.port[num];
+
+    pif->clk = 1 - pif->clk;
+    if (state == PIF_DONE || state == PIF_FAIL || state == PIF_READY)
+        return pif->clk;
+
+    if (pif->clk == 0) {
+        pif->drive = sending(state) ? out_bit(pif) : 1;
+    } else {
+        if (!sending(state))
+            in_bit(pif, dio(pif, s));
+        if (++pif->bits == state_bits(state))
+            next_state(pif, s);
+    }
+
+    return pif->clk;
+}
@@ -0,0 +1,59 @@
+#ifndef __PIF_H__
+#define __PIF_H__
+
+#include <stdio.h>
+
+#include "sm5.h"
+
+enum {
+    PIF_HELLO,
+    PIF_SEED,
+    PIF_CHECKSUM,
+    PIF_COMMAND,
+    PIF_CHALLENGE,
+    PIF_RESPONSE,
+    PIF_DONE,
+    PIF_FAIL,
+    PIF_READY,      // serving: waiting for pif_ask
+};
+
+typedef struct _pif_result_t {
+    int state;
+    uint8_t hello;
+    uint8_t seed[6];
+    uint8_t checksum[16];
+    unsigned rounds_ok;
+    unsigned rounds_bad;
+} pif_result_t;
+
+// Host side of the CIC protocol, one per emulated CIC. Install with
+//   sm5_set_io(s, pif_read, NULL, &pif);
+// sm5_run returns SM5_STOPPED when the session is done or has failed.
+typedef struct _pif_t {
+    unsigned rounds;        // 6105 challenge/response rounds per session
+    uint32_t seed;          // PRNG seed for challenges, bumped every session
+    FILE *log;              // protocol trace, NULL for none
+    int serve;              // stop in PIF_READY instead of making challenges
+
+    pif_result_t result;
+
+    int clk;
+    int drive;
+    unsigned bits;
+    uint8_t buf[32];
+    uint8_t challenge[30];
+    uint32_t rng;
+} pif_t;
+
+void pif_init(pif_t *pif);
+void pif_reset(pif_t *pif);
+int pif_read(void *ctx, sm5_t *s, unsigned num);
+
+// Serving: with pif->serve set, a session stops in PIF_READY after the
+// checksum and after every response instead of checking it, so the CIC
+// can be used as a 6105 oracle. pif_ask sends the next challenge; sm5_run
+// stops again in PIF_READY with the response in buf.
+#define PIF_CHALLENGE_LEN 30
+void pif_ask(pif_t *pif, const uint8_t *challenge);
+
+#endif
@@ -0,0 +1,344 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "replay.h"
+
+// Port I/O log
+//
+// The log starts with "SM5L" and a version byte, followed by one record per
+// event: a tag byte, a value byte, and the number of cycles since the
+// previous event as a little-endian base-128 varint. The tag is EV_READ
+// or'd with the port number for a TPB read, EV_WRITE or'd with the REG
+// index for an OUT, EV_OUTL for an OUTL, or EV_END on the final record,
+// whose cycle is where the recorded session stopped. Version 1 logs have
+// no OUTL records, and OUTL isn't checked when replaying one.
+
+#define LOG_MAGIC   "SM5L"
+#define LOG_VERSION 2
+
+static port_backend_t *inner = NULL;
+static FILE *log_file = NULL;
+static unsigned last_cycle = 0;
+
+// replay state
+static u8 *log_buf = NULL;
+static size_t log_len = 0, log_pos = 0;
+static unsigned log_cycle = 0;      // cycle of the last event consumed
+static unsigned log_events = 0, matched = 0;
+static u8 log_version;
+static int diverged = 0;
+
+
+int log_check_header(FILE *file) {
+    char magic[5];
+
+    if (fread(magic, 5, 1, file) != 1)
+        return 0;
+    return memcmp(magic, LOG_MAGIC, 4) == 0 && magic[4] >= 1 && magic[4] <= LOG_VERSION;
+}
+
+int log_get(FILE *file, u8 *tag, u8 *val, unsigned *delta) {
+    unsigned shift = 0;
+    int t, v, b;
+
+    t = getc(file);
+    v = getc(file);
+    if (t == EOF || v == EOF)
+        return 0;
+
+    *tag = t;
+    *val = v;
+    *delta = 0;
+    do {
+        b = getc(file);
+        if (b == EOF)
+            return 0;
+        *delta |= (unsigned)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    return 1;
+}
+
+
+////////////////////////////////
+// record
+//
+
+static void put_event(u8 tag, u8 val) {
+    unsigned delta = cpu->cycle - last_cycle;
+
+    last_cycle = cpu->cycle;
+    fputc(tag, log_file);
+    fputc(val, log_file);
+    while (delta >= 0x80) {
+        fputc((delta & 0x7f) | 0x80, log_file);
+        delta >>= 7;
+    }
+    fputc(delta, log_file);
+}
+
+static void record_reset(void) {
+    last_cycle = 0;
+    if (inner->reset)
+        inner->reset();
+}
+
+static int record_read(unsigned num) {
+    int val = inner->read(num);
+    put_event(EV_READ | num, val);
+    return val;
+}
+
+static u8 write_tag(u8 reg) {
+    return reg == SM5_OUTL ? EV_OUTL : EV_WRITE | reg;
+}
+
+static void record_write(u8 reg, u8 val) {
+    put_event(write_tag(reg), val);
+    if (inner->write)
+        inner->write(reg, val);
+}
+
+// a restored snapshot rewinds the log to where the snapshot was taken
+typedef struct _record_state_t {
+    long pos;
+    unsigned last_cycle;
+} record_state_t;
+
+static void record_save(void *buf) {
+    record_state_t *rs = buf;
+
+    fflush(log_file);
+    rs->pos = ftell(log_file);
+    rs->last_cycle = last_cycle;
+    if (inner->save)
+        inner->save(rs + 1);
+}
+
+static void record_restore(const void *buf) {
+    const record_state_t *rs = buf;
+
+    fflush(log_file);
+    fseek(log_file, rs->pos, SEEK_SET);
+    if (ftruncate(fileno(log_file), rs->pos) != 0)
+        warn("Can't rewind log");
+    last_cycle = rs->last_cycle;
+    if (inner->restore)
+        inner->restore(rs + 1);
+}
+
+port_backend_t record_backend = {
+    .name = "record",
+    .reset = record_reset,
+    .read = record_read,
+    .write = record_write,
+    .save = record_save,
+    .restore = record_restore,
+};
+
+void record_open(const char *name) {
+    log_file = fopen(name, "w");
+    if (log_file == NULL)
+        err(1, "Can't open %s", name);
+
+    fwrite(LOG_MAGIC, 4, 1, log_file);
+    fputc(LOG_VERSION, log_file);
+
+    inner = backend;
+    record_backend.state_size = sizeof(record_state_t) + inner->state_size;
+    backend = &record_backend;
+}
+
+void record_close(void) {
+    if (log_file == NULL)
+        return;
+
+    put_event(EV_END, 0);
+    fclose(log_file);
+    log_file = NULL;
+    backend = inner;
+}
+
+
+////////////////////////////////
+// replay
+//
+
+// leaves tag, val and at alone unless there is a whole event
+static int next_event(u8 *tag, u8 *val, unsigned *at) {
+    unsigned delta = 0, shift = 0;
+    u8 b, t, v;
+
+    if (log_pos + 3 > log_len)
+        return 0;
+
+    t = log_buf[log_pos++];
+    v = log_buf[log_pos++];
+    do {
+        if (log_pos >= log_len)
+            return 0;
+        b = log_buf[log_pos++];
+        delta |= (unsigned)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    *tag = t;
+    *val = v;
+    *at = log_cycle + delta;
+    return 1;
+}
+
+static void describe(u8 tag, u8 val, unsigned at) {
+    if ((tag & 0xf0) == EV_READ)
+        printf("read port %u = %x at cycle %u", tag & 0xf, val, at);
+    else if ((tag & 0xf0) == EV_WRITE)
+        printf("write REG %x = %x at cycle %u", tag & 0xf, val, at);
+    else if (tag == EV_OUTL)
+        printf("write OUTL = %x at cycle %u", val, at);
+    else
+        printf("end of log at cycle %u", at);
+}
+
+static int expect(u8 tag, u8 val, u8 *logged_val) {
+    u8 ltag = EV_END, lval = 0;
+    unsigned at = log_cycle;
+
+    if (diverged)
+        return 0;
+
+    // past the end of the log, expect its end
+    next_event(&ltag, &lval, &at);
+
+    if (ltag != tag || at != cpu->cycle
+            || (((tag & 0xf0) == EV_WRITE || tag == EV_OUTL) && lval != val)) {
+        printf("replay diverged after %u events\n  expected ", matched);
+        describe(ltag, lval, at);
+        printf("\n  got      ");
+        describe(tag, val, cpu->cycle);
+        printf("\n");
+        diverged = 1;
+        finish();
+        return 0;
+    }
+
+    log_cycle = at;
+    ++matched;
+    *logged_val = lval;
+    return 1;
+}
+
+static void replay_reset(void) {
+    log_pos = 5;
+    log_cycle = 0;
+    matched = 0;
+    diverged = 0;
+}
+
+static int replay_read(unsigned num) {
+    u8 val = 0;
+    expect(EV_READ | num, 0, &val);
+    return val;
+}
+
+static void replay_write(u8 reg, u8 val) {
+    u8 lval;
+
+    if (reg == SM5_OUTL && log_version < 2)
+        return;
+    expect(write_tag(reg), val, &lval);
+}
+
+typedef struct _replay_state_t {
+    size_t pos;
+    unsigned cycle, matched;
+    int diverged;
+} replay_state_t;
+
+static void replay_save(void *buf) {
+    replay_state_t *rs = buf;
+
+    rs->pos = log_pos;
+    rs->cycle = log_cycle;
+    rs->matched = matched;
+    rs->diverged = diverged;
+}
+
+static void replay_restore(const void *buf) {
+    const replay_state_t *rs = buf;
+
+    log_pos = rs->pos;
+    log_cycle = rs->cycle;
+    matched = rs->matched;
+    diverged = rs->diverged;
+}
+
+port_backend_t replay_backend = {
+    .name = "replay",
+    .reset = replay_reset,
+    .read = replay_read,
+    .write = replay_write,
+    .state_size = sizeof(replay_state_t),
+    .save = replay_save,
+    .restore = replay_restore,
+};
+
+void replay_open(const char *name) {
+    FILE *file;
+    long len;
+    u8 tag = EV_END, val = 0;
+    int ended = 0;
+
+    file = fopen(name, "r");
+    if (file == NULL)
+        err(1, "Can't open %s", name);
+
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    log_buf = malloc(len);
+    if (log_buf == NULL)
+        err(1, "Can't allocate log buffer");
+    if (len < 5 || fread(log_buf, len, 1, file) != 1)
+        errx(1, "%s: short log", name);
+    fclose(file);
+
+    if (memcmp(log_buf, LOG_MAGIC, 4) != 0 || log_buf[4] < 1 || log_buf[4] > LOG_VERSION)
+        errx(1, "%s: not a port log", name);
+    log_version = log_buf[4];
+    log_len = len;
+
+    // find the end of the session
+    replay_reset();
+    log_events = 0;
+    while (next_event(&tag, &val, &log_cycle)) {
+        if (tag == EV_END) {
+            ended = 1;
+            break;
+        }
+        ++log_events;
+    }
+    if (!ended)
+        warnx("%s: log is truncated", name);
+    cycle_limit = log_cycle ? log_cycle : 1;
+    replay_reset();
+
+    backend = &replay_backend;
+}
+
+int replay_report(double secs) {
+    if (!diverged && matched < log_events) {
+        printf("replay stopped at cycle %u with %u of %u events matched\n",
+                cpu->cycle, matched, log_events);
+        diverged = 1;
+    }
+    if (!diverged)
+        printf("replay ok: %u events, %u cycles\n", matched, cpu->cycle);
+    if (secs > 0)
+        printf("%.0f cycles/s\n", cpu->cycle / secs);
+    return !diverged;
+}
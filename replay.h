@@ -0,0 +1,28 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "emu.h"
+
+#include <stdio.h>
+
+#define EV_READ     0x10
+#define EV_WRITE    0x20
+#define EV_END      0x30
+#define EV_OUTL     0x40
+
+// read one log record, returns 0 at end of file
+int log_get(FILE *file, u8 *tag, u8 *val, unsigned *delta);
+int log_check_header(FILE *file);
+
+// record every port read and OUT/OUTL write of the current backend to a log
+void record_open(const char *name);
+void record_close(void);
+
+// replace the backend with one that plays back and checks a log
+void replay_open(const char *name);
+int replay_report(double secs);
+
+extern port_backend_t record_backend;
+extern port_backend_t replay_backend;
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "romcov.h"
+
+// The file is "SM5C", a version byte, the little-endian 32-bit ROM id,
+// then the executed and skipped bitmaps.
+
+#define ROMCOV_MAGIC    "SM5C"
+#define ROMCOV_VERSION  1
+#define ROMCOV_SIZE     (4 + 1 + 4 + 2 * 0x80)
+
+typedef uint8_t u8;
+
+uint32_t romcov_rom_id(sm5_t *s) {
+    unsigned pages = sm5_variant(s)->rom_pages, page, addr;
+    uint32_t h = 2166136261u;
+
+    // FNV-1a
+    for (page = 0; page < pages; ++page)
+        for (addr = 0; addr < 0x40; ++addr) {
+            h ^= sm5_rom_byte(s, page, addr);
+            h *= 16777619u;
+        }
+    return h;
+}
+
+int romcov_load(const char *name, sm5_romcov_t *cov, uint32_t *rom_id) {
+    u8 buf[ROMCOV_SIZE];
+    FILE *file;
+    size_t r;
+
+    file = fopen(name, "r");
+    if (file == NULL)
+        return 0;
+    r = fread(buf, 1, sizeof(buf), file);
+    fclose(file);
+    if (r != sizeof(buf) || memcmp(buf, ROMCOV_MAGIC, 4) != 0 || buf[4] != ROMCOV_VERSION)
+        return 0;
+
+    *rom_id = buf[5] | buf[6] << 8 | buf[7] << 16 | (uint32_t)buf[8] << 24;
+    memcpy(cov->executed, buf + 9, 0x80);
+    memcpy(cov->skipped, buf + 9 + 0x80, 0x80);
+    return 1;
+}
+
+int romcov_save(const char *name, const sm5_romcov_t *cov, uint32_t rom_id) {
+    u8 buf[ROMCOV_SIZE];
+    FILE *file;
+    int ok;
+
+    memcpy(buf, ROMCOV_MAGIC, 4);
+    buf[4] = ROMCOV_VERSION;
+    buf[5] = rom_id;
+    buf[6] = rom_id >> 8;
+    buf[7] = rom_id >> 16;
+    buf[8] = rom_id >> 24;
+    memcpy(buf + 9, cov->executed, 0x80);
+    memcpy(buf + 9 + 0x80, cov->skipped, 0x80);
+
+    file = fopen(name, "w");
+    if (file == NULL)
+        return 0;
+    ok = fwrite(buf, sizeof(buf), 1, file) == 1;
+    if (fclose(file) != 0)
+        ok = 0;
+    return ok;
+}
+
+int romcov_merge_file(const char *name, const sm5_romcov_t *cov, uint32_t rom_id) {
+    sm5_romcov_t merged;
+    uint32_t id;
+    unsigned i;
+
+    if (romcov_load(name, &merged, &id)) {
+        if (id != rom_id)
+            return -1;
+        for (i = 0; i < 0x80; ++i) {
+            merged.executed[i] |= cov->executed[i];
+            merged.skipped[i] |= cov->skipped[i];
+        }
+    } else {
+        merged = *cov;
+    }
+    return romcov_save(name, &merged, rom_id);
+}
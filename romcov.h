@@ -0,0 +1,27 @@
+#ifndef __ROMCOV_H__
+#define __ROMCOV_H__
+
+#include <stdint.h>
+
+#include "sm5.h"
+
+// ROM coverage files, merged by OR and tied to the ROM they were taken on
+
+// hash of the instance's ROM, to catch merging coverage of another ROM
+uint32_t romcov_rom_id(sm5_t *s);
+// 0 if the file is missing or not a coverage file
+int romcov_load(const char *name, sm5_romcov_t *cov, uint32_t *rom_id);
+int romcov_save(const char *name, const sm5_romcov_t *cov, uint32_t rom_id);
+// OR the coverage into a file, creating it. 0 if it can't be written, -1
+// if it is for another ROM.
+int romcov_merge_file(const char *name, const sm5_romcov_t *cov, uint32_t rom_id);
+
+static inline int romcov_ran(const sm5_romcov_t *cov, unsigned a) {
+    return (cov->executed[a >> 3] >> (a & 7)) & 1;
+}
+
+static inline int romcov_skipped(const sm5_romcov_t *cov, unsigned a) {
+    return (cov->skipped[a >> 3] >> (a & 7)) & 1;
+}
+
+#endif
@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sm5int.h"
+#include "sched.h"
+
+// Linked instances
+//
+// Every write to a port is turned into events on the wires its instance
+// drives: the cycle and the new level, when the level changed. Events
+// queue on the wire until the reader's TPBs get to them, so a driver can
+// run as far ahead of its readers as it likes. A reader can't run ahead of
+// its drivers, though: a TPB at a cycle a driver hasn't reached yet would
+// miss writes still to come. Then the read callback blocks the instance,
+// which leaves the PC on the TPB, and the instance waits until the driver
+// has caught up. The instance furthest behind can always run, so the
+// instances never deadlock.
+//
+// This is what the scheduler gains over lockstep: instances switch only
+// when a TPB actually waits, rather than every instruction, and run in
+// slices with superinstructions and all. Slices are often only a few
+// instructions long, so they don't read the host clock.
+
+#define QUANTUM     10000       // cycles an instance runs before the next
+
+typedef struct _event_t {
+    unsigned cycle;
+    u8 level;
+} event_t;
+
+struct _node_t;
+
+typedef struct _wire_t {
+    struct _node_t *from, *to;
+    unsigned port;
+    sm5_level_fn level_fn;
+    u8 driven;                  // as the driver last wrote it
+    u8 level;                   // as the reader last saw it
+    event_t *ev;                // ring, a power of two in size
+    unsigned head, tail, size;
+    struct _wire_t *next_in, *next_out;
+} wire_t;
+
+typedef struct _node_t {
+    sm5_t *s;
+    unsigned base;              // cycle when added or reset
+    int status;
+    struct _node_t *wait_on;    // blocked until it gets to wait
+    unsigned wait;
+    wire_t *in[4], *out;
+
+    // the instance's own callbacks
+    sm5_read_fn read;
+    sm5_write_fn write;
+    void *ctx;
+} node_t;
+
+struct sm5_sched {
+    node_t **node;
+    unsigned nodes, max_nodes;
+    unsigned quantum;
+    unsigned horizon;           // where the current run ends
+    int lockstep;
+};
+
+int sm5_port2_level(sm5_t *s) {
+    return s->cpu.port2_hiz ? 1 : s->cpu.port[0] != 0;
+}
+
+static inline unsigned now(const node_t *n) {
+    return n->s->cpu.cycle - n->base;
+}
+
+// whether every write d will make up to cycle has been made
+static inline int caught_up(const node_t *d, unsigned cycle) {
+    return d->status != SM5_OK || (int)(now(d) - cycle) >= 0;
+}
+
+static int push(wire_t *w, unsigned cycle, u8 level) {
+    event_t *ev;
+    unsigned i, n;
+
+    if (w->tail - w->head == w->size) {
+        n = w->size ? w->size * 2 : 16;
+        ev = malloc(n * sizeof(*ev));
+        if (ev == NULL)
+            return 0;
+        for (i = 0; i < w->size; ++i)
+            ev[i] = w->ev[(w->head + i) & (w->size - 1)];
+        free(w->ev);
+        w->ev = ev;
+        w->tail -= w->head;
+        w->head = 0;
+        w->size = n;
+    }
+    w->ev[w->tail++ & (w->size - 1)] = (event_t){ cycle, level };
+    return 1;
+}
+
+static int sched_read(void *ctx, sm5_t *s, unsigned port) {
+    node_t *n = ctx;
+    wire_t *w = n->in[port & 3];
+    unsigned cycle;
+    event_t *ev;
+    int level = 1;
+
+    if (w == NULL)
+        return n->read ? n->read(n->ctx, s, port) : s->cpu.port[port];
+
+    // TPB takes a cycle, and sees the writes finished before it started
+    cycle = now(n) - 1;
+    for (; w != NULL; w = w->next_in)
+        if (!caught_up(w->from, cycle)) {
+            n->wait_on = w->from;
+            n->wait = cycle;
+            s->status = SM5_BLOCKED;
+            return 0;
+        }
+
+    for (w = n->in[port & 3]; w != NULL; w = w->next_in) {
+        while (w->head != w->tail) {
+            ev = &w->ev[w->head & (w->size - 1)];
+            if ((int)(ev->cycle - cycle) > 0)
+                break;
+            w->level = ev->level;
+            ++w->head;
+        }
+        level &= w->level;
+    }
+    return level;
+}
+
+static void sched_write(void *ctx, sm5_t *s, u8 reg, u8 val) {
+    node_t *n = ctx;
+    wire_t *w;
+    u8 level;
+
+    for (w = n->out; w != NULL; w = w->next_out) {
+        level = w->level_fn(s) != 0;
+        if (level == w->driven)
+            continue;
+        w->driven = level;
+        // out of memory: the reader just never sees it
+        push(w, now(n), level);
+    }
+    if (n->write)
+        n->write(n->ctx, s, reg, val);
+}
+
+static node_t *find(sm5_t *s) {
+    return s->read == sched_read ? s->io_ctx : NULL;
+}
+
+sm5_sched_t *sm5_sched_create(unsigned quantum) {
+    sm5_sched_t *sch = calloc(1, sizeof(*sch));
+
+    if (sch == NULL)
+        return NULL;
+    sch->quantum = quantum ? quantum : QUANTUM;
+    return sch;
+}
+
+void sm5_sched_destroy(sm5_sched_t *sch) {
+    node_t *n;
+    wire_t *w, *next;
+    unsigned i;
+
+    if (sch == NULL)
+        return;
+    for (i = 0; i < sch->nodes; ++i) {
+        n = sch->node[i];
+        sm5_set_io(n->s, n->read, n->write, n->ctx);
+        for (w = n->out; w != NULL; w = next) {
+            next = w->next_out;
+            free(w->ev);
+            free(w);
+        }
+        free(n);
+    }
+    free(sch->node);
+    free(sch);
+}
+
+int sm5_sched_add(sm5_sched_t *sch, sm5_t *s) {
+    node_t **grown, *n;
+
+    if (find(s) != NULL)
+        return SM5_OK;
+    if (sch->nodes == sch->max_nodes) {
+        grown = realloc(sch->node, (sch->max_nodes * 2 + 16) * sizeof(*grown));
+        if (grown == NULL)
+            return SM5_ERR_NOMEM;
+        sch->node = grown;
+        sch->max_nodes = sch->max_nodes * 2 + 16;
+    }
+    n = calloc(1, sizeof(*n));
+    if (n == NULL)
+        return SM5_ERR_NOMEM;
+    n->s = s;
+    n->base = s->cpu.cycle - sch->horizon;
+    n->status = SM5_OK;
+    n->read = s->read;
+    n->write = s->write;
+    n->ctx = s->io_ctx;
+    sm5_set_io(s, sched_read, sched_write, n);
+    sch->node[sch->nodes++] = n;
+    return SM5_OK;
+}
+
+int sm5_sched_wire(sm5_sched_t *sch, sm5_t *from, sm5_level_fn level, sm5_t *to, unsigned port) {
+    node_t *f = find(from), *t = find(to);
+    wire_t *w;
+
+    if (f == NULL || t == NULL || port < 1 || port > 3)
+        return SM5_ERR_RANGE;
+    w = calloc(1, sizeof(*w));
+    if (w == NULL)
+        return SM5_ERR_NOMEM;
+    w->from = f;
+    w->to = t;
+    w->port = port;
+    w->level_fn = level;
+    w->driven = w->level = level(from) != 0;
+    w->next_out = f->out;
+    f->out = w;
+    w->next_in = t->in[port];
+    t->in[port] = w;
+    return SM5_OK;
+}
+
+int sm5_sched_status(sm5_sched_t *sch, sm5_t *s) {
+    node_t *n = find(s);
+
+    return n != NULL ? n->status : SM5_ERR_RANGE;
+}
+
+void sm5_sched_reset(sm5_sched_t *sch) {
+    node_t *n;
+    wire_t *w;
+    unsigned i;
+
+    sch->horizon = 0;
+    for (i = 0; i < sch->nodes; ++i) {
+        n = sch->node[i];
+        n->base = n->s->cpu.cycle;
+        n->status = SM5_OK;
+        n->wait_on = NULL;
+    }
+    for (i = 0; i < sch->nodes; ++i)
+        for (w = sch->node[i]->out; w != NULL; w = w->next_out) {
+            w->head = w->tail = 0;
+            w->driven = w->level = w->level_fn(w->from->s) != 0;
+        }
+}
+
+void sm5_sched_lockstep(sm5_sched_t *sch, int enable) {
+    sch->lockstep = enable;
+}
+
+static int runnable(const sm5_sched_t *sch, const node_t *n) {
+    return n->status == SM5_OK && (int)(sch->horizon - now(n)) > 0
+        && (n->wait_on == NULL || caught_up(n->wait_on, n->wait));
+}
+
+// Until each instance is at the horizon. A blocked instance hands over to
+// the one it waits on, which soon blocks on it in turn, so linked
+// instances run together while they are in cache rather than once a pass
+// over all of them. The instance furthest behind is always runnable, so
+// every pass gets somewhere.
+static unsigned run_sliced(sm5_sched_t *sch) {
+    unsigned i, live, budget;
+    node_t *n;
+    int status;
+
+    do {
+        for (i = 0; i < sch->nodes; ++i)
+            for (n = sch->node[i]; runnable(sch, n); ) {
+                n->wait_on = NULL;
+                budget = sch->horizon - now(n);
+                if (budget > sch->quantum)
+                    budget = sch->quantum;
+                status = run_slice(n->s, budget);
+                if (status == SM5_BLOCKED)
+                    n = n->wait_on;
+                else if (status != SM5_OK)
+                    n->status = status;
+            }
+
+        for (i = live = 0; i < sch->nodes; ++i) {
+            n = sch->node[i];
+            live += n->status == SM5_OK && (int)(sch->horizon - now(n)) > 0;
+        }
+    } while (live > 0);
+
+    for (i = live = 0; i < sch->nodes; ++i)
+        live += sch->node[i]->status == SM5_OK;
+    return live;
+}
+
+// Every cycle, step each instance whose next instruction starts then. A
+// TPB's drivers have all got to its cycle by then, so nothing blocks.
+static unsigned run_lockstep(sm5_sched_t *sch, unsigned cycles) {
+    unsigned i, live = 0, cycle = sch->horizon - cycles;
+    node_t *n;
+    int status;
+
+    for (; cycle != sch->horizon; ++cycle)
+        for (i = 0; i < sch->nodes; ++i) {
+            n = sch->node[i];
+            while (n->status == SM5_OK && (int)(now(n) - cycle) <= 0) {
+                status = sm5_step(n->s);
+                if (status != SM5_OK)
+                    n->status = status;
+            }
+        }
+
+    for (i = 0; i < sch->nodes; ++i)
+        live += sch->node[i]->status == SM5_OK;
+    return live;
+}
+
+unsigned sm5_sched_run(sm5_sched_t *sch, unsigned cycles) {
+    sch->horizon += cycles;
+    return sch->lockstep ? run_lockstep(sch, cycles) : run_sliced(sch);
+}
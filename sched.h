@@ -0,0 +1,45 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include "sm5.h"
+
+// Linked instances: runs any number of instances on the calling thread,
+// with wires from an output of one to a TPB port of another. Each instance
+// runs on by itself in slices of up to a quantum of cycles, and stops only
+// when a TPB on a wired port would get ahead of an instance driving it,
+// so linked chips cost little more than unlinked ones.
+//
+// Cycle counts are from when the instance was added, or the last reset.
+// A TPB sees every write that finished before it started. Several wires
+// into one port are wired-AND, like open-drain lines with a pull-up.
+// Instance counters add up as usual, except host time.
+typedef struct sm5_sched sm5_sched_t;
+
+// level of an output, 0 or 1, from the driver's state after a port write
+typedef int (*sm5_level_fn)(sm5_t *s);
+
+// 0 quantum: the default
+sm5_sched_t *sm5_sched_create(unsigned quantum);
+// hands back the instances' own port callbacks
+void sm5_sched_destroy(sm5_sched_t *sch);
+
+// Takes over the port callbacks, so set them first: reads of ports without
+// wires and every write still reach them.
+int sm5_sched_add(sm5_sched_t *sch, sm5_t *s);
+int sm5_sched_wire(sm5_sched_t *sch, sm5_t *from, sm5_level_fn level, sm5_t *to, unsigned port);
+
+// Run every instance the given cycles further, or until it stops with an
+// event or an error. Returns how many are still running.
+unsigned sm5_sched_run(sm5_sched_t *sch, unsigned cycles);
+// how an instance stopped, SM5_OK while it runs
+int sm5_sched_status(sm5_sched_t *sch, sm5_t *s);
+// after resetting or restoring the instances: start over at cycle 0
+void sm5_sched_reset(sm5_sched_t *sch);
+// step every instance an instruction at a time in cycle order instead,
+// with the same results, to compare against
+void sm5_sched_lockstep(sm5_sched_t *sch, int enable);
+
+// port 2 as the pin sees it: pulled up while Hi-Z
+int sm5_port2_level(sm5_t *s);
+
+#endif
@@ -0,0 +1,334 @@
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+
+// Challenge/response server
+//
+// A request is a length byte and that many challenge nibbles, one per
+// byte; the reply is a length byte and the response nibbles, or a zero
+// length if the request wasn't PIF_CHALLENGE_LEN nibbles or the CIC didn't
+// answer. Replies come back in request order, and a client can send as
+// many requests ahead as it likes.
+//
+// The ROM is booted once, up to the point where the PIF would send its
+// first challenge, and that state is kept. Every request restores it into
+// an instance and runs one round, so answers don't depend on what was
+// asked before and any instance can take any request. Each connection has
+// a reader, which queues requests into a ring of slots, and a writer,
+// which sends the answers as their slots fill, in order. Workers, one per
+// instance, take requests from a queue shared by all connections.
+
+#define RING            256         // requests in flight per connection
+#define REQUEST_CYCLES  1000000     // to answer one challenge
+
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_DONE };
+
+struct stream;
+
+typedef struct _slot_t {
+    int state;
+    u8 len;
+    u8 nibbles[256];                // challenge, then response
+    struct stream *stream;
+    struct _slot_t *next;           // in the queue
+} slot_t;
+
+typedef struct stream {
+    FILE *in, *out;
+    slot_t slot[RING];
+    unsigned long long read, written;
+    int eof;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} stream_t;
+
+typedef struct _instance_t {
+    sm5_t *sm;
+    pif_t pif;
+    pthread_t thread;
+} instance_t;
+
+// the booted state
+static sm5_state_t warm;
+static pif_t warm_pif;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static slot_t *queue_head = NULL, *queue_tail = NULL;
+
+static unsigned long long served = 0;
+
+
+////////////////////////////////
+// instances
+//
+
+static sm5_t *instance(sm5_image_t *image, pif_t *pif) {
+    sm5_t *s = sm5_create_variant(sm5_variant(sm)->name);
+
+    if (s == NULL || sm5_set_image(s, image) != SM5_OK)
+        errx(1, "Can't create an instance");
+    sm5_set_io(s, pif_read, NULL, pif);
+    return s;
+}
+
+static void boot(sm5_image_t *image) {
+    sm5_t *s;
+    int status;
+
+    pif_init(&warm_pif);
+    warm_pif.serve = 1;
+    s = instance(image, &warm_pif);
+    pif_reset(&warm_pif);
+    status = sm5_run(s, cycle_limit ? cycle_limit : 10000000);
+    if (warm_pif.result.state != PIF_READY)
+        errx(1, "The ROM didn't get to the first challenge (%s at cycle %u)",
+                sm5_strerror(status), sm5_state(s)->cycle);
+    sm5_snapshot(s, &warm);
+    sm5_destroy(s);
+}
+
+static int answer(instance_t *in, u8 *nibbles) {
+    int status;
+
+    sm5_restore(in->sm, &warm);
+    in->pif = warm_pif;
+    pif_ask(&in->pif, nibbles);
+    status = sm5_run(in->sm, REQUEST_CYCLES);
+    if (status != SM5_STOPPED || in->pif.result.state != PIF_READY)
+        return 0;
+    memcpy(nibbles, in->pif.buf, PIF_CHALLENGE_LEN);
+    return 1;
+}
+
+static void *worker(void *arg) {
+    instance_t *in = arg;
+    stream_t *st;
+    slot_t *slot;
+    int ok;
+
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        slot = queue_head;
+        queue_head = slot->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        ok = answer(in, slot->nibbles);
+
+        st = slot->stream;
+        pthread_mutex_lock(&st->lock);
+        slot->len = ok ? PIF_CHALLENGE_LEN : 0;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+    return NULL;
+}
+
+static void enqueue(slot_t *slot) {
+    pthread_mutex_lock(&queue_lock);
+    slot->next = NULL;
+    if (queue_tail != NULL)
+        queue_tail->next = slot;
+    else
+        queue_head = slot;
+    queue_tail = slot;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+
+////////////////////////////////
+// connections
+//
+
+// answers in request order, flushing whenever the next isn't ready
+static void *writer(void *arg) {
+    stream_t *st = arg;
+    slot_t *slot;
+    int broken = 0;
+
+    pthread_mutex_lock(&st->lock);
+    while (1) {
+        slot = &st->slot[st->written % RING];
+        if (st->written < st->read && slot->state == SLOT_DONE) {
+            pthread_mutex_unlock(&st->lock);
+            if (!broken && (fputc(slot->len, st->out) == EOF
+                    || fwrite(slot->nibbles, 1, slot->len, st->out) != slot->len))
+                broken = 1;
+            pthread_mutex_lock(&st->lock);
+            slot->state = SLOT_FREE;
+            ++st->written;
+            pthread_cond_broadcast(&st->cond);
+            continue;
+        }
+        if (st->eof && st->written == st->read)
+            break;
+        pthread_mutex_unlock(&st->lock);
+        if (!broken && fflush(st->out) == EOF)
+            broken = 1;
+        pthread_mutex_lock(&st->lock);
+        // anything that came in while flushing
+        if (st->written < st->read && slot->state == SLOT_DONE)
+            continue;
+        if (st->eof && st->written == st->read)
+            break;
+        pthread_cond_wait(&st->cond, &st->lock);
+    }
+    pthread_mutex_unlock(&st->lock);
+    fflush(st->out);
+    return NULL;
+}
+
+static void stream_serve(FILE *in, FILE *out) {
+    stream_t *st;
+    pthread_t thread;
+    slot_t *slot;
+    int len;
+
+    st = calloc(1, sizeof(*st));
+    if (st == NULL)
+        err(1, "Can't allocate connection");
+    st->in = in;
+    st->out = out;
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->cond, NULL);
+    if (pthread_create(&thread, NULL, writer, st) != 0)
+        err(1, "Can't start writer");
+
+    while ((len = fgetc(in)) != EOF) {
+        slot = &st->slot[st->read % RING];
+        pthread_mutex_lock(&st->lock);
+        while (slot->state != SLOT_FREE)
+            pthread_cond_wait(&st->cond, &st->lock);
+        pthread_mutex_unlock(&st->lock);
+
+        if (fread(slot->nibbles, 1, len, in) != len)
+            break;
+        slot->stream = st;
+        pthread_mutex_lock(&st->lock);
+        ++st->read;
+        if (len == PIF_CHALLENGE_LEN) {
+            slot->state = SLOT_QUEUED;
+            pthread_mutex_unlock(&st->lock);
+            enqueue(slot);
+        } else {
+            slot->len = 0;
+            slot->state = SLOT_DONE;
+            pthread_cond_broadcast(&st->cond);
+            pthread_mutex_unlock(&st->lock);
+        }
+    }
+
+    pthread_mutex_lock(&st->lock);
+    st->eof = 1;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+    pthread_join(thread, NULL);
+
+    __atomic_add_fetch(&served, st->read, __ATOMIC_RELAXED);
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->cond);
+    free(st);
+}
+
+static void *connection(void *arg) {
+    int fd = (intptr_t)arg, fd2 = dup(fd);
+    FILE *in = fdopen(fd, "r"), *out = fd2 < 0 ? NULL : fdopen(fd2, "w");
+
+    if (in == NULL || out == NULL) {
+        warn("Can't serve connection");
+        if (in != NULL)
+            fclose(in);
+        else
+            close(fd);
+        if (fd2 >= 0 && out == NULL)
+            close(fd2);
+        return NULL;
+    }
+    stream_serve(in, out);
+    fclose(in);
+    fclose(out);
+    return NULL;
+}
+
+static void listen_on(const char *path) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+    int fd, client;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        err(1, "Can't create socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        errx(1, "Socket path %s is too long", path);
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+        err(1, "Can't listen on %s", path);
+
+    while (1) {
+        client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            warn("accept");
+            continue;
+        }
+        if (pthread_create(&thread, NULL, connection, (void *)(intptr_t)client) != 0) {
+            warn("Can't start connection");
+            close(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+void serve(sm5_image_t *image, const char *path, unsigned instances) {
+    struct timespec start, end;
+    instance_t *pool;
+    unsigned i;
+    double secs;
+
+    verbose = 0;
+    signal(SIGPIPE, SIG_IGN);
+
+    boot(image);
+
+    if (instances == 0)
+        instances = sysconf(_SC_NPROCESSORS_ONLN);
+    if (instances == 0)
+        instances = 1;
+    pool = calloc(instances, sizeof(*pool));
+    if (pool == NULL)
+        err(1, "Can't allocate instances");
+    for (i = 0; i < instances; ++i) {
+        pool[i].sm = instance(image, &pool[i].pif);
+        if (pthread_create(&pool[i].thread, NULL, worker, &pool[i]) != 0)
+            err(1, "Can't start worker");
+    }
+    sm5_image_release(image);
+    fprintf(stderr, "booted in %u cycles, serving with %u instances\n", warm.cycle, instances);
+
+    if (path != NULL)
+        listen_on(path);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stream_serve(stdin, stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "served %llu requests in %.3f s, %.0f/s\n", served, secs, served / secs);
+}
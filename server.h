@@ -0,0 +1,12 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include "emu.h"
+
+// Boot image once with the PIF in serving mode, then answer 6105
+// challenges with a pool of instances restored from the booted state: on
+// stdin and stdout, or on each connection to a Unix socket at path. Takes
+// over the reference to image.
+void serve(sm5_image_t *image, const char *path, unsigned instances);
+
+#endif
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sm5int.h"
+#include "variants.h"
+
+////////////////////////////////
+// core
+//
+
+#define X(name, ...) extern const sm5_core_t core_##name;
+SM5_VARIANTS(X)
+#undef X
+
+#define X(name, ...) &core_##name.variant,
+static const sm5_variant_t *const variants[] = { SM5_VARIANTS(X) NULL };
+#undef X
+
+#define X(name, ...) &core_##name,
+static const sm5_core_t *const cores[] = { SM5_VARIANTS(X) };
+#undef X
+
+const sm5_core_t *core_find(const char *name) {
+    unsigned i;
+
+    if (name == NULL)
+        return cores[0];
+    for (i = 0; i < sizeof(cores) / sizeof(cores[0]); ++i)
+        if (strcmp(cores[i]->variant.name, name) == 0)
+            return cores[i];
+    return NULL;
+}
+
+// starts with the blank ROM
+static sm5_t *create(const sm5_core_t *core) {
+    sm5_image_t *blank;
+    sm5_t *s;
+
+    hash_init();
+
+    if (core == NULL)
+        return NULL;
+    if (posix_memalign((void **)&s, 64, sizeof(*s)) != 0)
+        return NULL;
+    memset(s, 0, sizeof(*s));
+    s->core = core;
+    s->fuse = 1;
+    blank = sm5_image_mem(NULL, 0, core->variant.name);
+    if (blank == NULL) {
+        free(s);
+        return NULL;
+    }
+    sm5_set_image(s, blank);
+    sm5_image_release(blank);
+    sm5_reset(s);
+    return s;
+}
+
+sm5_t *sm5_create(void) {
+    return create(core_find(NULL));
+}
+
+sm5_t *sm5_create_variant(const char *name) {
+    return create(core_find(name));
+}
+
+const sm5_variant_t *sm5_variant(sm5_t *s) {
+    return &s->core->variant;
+}
+
+const sm5_variant_t *const *sm5_variants(void) {
+    return variants;
+}
+
+void sm5_destroy(sm5_t *s) {
+    if (s == NULL)
+        return;
+    memo_free(s);
+    loop_free(s);
+    sm5_image_release(s->image);
+    free(s);
+}
+
+const char *sm5_strerror(int status) {
+    switch (status) {
+        case SM5_OK:            return "ok";
+        case SM5_HALT:          return "halted";
+        case SM5_STOPPED:       return "stopped";
+        case SM5_LOOP:          return "state loop";
+        case SM5_BLOCKED:       return "blocked on a linked instance";
+        case SM5_ERR_OVERFLOW:  return "overflow!";
+        case SM5_ERR_UNDERFLOW: return "underflow!";
+        case SM5_ERR_OPCODE:    return "unknown opcode";
+        case SM5_ERR_IO:        return "can't read ROM";
+        case SM5_ERR_NOMEM:     return "out of memory";
+        case SM5_ERR_VARIANT:   return "image is for another variant";
+        case SM5_ERR_RANGE:     return "patch beyond the end of ROM";
+    }
+    return "unknown status";
+}
+
+int sm5_load_rom_mem(sm5_t *s, const u8 *rom, size_t len) {
+    sm5_image_t *image = sm5_image_mem(rom, len, s->core->variant.name);
+
+    if (image == NULL)
+        return SM5_ERR_NOMEM;
+    sm5_set_image(s, image);
+    sm5_image_release(image);
+    return SM5_OK;
+}
+
+int sm5_load_rom(sm5_t *s, const char *path) {
+    sm5_image_t *image = sm5_image_load(path, s->core->variant.name);
+
+    if (image == NULL)
+        return SM5_ERR_IO;
+    sm5_set_image(s, image);
+    sm5_image_release(image);
+    return SM5_OK;
+}
+
+u8 sm5_rom_byte(sm5_t *s, u8 page, u8 addr) {
+    return s->img->rom[page & (s->core->variant.rom_pages - 1)][addr & 0x3f];
+}
+
+void sm5_set_io(sm5_t *s, sm5_read_fn read, sm5_write_fn write, void *ctx) {
+    s->read = read;
+    s->write = write;
+    s->io_ctx = ctx;
+}
+
+void sm5_reset(sm5_t *s) {
+    memset(&s->cpu, 0, sizeof(s->cpu));
+    s->cpu.port2_hiz = 1;
+    s->status = SM5_OK;
+    s->stop = 0;
+    s->prev_loc = 0;
+    hash_reset(s);
+    sm5_taint_clear(s);
+}
+
+unsigned sm5_fetch(sm5_t *s, u8 *op, u8 *arg) {
+    return s->core->fetch(s, op, arg);
+}
+
+int sm5_step(sm5_t *s) {
+    unsigned cycle = s->cpu.cycle;
+    int status = s->core->step(s);
+
+    s->stats.cycles += s->cpu.cycle - cycle;
+    return status;
+}
+
+static unsigned long long insns_run(const sm5_stats_t *st) {
+    unsigned long long n = st->skipped;
+    unsigned i;
+
+    for (i = 0; i < SM5_CLASSES; ++i)
+        n += st->insns[i];
+    return n;
+}
+
+int run_slice(sm5_t *s, unsigned cycles) {
+    unsigned long long insns = insns_run(&s->stats);
+    unsigned cycle = s->cpu.cycle;
+    int status = s->core->run(s, cycles);
+
+    s->stats.cycles += s->cpu.cycle - cycle;
+    s->stats.run_insns += insns_run(&s->stats) - insns;
+    return status;
+}
+
+int sm5_run(sm5_t *s, unsigned cycles) {
+    struct timespec start, end;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = run_slice(s, cycles);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    s->stats.host_ns += (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+    return status;
+}
+
+void sm5_stop(sm5_t *s) {
+    s->stop = 1;
+}
+
+sm5_state_t *sm5_state(sm5_t *s) {
+    return &s->cpu;
+}
+
+void sm5_snapshot(sm5_t *s, sm5_state_t *out) {
+    *out = s->cpu;
+}
+
+void sm5_restore(sm5_t *s, const sm5_state_t *in) {
+    s->cpu = *in;
+    s->prev_loc = 0;
+    hash_reset(s);
+    sm5_taint_clear(s);
+}
+
+void sm5_invalidate(sm5_t *s) {
+    hash_reset(s);
+}
+
+void sm5_poke(sm5_t *s, u8 addr, u8 val) {
+    RAM_SET(s, addr, val);
+    TAINT(s->taint.ram[addr] = SM5_TAINT_HOST);
+    hash_reset(s);
+}
+
+void sm5_romcov_merge(sm5_t *s, sm5_romcov_t *cov) {
+    unsigned i;
+
+    for (i = 0; i < 0x400; ++i) {
+        if (s->rom_cov[0][i])
+            cov->executed[i >> 3] |= 1 << (i & 7);
+        if (s->rom_cov[1][i])
+            cov->skipped[i >> 3] |= 1 << (i & 7);
+    }
+}
+
+void sm5_romcov_clear(sm5_t *s) {
+    memset(s->rom_cov, 0, sizeof(s->rom_cov));
+}
+
+void sm5_coverage(sm5_t *s, u8 *map) {
+    s->edges = map;
+    s->prev_loc = 0;
+}
+
+void sm5_fusion_enable(sm5_t *s, int enable) {
+    s->fuse = enable;
+}
+
+unsigned sm5_fusion_stats(sm5_t *s, sm5_fusion_stat_t *stats, unsigned max) {
+    unsigned i;
+
+    for (i = 0; i < s->core->fusions && i < max; ++i) {
+        stats[i].name = s->core->fusion_name[i + 1];
+        stats[i].sites = s->img->fusion_sites[i + 1];
+        stats[i].fired = s->fusion_fired[i + 1];
+    }
+    return s->core->fusions;
+}
+
+void sm5_stats(sm5_t *s, sm5_stats_t *stats) {
+    *stats = s->stats;
+}
+
+void sm5_stats_clear(sm5_t *s) {
+    memset(&s->stats, 0, sizeof(s->stats));
+}
+
+void sm5_stats_add(sm5_stats_t *total, const sm5_stats_t *st) {
+    unsigned i;
+
+    for (i = 0; i < SM5_CLASSES; ++i)
+        total->insns[i] += st->insns[i];
+    total->skipped += st->skipped;
+    total->fused += st->fused;
+    total->interrupts += st->interrupts;
+    total->port_reads += st->port_reads;
+    total->port_writes += st->port_writes;
+    total->cycles += st->cycles;
+    total->run_insns += st->run_insns;
+    total->host_ns += st->host_ns;
+    if (st->stack_max > total->stack_max)
+        total->stack_max = st->stack_max;
+}
+
+const char *sm5_class_name(unsigned cls) {
+    static const char *const names[SM5_CLASSES] = {
+        [SM5_CLASS_CONTROL] = "control",
+        [SM5_CLASS_TRANSFER] = "transfer",
+        [SM5_CLASS_ARITH] = "arith",
+        [SM5_CLASS_TEST] = "test",
+        [SM5_CLASS_BIT] = "bit",
+        [SM5_CLASS_IO] = "io",
+        [SM5_CLASS_OTHER] = "other",
+    };
+
+    return cls < SM5_CLASSES ? names[cls] : "unknown";
+}
+
+const sm5_taint_t *sm5_taint(sm5_t *s) {
+#ifdef SM5_TAINT
+    return &s->taint;
+#else
+    return NULL;
+#endif
+}
+
+void sm5_taint_clear(sm5_t *s) {
+    TAINT(memset(&s->taint, 0, sizeof(s->taint)));
+}
+
+const char *sm5_taint_name(u8 tag, char *buf, size_t len) {
+    static const char *const names[] = { "port", "dta", "pat", "const", "host" };
+    size_t n = 0;
+    unsigned i;
+
+    if (len == 0)
+        return buf;
+    buf[0] = 0;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        if ((tag & (1 << i)) && n < len)
+            n += snprintf(buf + n, len - n, "%s%s", n ? " " : "", names[i]);
+    if (n == 0)
+        snprintf(buf, len, "-");
+    return buf;
+}
+
+
+////////////////////////////////
+// disassembler
+//
+
+unsigned sm5_insn_len(u8 op) {
+    // TL, CALL, DTA and PAT take an argument byte
+    if (op >= 0xE0 || op == 0x69 || op == 0x6A)
+        return 2;
+    return 1;
+}
+
+// grouped as the disassembler below groups them
+unsigned sm5_insn_class(u8 op) {
+    if (op >= 0x80 || op == 0x7D || op == 0x7E || op == 0x7F)
+        return SM5_CLASS_CONTROL;
+    if ((op >= 0x10 && op <= 0x3F) || (op >= 0x50 && op <= 0x5F) || (op >= 0x64 && op <= 0x68))
+        return SM5_CLASS_TRANSFER;
+    if ((op >= 0x01 && op <= 0x0F) || op == 0x78 || op == 0x79 || op == 0x7A || op == 0x7B || op == 0x7C)
+        return SM5_CLASS_ARITH;
+    if ((op >= 0x48 && op <= 0x4F) || op == 0x6B || op == 0x6E || op == 0x6F)
+        return SM5_CLASS_TEST;
+    if ((op >= 0x40 && op <= 0x47) || (op >= 0x60 && op <= 0x63))
+        return SM5_CLASS_BIT;
+    if (op == 0x71 || op == 0x75)
+        return SM5_CLASS_IO;
+    return SM5_CLASS_OTHER;
+}
+
+int sm5_disasm(u8 op, u8 arg, char *buf, size_t len) {
+    // NOP
+    if (op == 0x00) {
+        return snprintf(buf, len, "nop");
+    }
+
+    // control
+    else if (op >= 0x80 && op <= 0xBF) {
+        return snprintf(buf, len, "tr %02x", op & 0b111111);
+    } else if (op >= 0xE0 && op <= 0xEF) {
+        return snprintf(buf, len, "tl %x.%02x", ((op & 0xf) << 2) | (arg >> 6), arg & 0b111111);
+    } else if (op >= 0xC0 && op <= 0xDF) {
+        return snprintf(buf, len, "trs %x", op & 0b11111);
+    } else if (op >= 0xF0 && op <= 0xFF) {
+        return snprintf(buf, len, "call %x.%02x", ((op & 0xf) << 2) | (arg >> 6), arg & 0b111111);
+    } else if (op == 0x7D) {
+        return snprintf(buf, len, "rtn");
+    } else if (op == 0x7E) {
+        return snprintf(buf, len, "rtns");
+    } else if (op == 0x7F) {
+        return snprintf(buf, len, "rtni");
+    }
+
+    // data transfer
+    else if (op >= 0x10 && op <= 0x1F) {
+        return snprintf(buf, len, "lax %x", op & 0b1111);
+    } else if (op >= 0x30 && op <= 0x3F) {
+        return snprintf(buf, len, "lbmx %x", op & 0b1111);
+    } else if (op >= 0x20 && op <= 0x2F) {
+        return snprintf(buf, len, "lblx %x", op & 0b1111);
+    } else if (op >= 0x50 && op <= 0x53) {
+        return snprintf(buf, len, "lda %x", op & 0b11);
+    } else if (op >= 0x54 && op <= 0x57) {
+        return snprintf(buf, len, "exc %x", op & 0b11);
+    } else if (op >= 0x58 && op <= 0x5B) {
+        return snprintf(buf, len, "exci %x", op & 0b11);
+    } else if (op >= 0x5C && op <= 0x5F) {
+        return snprintf(buf, len, "excd %d", op & 0b11);
+    } else if (op == 0x64) {
+        return snprintf(buf, len, "exax");
+    } else if (op == 0x65) {
+        return snprintf(buf, len, "atx");
+    } else if (op == 0x66) {
+        return snprintf(buf, len, "exbm");
+    } else if (op == 0x67) {
+        return snprintf(buf, len, "exbl");
+    } else if (op == 0x68) {
+        return snprintf(buf, len, "ex");
+    }
+
+    // arithmetic
+    else if (op >= 0x00 && op <= 0x0F) {
+        return snprintf(buf, len, "adx %x", op & 0b1111);
+    } else if (op == 0x7A) {
+        return snprintf(buf, len, "add");
+    } else if (op == 0x7B) {
+        return snprintf(buf, len, "adc");
+    } else if (op == 0x79) {
+        return snprintf(buf, len, "coma");
+    } else if (op == 0x78) {
+        return snprintf(buf, len, "incb");
+    } else if (op == 0x7C) {
+        return snprintf(buf, len, "decb");
+    }
+
+    // test
+    else if (op == 0x6E) {
+        return snprintf(buf, len, "tc");
+    } else if (op == 0x6F) {
+        return snprintf(buf, len, "tam");
+    } else if (op >= 0x48 && op <= 0x4B) {
+        return snprintf(buf, len, "tm %x", op & 0b11);
+    } else if (op == 0x6B) {
+        return snprintf(buf, len, "tabl");
+    } else if (op >= 0x4C && op <= 0x4F) {
+        return snprintf(buf, len, "tpb %x", op & 0b11);
+    }
+
+    // bit manip
+    else if (op >= 0x40 && op <= 0x43) {
+        return snprintf(buf, len, "rm %x", op & 0b11);
+    } else if (op >= 0x44 && op <= 0x47) {
+        return snprintf(buf, len, "sm %x", op & 0b11);
+    } else if (op == 0x61) {
+        return snprintf(buf, len, "sc");
+    } else if (op == 0x60) {
+        return snprintf(buf, len, "rc");
+    } else if (op == 0x62) {
+        return snprintf(buf, len, "id");
+    } else if (op == 0x63) {
+        return snprintf(buf, len, "ie");
+    }
+
+    // io control
+    else if (op == 0x71) {
+        return snprintf(buf, len, "outl");
+    } else if (op == 0x75) {
+        return snprintf(buf, len, "out");
+    }
+
+    // unknown
+    else if (op == 0x6A) {
+        return snprintf(buf, len, "pat %x", arg);
+    } else if (op == 0x69) {
+        return snprintf(buf, len, "dta");
+    }
+
+    // special
+    else if (op == 0x77) {
+        return snprintf(buf, len, "halt");
+    }
+
+
+    else {
+        return snprintf(buf, len, "unknown");
+    }
+}
@@ -0,0 +1,306 @@
+#ifndef __SM5_H__
+#define __SM5_H__
+
+// libsm5: embeddable Sharp SM5 core
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _sm5_pc_t {
+    uint8_t page;
+    uint8_t addr;
+} sm5_pc_t;
+
+// CPU state
+//
+// Everything the SM5 holds lives in one cache-aligned struct so a snapshot,
+// fork or compare is a plain copy or memcmp. Build with PACKED=1 to store
+// RAM and REG two nibbles per byte (even address in the low nibble), which
+// brings the whole machine down to three cache lines. Use the sm5_ram_ and
+// sm5_reg_ accessors rather than indexing the arrays.
+typedef struct _sm5_state_t {
+#ifdef PACKED_STATE
+    uint8_t ram[0x80];
+    uint8_t reg[0x08];
+#else
+    uint8_t ram[0x100]; // A-series chips have 2x the RAM of non-A chips
+    uint8_t reg[0x10];
+#endif
+    sm5_pc_t pc;
+    sm5_pc_t frame_pc;
+    sm5_pc_t stack[4];
+    uint8_t sp;
+    uint8_t A, X;
+    uint8_t BL, BM, SB;
+    uint8_t C;
+    uint8_t skip;
+    uint8_t interrupt;
+    uint8_t port[4];
+    uint8_t port2_hiz;
+    unsigned cycle;
+} __attribute__((aligned(64))) sm5_state_t;
+
+#ifdef PACKED_STATE
+#define SM5_NIBBLE_SHIFT(a) (((a) & 1) << 2)
+
+static inline uint8_t sm5_ram_peek(const sm5_state_t *c, uint8_t addr) {
+    return (c->ram[addr >> 1] >> SM5_NIBBLE_SHIFT(addr)) & 0xf;
+}
+
+static inline void sm5_ram_poke(sm5_state_t *c, uint8_t addr, uint8_t val) {
+    uint8_t *p = &c->ram[addr >> 1];
+    *p = (*p & ~(0xf << SM5_NIBBLE_SHIFT(addr))) | ((val & 0xf) << SM5_NIBBLE_SHIFT(addr));
+}
+
+static inline uint8_t sm5_reg_peek(const sm5_state_t *c, uint8_t r) {
+    return (c->reg[(r & 0xf) >> 1] >> SM5_NIBBLE_SHIFT(r)) & 0xf;
+}
+
+static inline void sm5_reg_poke(sm5_state_t *c, uint8_t r, uint8_t val) {
+    uint8_t *p = &c->reg[(r & 0xf) >> 1];
+    *p = (*p & ~(0xf << SM5_NIBBLE_SHIFT(r))) | ((val & 0xf) << SM5_NIBBLE_SHIFT(r));
+}
+#else
+static inline uint8_t sm5_ram_peek(const sm5_state_t *c, uint8_t addr) {
+    return c->ram[addr];
+}
+
+static inline void sm5_ram_poke(sm5_state_t *c, uint8_t addr, uint8_t val) {
+    c->ram[addr] = val & 0xf;
+}
+
+static inline uint8_t sm5_reg_peek(const sm5_state_t *c, uint8_t r) {
+    return c->reg[r & 0xf];
+}
+
+static inline void sm5_reg_poke(sm5_state_t *c, uint8_t r, uint8_t val) {
+    c->reg[r & 0xf] = val & 0xf;
+}
+#endif
+
+// Status codes. Errors are negative and leave the PC on the instruction
+// that caused them. Events are positive.
+enum {
+    SM5_OK = 0,
+    SM5_HALT,               // HALT executed
+    SM5_STOPPED,            // sm5_stop() was called
+    SM5_LOOP,               // loop detection found a state loop
+    SM5_BLOCKED,            // a TPB waits on a linked instance, PC left on it
+
+    SM5_ERR_OVERFLOW = -1,  // stack overflow
+    SM5_ERR_UNDERFLOW = -2, // stack underflow
+    SM5_ERR_OPCODE = -3,    // unknown opcode
+    SM5_ERR_IO = -4,        // can't read ROM
+    SM5_ERR_NOMEM = -5,
+    SM5_ERR_VARIANT = -6,   // image decoded for another variant
+    SM5_ERR_RANGE = -7,     // patch beyond the end of ROM
+};
+
+typedef struct sm5 sm5_t;
+
+// Port callbacks. read returns the level of port 1-3 when TPB tests it.
+// write is called after OUT stores val into REG reg, and with reg set to
+// SM5_OUTL for OUTL.
+#define SM5_OUTL 0x10
+typedef int (*sm5_read_fn)(void *ctx, sm5_t *s, unsigned port);
+typedef void (*sm5_write_fn)(void *ctx, sm5_t *s, uint8_t reg, uint8_t val);
+
+// Variants differ in ROM and RAM size, stack depth, port count, the PAT
+// and TRS pages and the DTA table. Each has its own interpreter built
+// with these as constants.
+typedef struct _sm5_variant_t {
+    const char *name;
+    unsigned rom_pages;
+    unsigned ram_size;          // nibbles
+    unsigned stack_depth;
+    unsigned ports;
+    unsigned pat_page;
+    unsigned trs_page;
+    uint64_t secret;            // DTA table
+} sm5_variant_t;
+
+// the default variant
+sm5_t *sm5_create(void);
+// NULL if there is no such variant
+sm5_t *sm5_create_variant(const char *name);
+const sm5_variant_t *sm5_variant(sm5_t *s);
+// NULL terminated
+const sm5_variant_t *const *sm5_variants(void);
+
+void sm5_destroy(sm5_t *s);
+const char *sm5_strerror(int status);
+
+// short images are zero filled
+int sm5_load_rom(sm5_t *s, const char *path);
+int sm5_load_rom_mem(sm5_t *s, const uint8_t *rom, size_t len);
+uint8_t sm5_rom_byte(sm5_t *s, uint8_t page, uint8_t addr);
+
+// ROM images: a ROM predecoded for one variant. A process-wide registry
+// keyed by content hash builds each distinct image once and seals it
+// read-only, and every instance running that ROM shares it, so switching
+// an instance's ROM is a pointer assignment and instances add no ROM
+// memory. The load functions above go through it too. Each image returned
+// here is a reference for the caller to release; an instance holds its own.
+typedef struct sm5_image sm5_image_t;
+
+sm5_image_t *sm5_image_load(const char *path, const char *variant);    // NULL variant: default
+sm5_image_t *sm5_image_mem(const uint8_t *rom, size_t len, const char *variant);
+void sm5_image_release(sm5_image_t *image);
+uint64_t sm5_image_hash(const sm5_image_t *image);
+size_t sm5_image_size(const sm5_image_t *image);    // bytes loaded
+unsigned sm5_image_count(void);
+int sm5_set_image(sm5_t *s, sm5_image_t *image);
+// a new reference to the image s runs, patches included
+sm5_image_t *sm5_get_image(sm5_t *s);
+
+// ROM patching: write len bytes at page << 6 | addr of the instance's ROM
+// and redecode only the instructions and superinstructions they touch. An
+// image with other references is copied first, so nothing else sees the
+// change. Memo recordings are dropped; state, coverage and counters stay.
+int sm5_rom_patch(sm5_t *s, unsigned offset, const uint8_t *data, size_t len);
+int sm5_rom_poke(sm5_t *s, uint8_t page, uint8_t addr, uint8_t val);
+
+void sm5_set_io(sm5_t *s, sm5_read_fn read, sm5_write_fn write, void *ctx);
+
+void sm5_reset(sm5_t *s);
+int sm5_step(sm5_t *s);
+int sm5_run(sm5_t *s, unsigned cycles); // 0 runs until an event or error
+void sm5_stop(sm5_t *s);                // from a callback: end sm5_run
+
+// next instruction, without executing it
+unsigned sm5_fetch(sm5_t *s, uint8_t *op, uint8_t *arg);
+int sm5_disasm(uint8_t op, uint8_t arg, char *buf, size_t len);
+unsigned sm5_insn_len(uint8_t op);
+unsigned sm5_insn_class(uint8_t op);    // SM5_CLASS_*
+
+// state access
+sm5_state_t *sm5_state(sm5_t *s);
+void sm5_snapshot(sm5_t *s, sm5_state_t *out);
+void sm5_restore(sm5_t *s, const sm5_state_t *in);
+void sm5_invalidate(sm5_t *s);          // after writing sm5_state() directly
+void sm5_poke(sm5_t *s, uint8_t addr, uint8_t val);
+
+// state hash over everything but the cycle counter
+uint64_t sm5_hash(sm5_t *s);
+
+// loop detection: sm5_step/sm5_run return SM5_LOOP when the state repeats
+typedef struct _sm5_loop_t {
+    unsigned long long period;  // instructions
+    unsigned period_cycles;
+    unsigned entry_cycle;
+    int entry_exact;            // 0 if the loop began before the history
+} sm5_loop_t;
+
+int sm5_loop_detect(sm5_t *s, int enable);
+void sm5_loop_info(sm5_t *s, sm5_loop_t *info);
+
+// memoization of subroutines that do no port I/O
+typedef struct _sm5_memo_stats_t {
+    unsigned entries;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long saved_cycles;
+} sm5_memo_stats_t;
+
+int sm5_memo_enable(sm5_t *s, int enable);
+void sm5_memo_stats(sm5_t *s, sm5_memo_stats_t *stats);
+
+// ROM coverage: which addresses ran and which were skipped, a bit each at
+// page << 6 | addr. Always collected, at the cost of one store per step.
+// sm5_romcov_merge ORs it into cov, so runs and instances combine.
+typedef struct _sm5_romcov_t {
+    uint8_t executed[0x80];
+    uint8_t skipped[0x80];
+} sm5_romcov_t;
+
+void sm5_romcov_merge(sm5_t *s, sm5_romcov_t *cov);
+void sm5_romcov_clear(sm5_t *s);
+
+// edge coverage: one hit counter per (previous PC, PC) pair, hashed into
+// an AFL-style map of SM5_MAP_SIZE bytes. Counters wrap. Pass NULL to turn
+// it off. The previous PC is forgotten on reset, restore and here.
+#define SM5_MAP_SIZE 0x10000
+void sm5_coverage(sm5_t *s, uint8_t *map);
+
+// superinstructions: sm5_run dispatches common instruction sequences as
+// one, with the same results as stepping them. On by default; sm5_step,
+// loop detection, memoization and coverage go one instruction at a time.
+typedef struct _sm5_fusion_stat_t {
+    const char *name;           // e.g. "tpb tr"
+    unsigned sites;             // ROM addresses it starts at
+    unsigned long long fired;
+} sm5_fusion_stat_t;
+
+void sm5_fusion_enable(sm5_t *s, int enable);
+// fills up to max entries, returns the number of known sequences
+unsigned sm5_fusion_stats(sm5_t *s, sm5_fusion_stat_t *stats, unsigned max);
+
+// Execution counters, always on at the cost of an increment or two per
+// step. They run across resets and restores until sm5_stats_clear, and
+// sm5_stats_add sums them over instances. Host time is measured around
+// sm5_run only, so ns per instruction is host_ns / run_insns.
+enum {
+    SM5_CLASS_CONTROL,      // tr, tl, trs, call, rtn
+    SM5_CLASS_TRANSFER,     // lax, lb*, lda, exc*, ex*, atx
+    SM5_CLASS_ARITH,        // adx, add, adc, coma, incb, decb
+    SM5_CLASS_TEST,         // tc, tam, tm, tabl, tpb
+    SM5_CLASS_BIT,          // rm, sm, sc, rc, id, ie
+    SM5_CLASS_IO,           // out, outl
+    SM5_CLASS_OTHER,        // nop, pat, dta, halt, unknown
+    SM5_CLASSES,
+};
+
+typedef struct _sm5_stats_t {
+    unsigned long long insns[SM5_CLASSES];  // executed, by class
+    unsigned long long skipped;             // passed over by a skip
+    unsigned long long fused;               // executed inside superinstructions
+    unsigned long long interrupts;
+    unsigned long long port_reads;          // TPB of a port
+    unsigned long long port_writes;         // OUT and OUTL
+    unsigned long long cycles;
+    unsigned long long run_insns;           // executed and skipped in sm5_run
+    unsigned long long host_ns;             // spent in sm5_run
+    unsigned stack_max;                     // deepest the stack has been
+} sm5_stats_t;
+
+void sm5_stats(sm5_t *s, sm5_stats_t *stats);
+void sm5_stats_clear(sm5_t *s);
+void sm5_stats_add(sm5_stats_t *total, const sm5_stats_t *stats);
+const char *sm5_class_name(unsigned cls);
+
+// Dataflow tags: in a build with TAINT=1, every RAM and REG nibble and
+// register carries a mask of where its value came from, moved along by
+// each instruction. A value computed from others gets the union of their
+// tags. Taking a branch on a test of tagged data tags whatever the
+// subroutine writes after it with the test's origins, constants aside,
+// until it returns. Indexing PAT or DTA adds the index's tags. Tags start
+// clear on reset and restore, and sm5_poke tags what it writes HOST. The
+// taint build doesn't memoize: a replayed call would skip the handlers.
+enum {
+    SM5_TAINT_PORT = 1 << 0,    // TPB input
+    SM5_TAINT_DTA = 1 << 1,     // the secret table
+    SM5_TAINT_PAT = 1 << 2,     // ROM loads
+    SM5_TAINT_CONST = 1 << 3,   // immediates
+    SM5_TAINT_HOST = 1 << 4,    // sm5_poke
+};
+
+// one byte per nibble, laid out as in sm5_state_t unpacked
+typedef struct _sm5_taint_t {
+    uint8_t ram[0x100];
+    uint8_t reg[0x10];
+    uint8_t A, X;
+    uint8_t BL, BM, SB;
+    uint8_t C;
+    uint8_t port[4];
+    uint8_t skip;               // of the last test, for the next instruction
+    uint8_t flow;               // of the tests this subroutine branched on
+    uint8_t stack[4];           // the callers' flow
+} sm5_taint_t;
+
+// NULL unless built with TAINT=1
+const sm5_taint_t *sm5_taint(sm5_t *s);
+void sm5_taint_clear(sm5_t *s);
+// "port dta", "-" for none; returns buf
+const char *sm5_taint_name(uint8_t tag, char *buf, size_t len);
+
+#endif
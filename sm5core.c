@@ -0,0 +1,897 @@
+#include <string.h>
+
+#include "sm5int.h"
+#include "variants.h"
+
+// One interpreter, compiled once per variant with -DVARIANT=<name>. The
+// variant's parameters are compile-time constants, so the bounds and
+// masks below fold away and each core exports only core_<name>.
+
+#ifndef VARIANT
+#error "build with -DVARIANT=<name>, see variants.h"
+#endif
+
+#define PASTE_(a, b) a##_##b
+#define PASTE(a, b) PASTE_(a, b)
+#define STR_(a) #a
+#define PASTE_STR(a) STR_(a)
+
+#define X(name, rom_pages, ram_size, stack_depth, ports, pat_page, trs_page, secret) \
+    enum { \
+        name##_ROM_PAGES = rom_pages, \
+        name##_RAM_SIZE = ram_size, \
+        name##_STACK_DEPTH = stack_depth, \
+        name##_PORTS = ports, \
+        name##_PAT_PAGE = pat_page, \
+        name##_TRS_PAGE = trs_page, \
+    }; \
+    static const uint64_t name##_SECRET __attribute__((unused)) = secret;
+SM5_VARIANTS(X)
+#undef X
+
+#define ROM_PAGES   PASTE(VARIANT, ROM_PAGES)
+#define RAM_SIZE    PASTE(VARIANT, RAM_SIZE)
+#define STACK_DEPTH PASTE(VARIANT, STACK_DEPTH)
+#define PORTS       PASTE(VARIANT, PORTS)
+#define PAT_PAGE    PASTE(VARIANT, PAT_PAGE)
+#define TRS_PAGE    PASTE(VARIANT, TRS_PAGE)
+#define SECRET      PASTE(VARIANT, SECRET)
+
+_Static_assert((ROM_PAGES & (ROM_PAGES - 1)) == 0 && ROM_PAGES <= 0x10, "ROM pages");
+_Static_assert((RAM_SIZE & (RAM_SIZE - 1)) == 0 && RAM_SIZE <= 0x100, "RAM size");
+_Static_assert(STACK_DEPTH <= sizeof(((sm5_state_t *)0)->stack) / sizeof(sm5_pc_t), "stack depth");
+_Static_assert(PORTS <= sizeof(((sm5_state_t *)0)->port), "port count");
+
+// RAM address from B, mirrored on parts with less RAM
+#define RAM_ADDR    (B & (RAM_SIZE - 1))
+
+#define IMG_ROM(img, page, addr) ((img)->rom[(page) & (ROM_PAGES - 1)][(addr) & 0x3f])
+#define IMG_CODE(img, page, addr) ((img)->code[(page) & (ROM_PAGES - 1)][(addr) & 0x3f])
+#define ROM(page, addr) IMG_ROM(s->img, page, addr)
+#define CODE(page, addr) IMG_CODE(s->img, page, addr)
+
+// statuses that leave the PC on the instruction, as if it hadn't run
+#define REWOUND(status) ((status) < 0 || (status) == SM5_BLOCKED)
+
+// after a push
+#define STACK_HIGH_WATER() do { \
+        if (s->cpu.sp > s->stats.stack_max) \
+            s->stats.stack_max = s->cpu.sp; \
+    } while (0)
+
+////////////////////////////////
+// instruction emulation
+//
+
+
+//////////////////
+// address control
+
+static void op_TR(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.pc.addr = op & 0b111111;
+}
+
+static void op_TL(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.pc.page = ((op & 0xf) << 2) | (arg >> 6);
+    s->cpu.pc.addr = arg & 0b111111;
+}
+
+static void op_TRS(sm5_t *s, u8 op, u8 arg) {
+    if (s->cpu.sp == STACK_DEPTH) {
+        s->status = SM5_ERR_OVERFLOW;
+        return;
+    }
+    s->cpu.stack[s->cpu.sp] = s->cpu.pc;
+    TAINT(s->taint.stack[s->cpu.sp] = s->taint.flow);
+    ++s->cpu.sp;
+    STACK_HIGH_WATER();
+    s->cpu.pc.page = TRS_PAGE;
+    s->cpu.pc.addr = (op & 0b11111) << 1;
+}
+
+static void op_CALL(sm5_t *s, u8 op, u8 arg) {
+    if (s->cpu.sp == STACK_DEPTH) {
+        s->status = SM5_ERR_OVERFLOW;
+        return;
+    }
+    s->cpu.stack[s->cpu.sp] = s->cpu.pc;
+    TAINT(s->taint.stack[s->cpu.sp] = s->taint.flow);
+    ++s->cpu.sp;
+    STACK_HIGH_WATER();
+    s->cpu.pc.page = ((op & 0xf) << 2) | (arg >> 6);
+    s->cpu.pc.addr = arg & 0b111111;
+}
+
+static void op_RTN(sm5_t *s, u8 op, u8 arg) {
+    if (s->cpu.sp == 0) {
+        s->status = SM5_ERR_UNDERFLOW;
+        return;
+    }
+    --s->cpu.sp;
+    s->cpu.pc = s->cpu.stack[s->cpu.sp];
+    TAINT(s->taint.flow = s->taint.stack[s->cpu.sp]);
+}
+
+static void op_RTNS(sm5_t *s, u8 op, u8 arg) {
+    op_RTN(s, op, arg);
+    if (s->status == SM5_OK)
+        s->cpu.skip = 1;
+}
+
+
+////////////////
+// data transfer
+
+static void op_LAX(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.A = op & 0b1111;
+    TAINT(s->taint.A = TAG(s, SM5_TAINT_CONST));
+}
+
+static void op_LBMX(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.BM = op & 0b1111;
+    TAINT(s->taint.BM = TAG(s, SM5_TAINT_CONST));
+}
+
+static void op_LBLX(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.BL = op & 0b1111;
+    TAINT(s->taint.BL = TAG(s, SM5_TAINT_CONST));
+}
+
+static void op_LDA(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.A = RAM_GET(s, RAM_ADDR);
+    TAINT(s->taint.A = TAG(s, s->taint.ram[RAM_ADDR]));
+    s->cpu.BM ^= op & 0b11;
+    TAINT(s->taint.BM = TAG(s, s->taint.BM | ((op & 0b11) ? SM5_TAINT_CONST : 0)));
+}
+
+static void op_EXC(sm5_t *s, u8 op, u8 arg) {
+    u8 tmp = RAM_GET(s, RAM_ADDR);
+
+    RAM_SET(s, RAM_ADDR, s->cpu.A);
+    s->cpu.A = tmp;
+    TAINT(u8 t = s->taint.ram[RAM_ADDR];
+            s->taint.ram[RAM_ADDR] = TAG(s, s->taint.A);
+            s->taint.A = TAG(s, t));
+    s->cpu.BM ^= op & 0b11;
+    TAINT(s->taint.BM = TAG(s, s->taint.BM | ((op & 0b11) ? SM5_TAINT_CONST : 0)));
+}
+
+static void op_EXCI(sm5_t *s, u8 op, u8 arg) {
+    u8 tmp = RAM_GET(s, RAM_ADDR);
+
+    RAM_SET(s, RAM_ADDR, s->cpu.A);
+    s->cpu.A = tmp;
+    TAINT(u8 t = s->taint.ram[RAM_ADDR];
+            s->taint.ram[RAM_ADDR] = TAG(s, s->taint.A);
+            s->taint.A = TAG(s, t));
+    TAINT(s->taint.skip = s->taint.BL;
+            s->taint.BL = TAG(s, s->taint.BL));
+    if (s->cpu.BL == 0x0F) {
+        s->cpu.BL = 0;
+        s->cpu.skip = 1;
+    } else {
+        ++s->cpu.BL;
+    }
+    s->cpu.BM ^= op & 0b11;
+    TAINT(s->taint.BM = TAG(s, s->taint.BM | ((op & 0b11) ? SM5_TAINT_CONST : 0)));
+}
+
+static void op_EXCD(sm5_t *s, u8 op, u8 arg) {
+    u8 tmp = RAM_GET(s, RAM_ADDR);
+
+    RAM_SET(s, RAM_ADDR, s->cpu.A);
+    s->cpu.A = tmp;
+    TAINT(u8 t = s->taint.ram[RAM_ADDR];
+            s->taint.ram[RAM_ADDR] = TAG(s, s->taint.A);
+            s->taint.A = TAG(s, t));
+    TAINT(s->taint.skip = s->taint.BL;
+            s->taint.BL = TAG(s, s->taint.BL));
+    if (s->cpu.BL == 0) {
+        s->cpu.BL = 0xF;
+        s->cpu.skip = 1;
+    } else {
+        --s->cpu.BL;
+    }
+    s->cpu.BM ^= op & 0b11;
+    TAINT(s->taint.BM = TAG(s, s->taint.BM | ((op & 0b11) ? SM5_TAINT_CONST : 0)));
+}
+
+static void op_EXAX(sm5_t *s, u8 op, u8 arg) {
+    u8 tmp = s->cpu.X;
+    s->cpu.X = s->cpu.A;
+    s->cpu.A = tmp;
+    TAINT(u8 t = s->taint.X;
+            s->taint.X = TAG(s, s->taint.A);
+            s->taint.A = TAG(s, t));
+}
+
+static void op_ATX(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.X = s->cpu.A;
+    TAINT(s->taint.X = TAG(s, s->taint.A));
+}
+
+static void op_EXBM(sm5_t *s, u8 op, u8 arg) {
+    u8 tmp = s->cpu.A;
+    s->cpu.A = s->cpu.BM;
+    s->cpu.BM = tmp;
+    TAINT(u8 t = s->taint.A;
+            s->taint.A = TAG(s, s->taint.BM);
+            s->taint.BM = TAG(s, t));
+}
+
+static void op_EXBL(sm5_t *s, u8 op, u8 arg) {
+    u8 tmp = s->cpu.A;
+    s->cpu.A = s->cpu.BL;
+    s->cpu.BL = tmp;
+    TAINT(u8 t = s->taint.A;
+            s->taint.A = TAG(s, s->taint.BL);
+            s->taint.BL = TAG(s, t));
+}
+
+static void op_EX(sm5_t *s, u8 op, u8 arg) {
+    u8 tmp = s->cpu.SB;
+    s->cpu.SB = B;
+    s->cpu.BM = tmp >> 4;
+    s->cpu.BL = tmp & 0xf;
+    // one tag for both halves of SB
+    TAINT(u8 t = s->taint.SB;
+            s->taint.SB = TAG(s, s->taint.BM | s->taint.BL);
+            s->taint.BM = s->taint.BL = TAG(s, t));
+}
+
+
+/////////////
+// arithmetic
+
+static void op_ADX(sm5_t *s, u8 op, u8 arg) {
+    TAINT(s->taint.skip = s->taint.A;
+            s->taint.A = TAG(s, s->taint.A | SM5_TAINT_CONST));
+    s->cpu.A = s->cpu.A + (op & 0b1111);
+    if (s->cpu.A >= 0x10) {
+        s->cpu.A %= 0x10;
+        s->cpu.skip = 1;
+    }
+}
+
+static void op_ADD(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.A = (s->cpu.A + RAM_GET(s, RAM_ADDR)) % 0x10;
+    TAINT(s->taint.A = TAG(s, s->taint.A | s->taint.ram[RAM_ADDR]));
+}
+
+static void op_ADC(sm5_t *s, u8 op, u8 arg) {
+    TAINT(s->taint.skip = s->taint.A | s->taint.ram[RAM_ADDR] | s->taint.C;
+            s->taint.A = s->taint.C = TAG(s, s->taint.skip));
+    s->cpu.A = s->cpu.A + RAM_GET(s, RAM_ADDR) + s->cpu.C;
+    if (s->cpu.A >= 0x10) {
+        s->cpu.A %= 0x10;
+        s->cpu.C = 1;
+        s->cpu.skip = 1;
+    } else {
+        s->cpu.C = 0;
+    }
+}
+
+static void op_COMA(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.A = (~s->cpu.A) & 0xf;
+    TAINT(s->taint.A = TAG(s, s->taint.A));
+}
+
+static void op_INCB(sm5_t *s, u8 op, u8 arg) {
+    TAINT(s->taint.skip = s->taint.BL;
+            s->taint.BL = TAG(s, s->taint.BL));
+    ++s->cpu.BL;
+    if (s->cpu.BL == 0x10) {
+        s->cpu.BL = 0;
+        s->cpu.skip = 1;
+    }
+}
+
+static void op_DECB(sm5_t *s, u8 op, u8 arg) {
+    TAINT(s->taint.skip = s->taint.BL;
+            s->taint.BL = TAG(s, s->taint.BL));
+    --s->cpu.BL;
+    if (s->cpu.BL == 0xFF) {
+        s->cpu.BL = 0xF;
+        s->cpu.skip = 1; // FIXME test
+    }
+}
+
+
+///////
+// test
+
+static void op_TC(sm5_t *s, u8 op, u8 arg) {
+    TAINT(s->taint.skip = s->taint.C);
+    if (s->cpu.C)
+        s->cpu.skip = 1;
+}
+
+static void op_TAM(sm5_t *s, u8 op, u8 arg) {
+    TAINT(s->taint.skip = s->taint.A | s->taint.ram[RAM_ADDR]);
+    if (s->cpu.A == RAM_GET(s, RAM_ADDR))
+        s->cpu.skip = 1;
+}
+
+static void op_TM(sm5_t *s, u8 op, u8 arg) {
+    TAINT(s->taint.skip = s->taint.ram[RAM_ADDR]);
+    if (RAM_GET(s, RAM_ADDR) & (1 << (op & 0b11)))
+        s->cpu.skip = 1;
+}
+
+static void op_TABL(sm5_t *s, u8 op, u8 arg) {
+    TAINT(s->taint.skip = s->taint.A | s->taint.BL);
+    if (s->cpu.A == s->cpu.BL)
+        s->cpu.skip = 1;
+}
+
+static void op_TPB(sm5_t *s, u8 op, u8 arg) {
+    u8 num = op & 0b11;
+    int level;
+
+    if (num == 0) {
+        s->cpu.skip = 1;
+        return;
+    }
+    if (num >= PORTS)
+        return;
+
+    MEMO_IMPURE(s);
+    if (s->read) {
+        level = s->read(s->io_ctx, s, num);
+        // the callback can't answer yet: the TPB runs again next time
+        if (s->status == SM5_BLOCKED)
+            return;
+        s->cpu.port[num] = level;
+        TAINT(s->taint.port[num] = SM5_TAINT_PORT);
+    }
+    ++s->stats.port_reads;
+    TAINT(s->taint.skip = s->taint.port[num]);
+    if (s->cpu.port[num])
+        s->cpu.skip = 1;
+}
+
+
+///////////////////
+// bit manipulation
+
+static void op_RM(sm5_t *s, u8 op, u8 arg) {
+    u8 mask = 1 << (op & 0b11);
+    RAM_SET(s, RAM_ADDR, RAM_GET(s, RAM_ADDR) & ~mask);
+    TAINT(s->taint.ram[RAM_ADDR] = TAG(s, s->taint.ram[RAM_ADDR] | SM5_TAINT_CONST));
+}
+
+static void op_SM(sm5_t *s, u8 op, u8 arg) {
+    u8 mask = 1 << (op & 0b11);
+    RAM_SET(s, RAM_ADDR, RAM_GET(s, RAM_ADDR) | mask);
+    TAINT(s->taint.ram[RAM_ADDR] = TAG(s, s->taint.ram[RAM_ADDR] | SM5_TAINT_CONST));
+}
+
+static void op_SC(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.C = 1;
+    TAINT(s->taint.C = TAG(s, SM5_TAINT_CONST));
+}
+
+static void op_RC(sm5_t *s, u8 op, u8 arg) {
+    s->cpu.C = 0;
+    TAINT(s->taint.C = TAG(s, SM5_TAINT_CONST));
+}
+
+static void op_ID(sm5_t *s, u8 op, u8 arg) {
+    // TODO
+}
+
+static void op_IE(sm5_t *s, u8 op, u8 arg) {
+    // TODO
+}
+
+
+/////////////
+// IO control
+
+static void op_OUTL(sm5_t *s, u8 op, u8 arg) {
+    MEMO_IMPURE(s);
+    ++s->stats.port_writes;
+    if (s->write)
+        s->write(s->io_ctx, s, SM5_OUTL, s->cpu.A);
+}
+
+static void op_OUT(sm5_t *s, u8 op, u8 arg) {
+    MEMO_IMPURE(s);
+    ++s->stats.port_writes;
+    REG_SET(s, s->cpu.BL, s->cpu.A);
+    TAINT(s->taint.reg[s->cpu.BL] = TAG(s, s->taint.A));
+    if (s->cpu.BL == 0xf)
+        s->cpu.port2_hiz = s->cpu.A ? 0 : 1;
+    else if (s->cpu.BL == 2) {
+        s->cpu.port[0] = s->cpu.A;
+        TAINT(s->taint.port[0] = TAG(s, s->taint.A));
+    }
+    if (s->write)
+        s->write(s->io_ctx, s, s->cpu.BL, s->cpu.A);
+}
+
+
+/////////
+// others
+
+// load from ROM
+static void op_PAT(sm5_t *s, u8 op, u8 arg) {
+    pc_t load;
+    u8 romval;
+
+    load.page = PAT_PAGE;
+    load.addr = ((s->cpu.X & 0b11) << 4) | s->cpu.A;
+
+    romval = ROM(load.page, load.addr);
+    s->cpu.X = romval >> 4;
+    s->cpu.A = romval & 0xf;
+    TAINT(s->taint.X = s->taint.A = TAG(s, SM5_TAINT_PAT | s->taint.A | s->taint.X));
+}
+
+// read from secret ROM
+static void op_DTA(sm5_t *s, u8 op, u8 arg) {
+    if (s->cpu.BM >= 4 && s->cpu.BM <= 7) {
+        s->cpu.skip = (SECRET >> (((s->cpu.BM - 4) << 4) | s->cpu.BL)) & 1;
+        TAINT(s->taint.skip = SM5_TAINT_DTA | s->taint.BM | s->taint.BL);
+    }
+}
+
+// halt
+static void op_HALT(sm5_t *s, u8 op, u8 arg) {
+    MEMO_IMPURE(s);
+    s->status = SM5_HALT;
+}
+
+
+typedef sm5_handler_t op_handler_t;
+
+static void op_NOP(sm5_t *s, u8 op, u8 arg) {
+    // do nuttin
+}
+
+static op_handler_t lookup(u8 op, unsigned *len) {
+    op_handler_t handler = NULL;
+
+    *len = 1;
+
+    // NOP
+    if (op == 0x00) {
+        handler = op_NOP;
+    }
+
+    // address control
+    else if (op >= 0x80 && op <= 0xBF) {
+        handler = op_TR;
+    } else if (op >= 0xE0 && op <= 0xEF) {
+        *len = 2;
+        handler = op_TL;
+    } else if (op >= 0xC0 && op <= 0xDF) {
+        handler = op_TRS;
+    } else if (op >= 0xF0 && op <= 0xFF) {
+        *len = 2;
+        handler = op_CALL;
+    } else if (op == 0x7D) {
+        handler = op_RTN;
+    } else if (op == 0x7E) {
+        handler = op_RTNS;
+    } else if (op == 0x7F) {
+        handler = op_RTN; // XXX does this need any other side effects?
+    }
+
+    // data transfer
+    else if (op >= 0x10 && op <= 0x1F) {
+        handler = op_LAX;
+    } else if (op >= 0x30 && op <= 0x3F) {
+        handler = op_LBMX;
+    } else if (op >= 0x20 && op <= 0x2F) {
+        handler = op_LBLX;
+    } else if (op >= 0x50 && op <= 0x53) {
+        handler = op_LDA;
+    } else if (op >= 0x54 && op <= 0x57) {
+        handler = op_EXC;
+    } else if (op >= 0x58 && op <= 0x5B) {
+        handler = op_EXCI;
+    } else if (op >= 0x5C && op <= 0x5F) {
+        handler = op_EXCD;
+    } else if (op == 0x64) {
+        handler = op_EXAX;
+    } else if (op == 0x65) {
+        handler = op_ATX;
+    } else if (op == 0x66) {
+        handler = op_EXBM;
+    } else if (op == 0x67) {
+        handler = op_EXBL;
+    } else if (op == 0x68) {
+        handler = op_EX;
+    }
+
+    // arithmetic
+    else if (op >= 0x00 && op <= 0x0F) {
+        handler = op_ADX;
+    } else if (op == 0x7A) {
+        handler = op_ADD;
+    } else if (op == 0x7B) {
+        handler = op_ADC;
+    } else if (op == 0x79) {
+        handler = op_COMA;
+    } else if (op == 0x78) {
+        handler = op_INCB;
+    } else if (op == 0x7C) {
+        handler = op_DECB;
+    }
+
+    // test
+    else if (op == 0x6E) {
+        handler = op_TC;
+    } else if (op == 0x6F) {
+        handler = op_TAM;
+    } else if (op >= 0x48 && op <= 0x4B) {
+        handler = op_TM;
+    } else if (op == 0x6B) {
+        handler = op_TABL;
+    } else if (op >= 0x4C && op <= 0x4F) {
+        handler = op_TPB;
+    }
+
+    // bit manip
+    else if (op >= 0x40 && op <= 0x43) {
+        handler = op_RM;
+    } else if (op >= 0x44 && op <= 0x47) {
+        handler = op_SM;
+    } else if (op == 0x61) {
+        handler = op_SC;
+    } else if (op == 0x60) {
+        handler = op_RC;
+    } else if (op == 0x62) {
+        handler = op_ID;
+    } else if (op == 0x63) {
+        handler = op_IE;
+    }
+
+    // io control
+    else if (op == 0x71) {
+        handler = op_OUTL;
+    } else if (op == 0x75) {
+        handler = op_OUT;
+    }
+
+
+    // unknown
+    else if (op == 0x6A) {
+        *len = 2;
+        handler = op_PAT;
+    } else if (op == 0x69) {
+        *len = 2;
+        handler = op_DTA;
+    }
+
+    // special
+    else if (op == 0x77) {
+        handler = op_HALT;
+    }
+
+    return handler;
+}
+
+
+
+////////////////////////////////
+// superinstructions
+//
+
+// Sequences that are common in CIC code, picked by profiling boot and
+// challenge sessions. Every instruction but the last must fall through
+// to the next and be unable to fail, so the sequence is straight-line
+// code. Longer sequences come first so they win over their prefixes.
+#define FUSIONS(X) \
+    X(LAX_LBLX_OUT, "lax lblx out", op_LAX, op_LBLX, op_OUT) \
+    X(EX_TPB_TR,    "ex tpb tr",    op_EX, op_TPB, op_TR) \
+    X(LAX_TPB_TR,   "lax tpb tr",   op_LAX, op_TPB, op_TR) \
+    X(LAX_TM_TR,    "lax tm tr",    op_LAX, op_TM, op_TR) \
+    X(TPB_TR,       "tpb tr",       op_TPB, op_TR) \
+    X(LBLX_OUT,     "lblx out",     op_LBLX, op_OUT) \
+    X(LAX_LBLX,     "lax lblx",     op_LAX, op_LBLX) \
+    X(LBMX_LBLX,    "lbmx lblx",    op_LBMX, op_LBLX) \
+    X(LBLX_LBMX,    "lblx lbmx",    op_LBLX, op_LBMX) \
+    X(LAX_EXC,      "lax exc",      op_LAX, op_EXC) \
+    X(EXC_LDA,      "exc lda",      op_EXC, op_LDA) \
+    X(EXCI_TR,      "exci tr",      op_EXCI, op_TR) \
+    X(EXCD_TR,      "excd tr",      op_EXCD, op_TR) \
+    X(TM_TR,        "tm tr",        op_TM, op_TR) \
+    X(TC_TR,        "tc tr",        op_TC, op_TR) \
+    X(ADX_TR,       "adx tr",       op_ADX, op_TR) \
+    X(INCB_TR,      "incb tr",      op_INCB, op_TR)
+
+enum {
+    FUSE_NONE,
+#define X(id, name, ...) FUSE_##id,
+    FUSIONS(X)
+#undef X
+    FUSE_COUNT,
+};
+_Static_assert(FUSE_COUNT <= SM5_MAX_FUSIONS, "too many superinstructions");
+
+#define X(id, name, ...) static const op_handler_t fuse_##id[] = { __VA_ARGS__ };
+FUSIONS(X)
+#undef X
+
+static const struct {
+    const op_handler_t *seq;
+    unsigned len;
+} fusion[] = {
+#define X(id, name, ...) [FUSE_##id] = { fuse_##id, sizeof(fuse_##id) / sizeof(op_handler_t) },
+    FUSIONS(X)
+#undef X
+};
+
+static const char *const fusion_name[] = {
+    [FUSE_NONE] = "none",
+#define X(id, name, ...) [FUSE_##id] = name,
+    FUSIONS(X)
+#undef X
+};
+
+static void decode_at(sm5_rom_image_t *img, unsigned page, unsigned addr) {
+    sm5_insn_t *insn = &img->code[page][addr];
+    unsigned len;
+
+    insn->op = IMG_ROM(img, page, addr);
+    insn->handler = lookup(insn->op, &len);
+    insn->len = len;
+    insn->arg = len == 2 ? IMG_ROM(img, page, addr + 1) : 0;
+    insn->cls = sm5_insn_class(insn->op);
+    // odd multiplier: distinct for every address, spread over the map
+    insn->loc = (((page << 6) | addr) * 0x9e5b) & (SM5_MAP_SIZE - 1);
+}
+
+// mark the superinstruction starting at page.addr, if any
+static void fuse_at(sm5_rom_image_t *img, unsigned page, unsigned addr) {
+    sm5_insn_t *insn = &img->code[page][addr];
+    unsigned f, i;
+    u8 at, lead;
+
+    insn->fusion = FUSE_NONE;
+    insn->lead = 0;
+    for (f = 1; f < FUSE_COUNT; ++f) {
+        at = addr;
+        lead = 0;
+        for (i = 0; i < fusion[f].len; ++i) {
+            if (IMG_CODE(img, page, at).handler != fusion[f].seq[i])
+                break;
+            if (i + 1 < fusion[f].len)
+                lead += IMG_CODE(img, page, at).len;
+            at = (at + IMG_CODE(img, page, at).len) & 0x3f;
+        }
+        if (i == fusion[f].len) {
+            insn->fusion = f;
+            insn->lead = lead;
+            ++img->fusion_sites[f];
+            return;
+        }
+    }
+}
+
+// predecode the ROM and mark where each superinstruction starts
+static void decode(sm5_rom_image_t *img) {
+    unsigned page, addr;
+
+    memset(img->fusion_sites, 0, sizeof(img->fusion_sites));
+
+    for (page = 0; page < 0x10; ++page)
+        for (addr = 0; addr < 0x40; ++addr) {
+            decode_at(img, page, addr);
+            img->code[page][addr].fusion = FUSE_NONE;
+            img->code[page][addr].lead = 0;
+        }
+
+    for (page = 0; page < ROM_PAGES; ++page)
+        for (addr = 0; addr < 0x40; ++addr)
+            fuse_at(img, page, addr);
+}
+
+// After the ROM byte at page.addr changed: redecode the instruction there
+// and the one before, whose operand it may be, then every superinstruction
+// start that could reach either. A sequence is at most two bytes an
+// instruction, so none starting further back can.
+static void patch(sm5_rom_image_t *img, unsigned page, unsigned addr) {
+    unsigned span = 0, f, i;
+    u8 at;
+    sm5_insn_t *insn;
+
+    page &= ROM_PAGES - 1;
+    addr &= 0x3f;
+    decode_at(img, page, (addr - 1) & 0x3f);
+    decode_at(img, page, addr);
+
+    for (f = 1; f < FUSE_COUNT; ++f)
+        if (fusion[f].len * 2 > span)
+            span = fusion[f].len * 2;
+    // a sequence of span bytes starting at addr - span + 1 reaches addr - 1
+    for (i = 1; i <= span; ++i) {
+        at = (addr - span + i) & 0x3f;
+        insn = &img->code[page][at];
+        if (insn->fusion != FUSE_NONE)
+            --img->fusion_sites[insn->fusion];
+        fuse_at(img, page, at);
+    }
+}
+
+static unsigned fetch(sm5_t *s, u8 *op, u8 *arg) {
+    const sm5_insn_t *insn = &CODE(s->cpu.pc.page, s->cpu.pc.addr);
+
+    *op = insn->op;
+    *arg = insn->arg;
+    return insn->len;
+}
+
+static inline int step(sm5_t *s) {
+    sm5_state_t *c = &s->cpu;
+    const sm5_insn_t *insn = &CODE(c->pc.page, c->pc.addr);
+    op_handler_t handler = insn->handler;
+    unsigned len = insn->len;
+    u8 op = insn->op, arg = insn->arg;
+    int status;
+
+    c->frame_pc = c->pc;
+    if (s->edges) {
+        ++s->edges[insn->loc ^ s->prev_loc];
+        s->prev_loc = insn->loc >> 1;
+    }
+    if (handler == NULL)
+        return SM5_ERR_OPCODE;
+    // the program counter wraps within the page
+    c->pc.addr = (c->pc.addr + len) & 0x3f;
+    // whether this runs hangs on the last test
+    TAINT(s->taint.flow |= s->taint.skip & TAINT_FLOW; s->taint.skip = 0);
+
+    if (c->interrupt) {
+        // refused like a CALL, with the interrupt still pending
+        if (c->sp == STACK_DEPTH) {
+            c->pc = c->frame_pc;
+            return SM5_ERR_OVERFLOW;
+        }
+        MEMO_IMPURE(s);
+        c->stack[c->sp] = c->pc;
+        TAINT(s->taint.stack[c->sp] = s->taint.flow);
+        ++c->sp;
+        STACK_HIGH_WATER();
+        c->pc.page = 0x2;
+        c->pc.addr = 0;
+        c->interrupt = 0;
+        ++s->stats.interrupts;
+    } else {
+        c->cycle += len;
+        s->rom_cov[c->skip != 0][insn - &s->img->code[0][0]] = 1;
+
+        if (!c->skip) {
+            ++s->stats.insns[insn->cls];
+            if (s->memo && (handler == op_CALL || handler == op_TRS)
+                    && memo_call(s, op, arg))
+                return SM5_OK;
+            handler(s, op, arg);
+            if (s->status != SM5_OK) {
+                status = s->status;
+                s->status = SM5_OK;
+                if (REWOUND(status)) {
+                    c->pc = c->frame_pc;
+                    c->cycle -= len;
+                    --s->stats.insns[insn->cls];
+                }
+                return status;
+            }
+            if (s->memo_recording)
+                memo_after(s, handler == op_RTN || handler == op_RTNS);
+        } else {
+            c->skip = 0;
+            ++s->stats.skipped;
+        }
+    }
+
+    if (s->loop)
+        return loop_step(s);
+    return SM5_OK;
+}
+
+// Run a superinstruction as step() would run each of its instructions,
+// with neither loop detection, memoization nor coverage on. It ends early if a port
+// callback stops the run or raises an interrupt.
+static inline __attribute__((always_inline))
+int step_fused(sm5_t *s, const op_handler_t *seq, unsigned n) {
+    sm5_state_t *c = &s->cpu;
+    const sm5_insn_t *insn;
+    unsigned i;
+    int status;
+
+    for (i = 0; i < n; ++i) {
+        insn = &CODE(c->pc.page, c->pc.addr);
+        c->frame_pc = c->pc;
+        c->pc.addr = (c->pc.addr + insn->len) & 0x3f;
+        c->cycle += insn->len;
+        s->rom_cov[c->skip != 0][insn - &s->img->code[0][0]] = 1;
+        TAINT(s->taint.flow |= s->taint.skip & TAINT_FLOW; s->taint.skip = 0);
+
+        if (c->skip) {
+            c->skip = 0;
+            ++s->stats.skipped;
+        } else {
+            ++s->stats.insns[insn->cls];
+            ++s->stats.fused;
+            seq[i](s, insn->op, insn->arg);
+            if (s->status != SM5_OK) {
+                status = s->status;
+                s->status = SM5_OK;
+                if (REWOUND(status)) {
+                    c->pc = c->frame_pc;
+                    c->cycle -= insn->len;
+                    --s->stats.insns[insn->cls];
+                    --s->stats.fused;
+                }
+                return status;
+            }
+        }
+        if (s->stop || c->interrupt)
+            break;
+    }
+    return SM5_OK;
+}
+
+static int run(sm5_t *s, unsigned cycles) {
+    unsigned end = s->cpu.cycle + cycles;
+    const sm5_insn_t *insn;
+    int fuse = s->fuse && s->loop == NULL && s->memo == NULL && s->edges == NULL;
+    int status;
+
+    s->stop = 0;
+    while (cycles == 0 || (int)(end - s->cpu.cycle) > 0) {
+        insn = &CODE(s->cpu.pc.page, s->cpu.pc.addr);
+        // the whole sequence has to fit in the budget
+        if (fuse && insn->fusion && !s->cpu.interrupt
+                && (cycles == 0 || (int)(end - s->cpu.cycle) > insn->lead)) {
+            ++s->fusion_fired[insn->fusion];
+            switch (insn->fusion) {
+#define X(id, name, ...) \
+                case FUSE_##id: \
+                    status = step_fused(s, fuse_##id, fusion[FUSE_##id].len); \
+                    break;
+                FUSIONS(X)
+#undef X
+                default:
+                    status = step(s);
+                    break;
+            }
+        } else {
+            status = step(s);
+        }
+        if (status != SM5_OK)
+            return status;
+        if (s->stop) {
+            s->stop = 0;
+            return SM5_STOPPED;
+        }
+    }
+    return SM5_OK;
+}
+
+static int step_one(sm5_t *s) {
+    return step(s);
+}
+
+const sm5_core_t PASTE(core, VARIANT) = {
+    .variant = {
+        .name = PASTE_STR(VARIANT),
+        .rom_pages = ROM_PAGES,
+        .ram_size = RAM_SIZE,
+        .stack_depth = STACK_DEPTH,
+        .ports = PORTS,
+        .pat_page = PAT_PAGE,
+        .trs_page = TRS_PAGE,
+        .secret = SECRET,
+    },
+    .step = step_one,
+    .run = run,
+    .fetch = fetch,
+    .decode = decode,
+    .patch = patch,
+    .fusions = FUSE_COUNT - 1,
+    .fusion_name = fusion_name,
+};
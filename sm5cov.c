@@ -0,0 +1,332 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "romcov.h"
+#include "sm5.h"
+
+// Reports on ROM coverage files written by sm5emu -C
+
+typedef uint8_t u8;
+
+// one instruction of the listing
+typedef struct _line_t {
+    unsigned addr;              // page << 6 | addr
+    unsigned next;              // address of the instruction after it
+    u8 op, arg;
+} line_t;
+
+static sm5_t *sm;
+static sm5_romcov_t total;
+static line_t lines[0x400];
+static unsigned nlines = 0;
+
+static int covered(const sm5_romcov_t *cov, unsigned a) {
+    return romcov_ran(cov, a) || romcov_skipped(cov, a);
+}
+
+// instructions that can skip the next one
+static int may_skip(u8 op) {
+    return (op >= 0x01 && op <= 0x0F)       // adx
+        || (op >= 0x58 && op <= 0x5F)       // exci, excd
+        || (op >= 0x48 && op <= 0x4F)       // tm, tpb
+        || op == 0x7B || op == 0x78 || op == 0x7C   // adc, incb, decb
+        || op == 0x6E || op == 0x6F || op == 0x6B   // tc, tam, tabl
+        || op == 0x69;                      // dta
+}
+
+// Linear sweep of each page. The second byte of a two byte instruction
+// starts a line of its own if something ran or skipped it.
+static void build_listing(void) {
+    unsigned pages = sm5_variant(sm)->rom_pages, page, a, len;
+    line_t *l;
+
+    for (page = 0; page < pages; ++page) {
+        a = 0;
+        while (a < 0x40) {
+            l = &lines[nlines++];
+            l->addr = (page << 6) | a;
+            l->op = sm5_rom_byte(sm, page, a);
+            l->arg = sm5_rom_byte(sm, page, a + 1);
+            len = sm5_insn_len(l->op);
+            l->next = (page << 6) | ((a + len) & 0x3f);
+            if (len == 2 && a + 1 < 0x40 && covered(&total, l->addr + 1))
+                len = 1;
+            a += len;
+        }
+    }
+}
+
+static void format_line(line_t *l, char *buf, size_t len) {
+    char dis[32];
+
+    sm5_disasm(l->op, l->arg, dis, sizeof(dis));
+    if (sm5_insn_len(l->op) == 2)
+        snprintf(buf, len, "%x.%02x  %02x %02x  %s", l->addr >> 6, l->addr & 0x3f, l->op, l->arg, dis);
+    else
+        snprintf(buf, len, "%x.%02x  %02x     %s", l->addr >> 6, l->addr & 0x3f, l->op, dis);
+}
+
+static void summary(void) {
+    unsigned i, ran = 0, skipped = 0, never = 0, tests = 0, both = 0, one = 0;
+    line_t *l;
+
+    for (i = 0; i < nlines; ++i) {
+        l = &lines[i];
+        if (romcov_ran(&total, l->addr))
+            ++ran;
+        else if (romcov_skipped(&total, l->addr))
+            ++skipped;
+        else
+            ++never;
+
+        if (may_skip(l->op) && romcov_ran(&total, l->addr)) {
+            ++tests;
+            if (romcov_ran(&total, l->next) && romcov_skipped(&total, l->next))
+                ++both;
+            else if (covered(&total, l->next))
+                ++one;
+        }
+    }
+    printf("%u instructions: %u ran (%.1f%%), %u only skipped, %u never reached\n",
+            nlines, ran, 100.0 * ran / nlines, skipped, never);
+    printf("%u tests ran: %u saw both outcomes, %u saw one\n", tests, both, one);
+}
+
+static void annotate(void) {
+    char buf[64];
+    const char *mark;
+    unsigned i;
+    line_t *l;
+
+    for (i = 0; i < nlines; ++i) {
+        l = &lines[i];
+        if (romcov_ran(&total, l->addr))
+            mark = romcov_skipped(&total, l->addr) ? "both" : "ran";
+        else
+            mark = romcov_skipped(&total, l->addr) ? "skip" : "----";
+        format_line(l, buf, sizeof(buf));
+        printf("%-4s  %-28s", mark, buf);
+        if (may_skip(l->op) && romcov_ran(&total, l->addr)) {
+            if (romcov_skipped(&total, l->next))
+                printf(romcov_ran(&total, l->next) ? "  skipped, fell through" : "  skipped only");
+            else if (romcov_ran(&total, l->next))
+                printf("  fell through only");
+        }
+        printf("\n");
+    }
+}
+
+// lcov tracefile over a listing with one line per instruction; each test
+// is a branch, taken when it skipped
+static void lcov(const char *prefix) {
+    char name[4096], buf[64];
+    unsigned i, lh = 0, brf = 0, brh = 0;
+    FILE *lst, *info;
+    line_t *l;
+
+    snprintf(name, sizeof(name), "%s.lst", prefix);
+    lst = fopen(name, "w");
+    if (lst == NULL)
+        err(1, "Can't open %s", name);
+    for (i = 0; i < nlines; ++i) {
+        format_line(&lines[i], buf, sizeof(buf));
+        fprintf(lst, "%s\n", buf);
+    }
+    fclose(lst);
+
+    snprintf(name, sizeof(name), "%s.info", prefix);
+    info = fopen(name, "w");
+    if (info == NULL)
+        err(1, "Can't open %s", name);
+    fprintf(info, "TN:\nSF:%s.lst\n", prefix);
+    for (i = 0; i < nlines; ++i) {
+        l = &lines[i];
+        if (!may_skip(l->op))
+            continue;
+        if (!romcov_ran(&total, l->addr)) {
+            fprintf(info, "BRDA:%u,0,0,-\nBRDA:%u,0,1,-\n", i + 1, i + 1);
+        } else {
+            fprintf(info, "BRDA:%u,0,0,%d\nBRDA:%u,0,1,%d\n",
+                    i + 1, romcov_skipped(&total, l->next), i + 1, romcov_ran(&total, l->next));
+            brh += romcov_skipped(&total, l->next) + romcov_ran(&total, l->next);
+        }
+        brf += 2;
+    }
+    for (i = 0; i < nlines; ++i) {
+        fprintf(info, "DA:%u,%d\n", i + 1, romcov_ran(&total, lines[i].addr));
+        lh += romcov_ran(&total, lines[i].addr);
+    }
+    fprintf(info, "BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n", brf, brh, nlines, lh);
+    fclose(info);
+}
+
+// a JSON string, quotes included
+static void json_string(const char *str) {
+    const unsigned char *p;
+
+    putchar('"');
+    for (p = (const unsigned char *)str; *p; ++p) {
+        if (*p == '"' || *p == '\\')
+            printf("\\%c", *p);
+        else if (*p < 0x20)
+            printf("\\u%04x", *p);
+        else
+            putchar(*p);
+    }
+    putchar('"');
+}
+
+static void json(const char *rom_name) {
+    char dis[32];
+    unsigned i;
+    line_t *l;
+
+    printf("{\"rom\": ");
+    json_string(rom_name);
+    printf(", \"rom_id\": \"%08x\", \"instructions\": [\n", romcov_rom_id(sm));
+    for (i = 0; i < nlines; ++i) {
+        l = &lines[i];
+        sm5_disasm(l->op, l->arg, dis, sizeof(dis));
+        printf("  {\"pc\": \"%x.%02x\", \"op\": \"%s\", \"ran\": %s, \"skipped\": %s",
+                l->addr >> 6, l->addr & 0x3f, dis,
+                romcov_ran(&total, l->addr) ? "true" : "false",
+                romcov_skipped(&total, l->addr) ? "true" : "false");
+        if (may_skip(l->op))
+            printf(", \"outcomes\": {\"skip\": %s, \"fall_through\": %s}",
+                    romcov_ran(&total, l->addr) && romcov_skipped(&total, l->next) ? "true" : "false",
+                    romcov_ran(&total, l->addr) && romcov_ran(&total, l->next) ? "true" : "false");
+        printf("}%s\n", i + 1 < nlines ? "," : "");
+    }
+    printf("]}\n");
+}
+
+static unsigned count_new(const sm5_romcov_t *cov, const sm5_romcov_t *have) {
+    unsigned i, n = 0;
+
+    for (i = 0; i < 0x80; ++i)
+        n += __builtin_popcount(cov->executed[i] & ~have->executed[i])
+           + __builtin_popcount(cov->skipped[i] & ~have->skipped[i]);
+    return n;
+}
+
+// greedy set cover: the file adding the most coverage, until none adds any
+static void select_files(sm5_romcov_t *cov, char **names, unsigned n) {
+    sm5_romcov_t have;
+    unsigned i, best, gain, best_gain, picked = 0;
+
+    memset(&have, 0, sizeof(have));
+    while (1) {
+        best_gain = 0;
+        best = 0;
+        for (i = 0; i < n; ++i) {
+            gain = count_new(&cov[i], &have);
+            if (gain > best_gain) {
+                best_gain = gain;
+                best = i;
+            }
+        }
+        if (best_gain == 0)
+            break;
+        for (i = 0; i < 0x80; ++i) {
+            have.executed[i] |= cov[best].executed[i];
+            have.skipped[i] |= cov[best].skipped[i];
+        }
+        ++picked;
+        printf("%s  +%u\n", names[best], best_gain);
+    }
+    printf("%u of %u files cover everything\n", picked, n);
+}
+
+static void usage(char *prog) {
+    printf("Usage: %s [options] <rom.bin> <coverage>...\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("    -m <variant>     SM5 variant\n");
+    printf("    -a               annotated disassembly\n");
+    printf("    -j               JSON\n");
+    printf("    -l <prefix>      write an lcov tracefile and its listing\n");
+    printf("    -o <coverage>    write the merged coverage\n");
+    printf("    -s               pick a small set of files covering as much as all\n");
+}
+
+int main(int argc, char **argv) {
+    char *variant_name = NULL, *lcov_prefix = NULL, *out_name = NULL;
+    int opt, do_annotate = 0, do_json = 0, do_select = 0;
+    sm5_romcov_t *cov;
+    uint32_t id, rom_id;
+    unsigned i, j, files;
+
+    while ((opt = getopt(argc, argv, "m:ajl:o:s")) != -1) {
+        switch (opt) {
+            case 'm':
+                variant_name = optarg;
+                break;
+            case 'a':
+                do_annotate = 1;
+                break;
+            case 'j':
+                do_json = 1;
+                break;
+            case 'l':
+                lcov_prefix = optarg;
+                break;
+            case 'o':
+                out_name = optarg;
+                break;
+            case 's':
+                do_select = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    sm = variant_name ? sm5_create_variant(variant_name) : sm5_create();
+    if (sm == NULL)
+        errx(1, "Can't create emulator for variant %s", variant_name);
+    if (sm5_load_rom(sm, argv[optind]) != SM5_OK)
+        errx(1, "Can't read ROM %s", argv[optind]);
+    rom_id = romcov_rom_id(sm);
+
+    files = argc - optind - 1;
+    cov = calloc(files, sizeof(*cov));
+    if (cov == NULL)
+        err(1, "Can't allocate coverage");
+    for (i = 0; i < files; ++i) {
+        if (!romcov_load(argv[optind + 1 + i], &cov[i], &id))
+            errx(1, "%s is not a coverage file", argv[optind + 1 + i]);
+        if (id != rom_id)
+            errx(1, "%s is coverage of another ROM", argv[optind + 1 + i]);
+    }
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < files; ++i)
+        for (j = 0; j < 0x80; ++j) {
+            total.executed[j] |= cov[i].executed[j];
+            total.skipped[j] |= cov[i].skipped[j];
+        }
+    build_listing();
+
+    if (out_name != NULL && !romcov_save(out_name, &total, rom_id))
+        err(1, "Can't write %s", out_name);
+    if (lcov_prefix != NULL)
+        lcov(lcov_prefix);
+
+    if (do_select)
+        select_files(cov, argv + optind + 1, files);
+    else if (do_json)
+        json(argv[optind]);
+    else if (do_annotate)
+        annotate();
+    else
+        summary();
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+#ifndef __SM5INT_H__
+#define __SM5INT_H__
+
+// libsm5 internals, shared by the core's translation units
+
+#include "sm5.h"
+
+typedef uint8_t u8;
+typedef sm5_pc_t pc_t;
+
+struct memo;
+struct loop;
+
+typedef void (*sm5_handler_t)(sm5_t *s, u8 op, u8 arg);
+
+// predecoded ROM, one entry per address
+typedef struct _sm5_insn_t {
+    sm5_handler_t handler;  // NULL for unknown opcodes
+    u8 op, arg, len;
+    u8 fusion;              // superinstruction starting here, 0 for none
+    u8 lead;                // cycles of all but its last instruction
+    u8 cls;                 // SM5_CLASS_*
+    uint16_t loc;           // coverage map location
+} sm5_insn_t;
+
+#define SM5_MAX_FUSIONS 32
+
+struct _sm5_core_t;
+
+// A ROM predecoded for one core. Built once per distinct ROM and core by
+// image.c, then sealed read-only and shared by every instance using it.
+typedef struct _sm5_rom_image_t {
+    sm5_insn_t code[0x10][0x40];
+    u8 rom[0x10][0x40];     // sized for the largest variant
+    unsigned fusion_sites[SM5_MAX_FUSIONS];
+    const struct _sm5_core_t *core;
+    uint64_t hash;
+    size_t len;             // bytes loaded, the rest is zero
+} sm5_rom_image_t;
+
+// an interpreter specialized for one variant, from sm5core.c
+typedef struct _sm5_core_t {
+    sm5_variant_t variant;
+    int (*step)(sm5_t *s);
+    int (*run)(sm5_t *s, unsigned cycles);
+    unsigned (*fetch)(sm5_t *s, u8 *op, u8 *arg);
+    void (*decode)(sm5_rom_image_t *img);
+    // after one ROM byte changed, redecode what it touches
+    void (*patch)(sm5_rom_image_t *img, unsigned page, unsigned addr);
+
+    // superinstructions, numbered from 1
+    unsigned fusions;
+    const char *const *fusion_name;
+} sm5_core_t;
+
+struct sm5 {
+    sm5_state_t cpu;
+    const sm5_rom_image_t *img;
+    sm5_image_t *image;     // the reference img was taken through
+    const sm5_core_t *core;
+
+    sm5_read_fn read;
+    sm5_write_fn write;
+    void *io_ctx;
+
+    int status;             // set by a handler to end the step
+    int stop;
+
+    uint64_t mem_hash;      // Zobrist hash of RAM and REG
+    int memo_recording;
+    struct memo *memo;
+    struct loop *loop;
+
+    u8 rom_cov[2][0x400];   // ran, skipped; a byte per ROM address
+    u8 *edges;              // coverage map, NULL when off
+    uint16_t prev_loc;
+
+    int fuse;
+    unsigned long long fusion_fired[SM5_MAX_FUSIONS];
+
+    sm5_stats_t stats;
+
+#ifdef SM5_TAINT
+    sm5_taint_t taint;
+#endif
+};
+
+#define B ((s->cpu.BM << 4) | s->cpu.BL)
+
+// sm5.c: NULL for the default
+const sm5_core_t *core_find(const char *name);
+// sm5_run without reading the host clock, which would cost more than a
+// short slice
+int run_slice(sm5_t *s, unsigned cycles);
+
+// hash.c
+extern uint64_t zobrist_ram[0x100][0x10];
+extern uint64_t zobrist_reg[0x10][0x10];
+
+void hash_init(void);
+void hash_reset(sm5_t *s);
+int loop_step(sm5_t *s);
+void loop_free(sm5_t *s);
+
+u8 memo_read(sm5_t *s, u8 addr);
+void memo_write(sm5_t *s, u8 addr);
+int memo_call(sm5_t *s, u8 op, u8 arg);
+void memo_after(sm5_t *s, int returned);
+void memo_abort(sm5_t *s);
+void memo_free(sm5_t *s);
+
+// RAM and REG accesses from handlers keep the hash and the memo recorder
+// up to date
+#define RAM_GET(s, a) ((s)->memo_recording ? memo_read(s, a) : sm5_ram_peek(&(s)->cpu, a))
+#define RAM_SET(s, a, v) do { \
+        u8 _a = (a), _v = (v) & 0xf; \
+        (s)->mem_hash ^= zobrist_ram[_a][sm5_ram_peek(&(s)->cpu, _a)] ^ zobrist_ram[_a][_v]; \
+        if ((s)->memo_recording) \
+            memo_write(s, _a); \
+        sm5_ram_poke(&(s)->cpu, _a, _v); \
+    } while (0)
+#define REG_SET(s, r, v) do { \
+        u8 _r = (r) & 0xf, _v = (v) & 0xf; \
+        (s)->mem_hash ^= zobrist_reg[_r][sm5_reg_peek(&(s)->cpu, _r)] ^ zobrist_reg[_r][_v]; \
+        sm5_reg_poke(&(s)->cpu, _r, _v); \
+    } while (0)
+
+#define MEMO_IMPURE(s) do { if ((s)->memo_recording) memo_abort(s); } while (0)
+
+// Tag propagation, compiled out unless built with TAINT=1. TAG is the tag
+// a write stores: the value's origins plus the control flow's.
+#ifdef SM5_TAINT
+#define TAINT(...) do { __VA_ARGS__; } while (0)
+#else
+#define TAINT(...) do { } while (0)
+#endif
+#define TAG(s, t) ((t) | (s)->taint.flow)
+// control flow picks up everything but constants
+#define TAINT_FLOW (~SM5_TAINT_CONST & 0xff)
+
+#endif
@@ -0,0 +1,199 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sched.h"
+#include "sm5.h"
+
+// Runs pairs of linked instances, a and b, on one thread with the
+// scheduler in sched.h. Every pair starts from reset, so every pair should
+// end in the same state; -x runs them in lockstep instead, which should
+// end in the same state too, only slower.
+
+#define MAX_WIRES   16
+
+typedef struct _wire_spec_t {
+    int from, to;               // 0 for a, 1 for b
+    sm5_level_fn level;
+    unsigned port;
+} wire_spec_t;
+
+// bit 0 of a REG file entry
+#define REG_LEVEL(n) \
+    static int reg_level_##n(sm5_t *s) { return sm5_reg_peek(sm5_state(s), n) & 1; }
+REG_LEVEL(0) REG_LEVEL(1) REG_LEVEL(2) REG_LEVEL(3)
+REG_LEVEL(4) REG_LEVEL(5) REG_LEVEL(6) REG_LEVEL(7)
+REG_LEVEL(8) REG_LEVEL(9) REG_LEVEL(10) REG_LEVEL(11)
+REG_LEVEL(12) REG_LEVEL(13) REG_LEVEL(14) REG_LEVEL(15)
+
+static const sm5_level_fn reg_level[16] = {
+    reg_level_0, reg_level_1, reg_level_2, reg_level_3,
+    reg_level_4, reg_level_5, reg_level_6, reg_level_7,
+    reg_level_8, reg_level_9, reg_level_10, reg_level_11,
+    reg_level_12, reg_level_13, reg_level_14, reg_level_15,
+};
+
+static int side(char c) {
+    return c == 'a' ? 0 : c == 'b' ? 1 : -1;
+}
+
+// <a|b><p|r<reg>>:<a|b><port>, such as ap:b2 or br3:a1
+static int parse_wire(const char *spec, wire_spec_t *w) {
+    const char *p = spec;
+    char *end;
+    unsigned reg;
+
+    if ((w->from = side(*p++)) < 0)
+        return 0;
+    if (*p == 'p') {
+        w->level = sm5_port2_level;
+        ++p;
+    } else if (*p == 'r') {
+        reg = strtoul(p + 1, &end, 16);
+        if (end == p + 1 || reg > 0xf)
+            return 0;
+        w->level = reg_level[reg];
+        p = end;
+    } else {
+        return 0;
+    }
+    if (*p++ != ':' || (w->to = side(*p++)) < 0)
+        return 0;
+    if (*p < '1' || *p > '3' || p[1] != 0)
+        return 0;
+    w->port = *p - '0';
+    return 1;
+}
+
+static uint64_t state_hash(sm5_t *s) {
+    return sm5_hash(s) ^ sm5_state(s)->cycle * 0x9e3779b97f4a7c15ull;
+}
+
+static void usage(char *prog) {
+    printf("Usage: %s [options] <a.bin> <b.bin>\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("    -m <variant>     SM5 variant\n");
+    printf("    -n <pairs>       pairs to run (default 1)\n");
+    printf("    -l <cycles>      cycles to run each instance (default 1000000)\n");
+    printf("    -q <cycles>      scheduler quantum\n");
+    printf("    -w <wire>        wire an output to a port, repeatable (default port 2\n");
+    printf("                     pins wired-AND: ap:a2 ap:b2 bp:a2 bp:b2)\n");
+    printf("    -x               run in lockstep, for comparison\n");
+    printf("\n");
+    printf("A wire is <a|b><output>:<a|b><port>, the output being p for the port 2\n");
+    printf("pin or r<reg> for bit 0 of a REG entry, such as br3:a1.\n");
+}
+
+int main(int argc, char **argv) {
+    static const char *default_wires[] = { "ap:a2", "ap:b2", "bp:a2", "bp:b2" };
+    char *variant_name = NULL;
+    wire_spec_t wire[MAX_WIRES];
+    unsigned nwires = 0, pairs = 1, cycles = 1000000, quantum = 0, i, j, live;
+    unsigned stopped[2] = { 0, 0 }, mismatch = 0;
+    int opt, lockstep = 0, status;
+    sm5_image_t *image[2];
+    sm5_sched_t *sch;
+    sm5_t **inst;
+    uint64_t first[2], h;
+    struct timespec start, end;
+    double secs;
+
+    while ((opt = getopt(argc, argv, "m:n:l:q:w:x")) != -1) {
+        switch (opt) {
+            case 'm':
+                variant_name = optarg;
+                break;
+            case 'n':
+                pairs = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                cycles = strtoul(optarg, NULL, 0);
+                break;
+            case 'q':
+                quantum = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                if (nwires == MAX_WIRES)
+                    errx(1, "At most %u wires", MAX_WIRES);
+                if (!parse_wire(optarg, &wire[nwires++]))
+                    errx(1, "Bad wire %s", optarg);
+                break;
+            case 'x':
+                lockstep = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind < 2 || pairs == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (nwires == 0)
+        for (nwires = 0; nwires < 4; ++nwires)
+            parse_wire(default_wires[nwires], &wire[nwires]);
+
+    for (i = 0; i < 2; ++i) {
+        image[i] = sm5_image_load(argv[optind + i], variant_name);
+        if (image[i] == NULL)
+            errx(1, "Can't read ROM %s", argv[optind + i]);
+    }
+
+    sch = sm5_sched_create(quantum);
+    inst = calloc(pairs * 2, sizeof(*inst));
+    if (sch == NULL || inst == NULL)
+        err(1, "Can't allocate %u pairs", pairs);
+    sm5_sched_lockstep(sch, lockstep);
+    for (i = 0; i < pairs * 2; ++i) {
+        inst[i] = variant_name ? sm5_create_variant(variant_name) : sm5_create();
+        if (inst[i] == NULL)
+            errx(1, "Can't create instance");
+        sm5_set_image(inst[i], image[i & 1]);
+        if (sm5_sched_add(sch, inst[i]) != SM5_OK)
+            errx(1, "Can't add instance");
+    }
+    for (i = 0; i < pairs; ++i)
+        for (j = 0; j < nwires; ++j)
+            if (sm5_sched_wire(sch, inst[i * 2 + wire[j].from], wire[j].level,
+                        inst[i * 2 + wire[j].to], wire[j].port) != SM5_OK)
+                errx(1, "Can't wire pair %u", i);
+    sm5_image_release(image[0]);
+    sm5_image_release(image[1]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    live = sm5_sched_run(sch, cycles);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (i = 0; i < pairs * 2; ++i) {
+        status = sm5_sched_status(sch, inst[i]);
+        if (status != SM5_OK) {
+            ++stopped[i & 1];
+            if (i < 2)
+                printf("%c: %s at cycle %u\n", 'a' + i, sm5_strerror(status),
+                        sm5_state(inst[i])->cycle);
+        }
+        h = state_hash(inst[i]);
+        if (i < 2)
+            first[i] = h;
+        else if (h != first[i & 1])
+            ++mismatch;
+    }
+
+    printf("pairs %u running %u stopped a %u b %u mismatch %u\n",
+            pairs, live, stopped[0], stopped[1], mismatch);
+    printf("state a %016llx b %016llx\n", (unsigned long long)first[0], (unsigned long long)first[1]);
+    printf("%.3f s, %.1f Mcycles/s over all instances\n",
+            secs, (double)cycles * pairs * 2 / secs / 1e6);
+
+    sm5_sched_destroy(sch);
+    for (i = 0; i < pairs * 2; ++i)
+        sm5_destroy(inst[i]);
+    free(inst);
+    return mismatch != 0;
+}
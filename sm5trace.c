@@ -0,0 +1,175 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sm5.h"
+#include "trace.h"
+
+// Offline analyzer for traces written by sm5emu -t
+
+static const char *field_name[] = {
+    "A", "X", "BL", "BM", "SB", "C", "skip", "SP", "int",
+    "P0", "P1", "P2", "P3", "hiz",
+};
+
+static void print_rec(trace_rec_t *rec, sm5_state_t *after) {
+    char buf[32];
+    unsigned bit, i;
+
+    sm5_disasm(rec->op, rec->arg, buf, sizeof(buf));
+    printf("%10u %x.%02x  %-10s", rec->cycle, rec->pc.page, rec->pc.addr, buf);
+
+    for (bit = 0; bit < 14; ++bit)
+        if (rec->changed & (1 << bit))
+            printf(" %s=%x", field_name[bit], trace_field(after, bit));
+    if (rec->changed & TR_STACK)
+        printf(" stack");
+    for (i = 0; i < rec->cells; ++i) {
+        if (rec->cell[i].addr & TR_REG)
+            printf(" r%x=%x>%x", rec->cell[i].addr & 0xf, rec->cell[i].old, rec->cell[i].val);
+        else
+            printf(" [%02x]=%x>%x", rec->cell[i].addr, rec->cell[i].old, rec->cell[i].val);
+    }
+    printf("\n");
+}
+
+static void print_state(sm5_state_t *c) {
+    unsigned i;
+
+    printf("  PC=%x.%02x A=%x X=%x BM=%x BL=%x SB=%02x C=%d SP=%d skip=%d\n",
+            c->pc.page, c->pc.addr, c->A, c->X, c->BM, c->BL, c->SB, c->C, c->sp, c->skip);
+    printf("  P0=%x P1=%x P2=%x hiz=%d   cycle=%u\n", c->port[0], c->port[1], c->port[2], c->port2_hiz, c->cycle);
+    for (i = 0; i < c->sp; ++i)
+        printf("  SP[%d] %x.%02x\n", i, c->stack[i].page, c->stack[i].addr);
+
+    printf("  RAM ");
+    for (i = 0; i < 0x100; ++i) {
+        printf("%x", sm5_ram_peek(c, i));
+        if ((i & 15) == 15)
+            printf(i == 0xff ? "\n" : "\n      ");
+    }
+    printf("  REG ");
+    for (i = 0; i < 0x10; ++i)
+        printf("%x", sm5_reg_peek(c, i));
+    printf("\n");
+}
+
+static int touches(trace_rec_t *rec, unsigned addr) {
+    unsigned i;
+
+    for (i = 0; i < rec->cells; ++i)
+        if (rec->cell[i].addr == addr)
+            return 1;
+    return 0;
+}
+
+static void usage(char *prog) {
+    printf("Usage: %s [options] <trace>\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("    -i               summary\n");
+    printf("    -s <cycle>       start at cycle\n");
+    printf("    -e <cycle>       stop at cycle\n");
+    printf("    -p <page.addr>   only instructions at this PC\n");
+    printf("    -a <addr>        only instructions that write RAM cell addr\n");
+    printf("    -r <reg>         only instructions that write REG reg\n");
+    printf("    -S <cycle>       print the full state at cycle\n");
+}
+
+int main(int argc, char **argv) {
+    trace_reader_t r;
+    trace_info_t info;
+    trace_rec_t *rec;
+    unsigned start = 0, end = ~0u, state_at = 0, page = 0, addr = 0, cell = 0;
+    int opt, info_only = 0, want_state = 0, filter_pc = 0, filter_cell = 0;
+    char *dot;
+
+    while ((opt = getopt(argc, argv, "is:e:p:a:r:S:")) != -1) {
+        switch (opt) {
+            case 'i':
+                info_only = 1;
+                break;
+            case 's':
+                start = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                end = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                dot = strchr(optarg, '.');
+                if (dot == NULL)
+                    errx(1, "PC must be page.addr");
+                page = strtoul(optarg, NULL, 16);
+                addr = strtoul(dot + 1, NULL, 16);
+                filter_pc = 1;
+                break;
+            case 'a':
+                cell = strtoul(optarg, NULL, 16) & 0xff;
+                filter_cell = 1;
+                break;
+            case 'r':
+                cell = TR_REG | (strtoul(optarg, NULL, 16) & 0xf);
+                filter_cell = 1;
+                break;
+            case 'S':
+                state_at = strtoul(optarg, NULL, 0);
+                want_state = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!trace_reader_open(&r, argv[optind]))
+        errx(1, "Can't read trace %s", argv[optind]);
+
+    if (info_only) {
+        if (!trace_info(&r, &info))
+            errx(1, "Trace is empty");
+        printf("variant %s\n", r.variant);
+        printf("%llu instructions, cycles %u-%u, %u chunks\n",
+                (unsigned long long)info.records, info.first_cycle, info.last_cycle, info.chunks);
+        printf("%llu bytes, %.2f bytes/instruction, %.1fx compression\n",
+                (unsigned long long)info.file_bytes, (double)info.file_bytes / info.records,
+                (double)info.raw_bytes / info.file_bytes);
+        return 0;
+    }
+
+    rec = malloc(sizeof(*rec));
+    if (rec == NULL)
+        err(1, "Can't allocate record");
+
+    // state at the first instruction boundary at or after the cycle
+    if (want_state) {
+        if (!trace_seek(&r, state_at))
+            errx(1, "Trace is empty");
+        while (r.state.cycle < state_at && trace_next(&r, rec))
+            ;
+        print_state(&r.state);
+        return 0;
+    }
+
+    if (!trace_seek(&r, start))
+        errx(1, "Trace is empty");
+    while (trace_next(&r, rec)) {
+        if (rec->cycle < start)
+            continue;
+        if (rec->cycle > end)
+            break;
+        if (filter_pc && (rec->pc.page != page || rec->pc.addr != addr))
+            continue;
+        if (filter_cell && !touches(rec, cell))
+            continue;
+        print_rec(rec, &r.state);
+    }
+
+    trace_reader_close(&r);
+    return 0;
+}
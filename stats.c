@@ -0,0 +1,114 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+
+// Runtime metrics
+//
+// The core keeps its own counters (sm5_stats). The CLI adds the session
+// count and wall time, prints them for the debugger's stats command and,
+// with -j, writes them to a file descriptor as one JSON object per line:
+// every interval while running and a last one with "final": true at exit.
+// Counters are totals since startup, so rates over an interval are the
+// difference of two lines.
+
+int stats_on = 0;
+unsigned stats_sessions = 0;
+
+static FILE *out = NULL;
+static unsigned interval;
+static struct timespec start;
+static double due;
+
+static double elapsed(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static unsigned long long executed(const sm5_stats_t *st) {
+    unsigned long long n = 0;
+    unsigned i;
+
+    for (i = 0; i < SM5_CLASSES; ++i)
+        n += st->insns[i];
+    return n;
+}
+
+static double ratio(unsigned long long n, unsigned long long total) {
+    return total ? (double)n / total : 0;
+}
+
+static void write_line(int final) {
+    sm5_stats_t st;
+    unsigned long long insns;
+    unsigned i;
+
+    sm5_stats(sm, &st);
+    insns = executed(&st);
+    fprintf(out, "{\"t\": %.3f, \"sessions\": %u, \"cycle\": %u, \"cycles\": %llu, \"insns\": %llu, \"mix\": {",
+            elapsed(), stats_sessions, cpu->cycle, st.cycles, insns);
+    for (i = 0; i < SM5_CLASSES; ++i)
+        fprintf(out, "%s\"%s\": %llu", i ? ", " : "", sm5_class_name(i), st.insns[i]);
+    fprintf(out, "}, \"skipped\": %llu, \"skip_rate\": %.4f, \"fused\": %llu, \"fused_rate\": %.4f"
+            ", \"interrupts\": %llu, \"port_reads\": %llu, \"port_writes\": %llu, \"stack_max\": %u"
+            ", \"run_insns\": %llu, \"host_ns\": %llu, \"ns_per_insn\": %.2f%s}\n",
+            st.skipped, ratio(st.skipped, insns + st.skipped), st.fused, ratio(st.fused, insns),
+            st.interrupts, st.port_reads, st.port_writes, st.stack_max,
+            st.run_insns, st.host_ns, ratio(st.host_ns, st.run_insns),
+            final ? ", \"final\": true" : "");
+    fflush(out);
+}
+
+static void stats_close(void) {
+    write_line(1);
+    fclose(out);
+}
+
+void stats_open(int fd, unsigned interval_ms) {
+    out = fdopen(fd, "w");
+    if (out == NULL)
+        err(1, "Can't write stats to fd %d", fd);
+    interval = interval_ms;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    due = interval / 1e3;
+    stats_on = 1;
+    atexit(stats_close);
+}
+
+void stats_poll(void) {
+    double now;
+
+    if (interval == 0)
+        return;
+    now = elapsed();
+    if (now < due)
+        return;
+    write_line(0);
+    // skip intervals missed while a long run was in progress
+    while (due <= now)
+        due += interval / 1e3;
+}
+
+void stats_report(void) {
+    sm5_stats_t st;
+    unsigned long long insns;
+    unsigned i;
+
+    sm5_stats(sm, &st);
+    insns = executed(&st);
+    printf("%llu instructions, %llu skipped (%.1f%%), %llu fused (%.1f%%)\n",
+            insns, st.skipped, 100 * ratio(st.skipped, insns + st.skipped),
+            st.fused, 100 * ratio(st.fused, insns));
+    for (i = 0; i < SM5_CLASSES; ++i)
+        printf("  %-9s %12llu  %5.1f%%\n", sm5_class_name(i), st.insns[i], 100 * ratio(st.insns[i], insns));
+    printf("%llu cycles over %u sessions, %llu interrupts\n", st.cycles, stats_sessions, st.interrupts);
+    printf("%llu port reads, %llu port writes, stack high-water %u\n",
+            st.port_reads, st.port_writes, st.stack_max);
+    if (st.run_insns)
+        printf("%.1f ns/instruction over %llu instructions run\n",
+                ratio(st.host_ns, st.run_insns), st.run_insns);
+}
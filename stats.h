@@ -0,0 +1,16 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "emu.h"
+
+// set while JSON lines are being written
+extern int stats_on;
+extern unsigned stats_sessions;
+
+// a JSON line of the counters to fd every interval ms, and one at exit
+void stats_open(int fd, unsigned interval_ms);
+// from the run loop: writes a line if one is due
+void stats_poll(void);
+void stats_report(void);
+
+#endif
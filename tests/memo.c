@@ -0,0 +1,52 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../sm5.h"
+
+// Memoized calls have to end in the state stepping them would: a far CALL
+// (F4-FF, whose page wraps within ROM) and a routine called from two sites.
+
+static int run(const uint8_t *rom, size_t len, int memo, sm5_state_t *out) {
+    sm5_memo_stats_t stats;
+    sm5_t *s = sm5_create_variant("cic6105");
+    int status;
+
+    if (s == NULL || sm5_load_rom_mem(s, rom, len) != SM5_OK)
+        errx(1, "Can't create an instance");
+    if (memo && sm5_memo_enable(s, 1) != SM5_OK)
+        errx(1, "Can't enable memoization");
+    sm5_reset(s);
+    status = sm5_run(s, 1000);
+    sm5_snapshot(s, out);
+    sm5_memo_stats(s, &stats);
+    sm5_destroy(s);
+    if (memo && stats.hits == 0)
+        errx(1, "no memo hits");
+    return status;
+}
+
+int main(void) {
+    uint8_t rom[0x400] = { 0 };
+    sm5_state_t plain, memo;
+    int a, b;
+
+    // call ff 00 from two sites: page 3c wraps to c
+    rom[0x000] = 0x10;                      // lax 0
+    rom[0x001] = 0xff; rom[0x002] = 0x00;
+    rom[0x003] = 0x10;
+    rom[0x004] = 0xff; rom[0x005] = 0x00;
+    rom[0x006] = 0x77;                      // halt
+    rom[0x300] = 0x15;                      // lax 5
+    rom[0x301] = 0x7d;                      // rtn
+
+    a = run(rom, sizeof(rom), 0, &plain);
+    b = run(rom, sizeof(rom), 1, &memo);
+    if (a != SM5_HALT || b != SM5_HALT)
+        errx(1, "far call: %s without memo, %s with", sm5_strerror(a), sm5_strerror(b));
+    if (memcmp(&plain, &memo, sizeof(plain)) != 0)
+        errx(1, "far call: memoized state differs");
+
+    printf("memo ok\n");
+    return 0;
+}
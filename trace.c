@@ -0,0 +1,551 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "trace.h"
+
+// Execution trace
+//
+// The trace starts with "SM5T", a version byte and the variant name (a
+// length byte and the name). The rest is chunks. Each chunk has a header of
+// three little-endian 32-bit words (uncompressed size, compressed size and
+// record count), then a keyframe holding the full machine state before its
+// first record, then its records compressed with zlib.
+//
+// There is one record per instruction. It holds the opcode and the state
+// changes the instruction made:
+//
+//   flags      TF_* below
+//   op
+//   arg        if TF_ARG: two byte instruction
+//   pc         if TF_PC: page and address of the next instruction, when it
+//              doesn't follow this one
+//   cycles     if TF_CYCLE: cycles taken as a varint, when it isn't the
+//              instruction length
+//   changed    if TF_REGS: 16-bit mask of TR_* fields, then a byte for each
+//              in bit order (8 for the stack)
+//   cells      if TF_CELLS: a varint count, then the low byte of each
+//              address and (REG << 4) | new value
+//
+// The PC of a record and its starting cycle come from the state left by
+// the one before, so a chunk can be decoded on its own from its keyframe.
+
+#define TRACE_MAGIC     "SM5T"
+#define TRACE_VERSION   1
+#define CHUNK_SIZE      (256 * 1024)
+#define CHUNK_MAX       (CHUNK_SIZE + 1024)     // room for one more record past CHUNK_SIZE
+#define CHUNK_HEADER    12
+#define KEY_SIZE        (0x100 + 0x10 + 2 + 8 + 9 + 5 + 4)
+
+#define TF_ARG      0x01
+#define TF_PC       0x02
+#define TF_CYCLE    0x04
+#define TF_REGS     0x08
+#define TF_CELLS    0x10
+
+typedef uint8_t u8;
+
+static void put32(u8 *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get32(const u8 *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void key_pack(u8 *key, const sm5_state_t *c) {
+    unsigned i;
+    u8 *p = key;
+
+    for (i = 0; i < 0x100; ++i)
+        *p++ = sm5_ram_peek(c, i);
+    for (i = 0; i < 0x10; ++i)
+        *p++ = sm5_reg_peek(c, i);
+    *p++ = c->pc.page;
+    *p++ = c->pc.addr;
+    for (i = 0; i < 4; ++i) {
+        *p++ = c->stack[i].page;
+        *p++ = c->stack[i].addr;
+    }
+    *p++ = c->sp;
+    *p++ = c->A;
+    *p++ = c->X;
+    *p++ = c->BL;
+    *p++ = c->BM;
+    *p++ = c->SB;
+    *p++ = c->C;
+    *p++ = c->skip;
+    *p++ = c->interrupt;
+    for (i = 0; i < 4; ++i)
+        *p++ = c->port[i];
+    *p++ = c->port2_hiz;
+    put32(p, c->cycle);
+}
+
+static void key_unpack(sm5_state_t *c, const u8 *key) {
+    unsigned i;
+    const u8 *p = key;
+
+    memset(c, 0, sizeof(*c));
+    for (i = 0; i < 0x100; ++i)
+        sm5_ram_poke(c, i, *p++);
+    for (i = 0; i < 0x10; ++i)
+        sm5_reg_poke(c, i, *p++);
+    c->pc.page = *p++;
+    c->pc.addr = *p++;
+    for (i = 0; i < 4; ++i) {
+        c->stack[i].page = *p++;
+        c->stack[i].addr = *p++;
+    }
+    c->sp = *p++;
+    c->A = *p++;
+    c->X = *p++;
+    c->BL = *p++;
+    c->BM = *p++;
+    c->SB = *p++;
+    c->C = *p++;
+    c->skip = *p++;
+    c->interrupt = *p++;
+    for (i = 0; i < 4; ++i)
+        c->port[i] = *p++;
+    c->port2_hiz = *p++;
+    c->cycle = get32(p);
+    c->frame_pc = c->pc;
+}
+
+// the registers in TR_* bit order
+static u8 *field(sm5_state_t *c, unsigned bit) {
+    switch (bit) {
+        case 0:  return &c->A;
+        case 1:  return &c->X;
+        case 2:  return &c->BL;
+        case 3:  return &c->BM;
+        case 4:  return &c->SB;
+        case 5:  return &c->C;
+        case 6:  return &c->skip;
+        case 7:  return &c->sp;
+        case 8:  return &c->interrupt;
+        case 9:  case 10: case 11: case 12:
+                 return &c->port[bit - 9];
+        case 13: return &c->port2_hiz;
+    }
+    return NULL;
+}
+
+uint8_t trace_field(const sm5_state_t *c, unsigned bit) {
+    return *field((sm5_state_t *)c, bit);
+}
+
+static sm5_pc_t next_pc(sm5_pc_t pc, unsigned len) {
+    pc.addr = (pc.addr + len) & 0x3f;
+    return pc;
+}
+
+
+////////////////////////////////
+// writer
+//
+
+static FILE *trace_file = NULL;
+static u8 *chunk = NULL;            // header, keyframe and records
+static size_t chunk_len = 0;
+static unsigned chunk_records = 0;
+static u8 *zbuf = NULL;
+static uLong zbuf_size = 0;
+
+// the instruction whose record is written once its effects are known
+static sm5_state_t prev;
+static u8 pend_op, pend_arg;
+static unsigned pend_len = 0;
+
+static void put_varint(u8 **p, unsigned v) {
+    while (v >= 0x80) {
+        *(*p)++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *(*p)++ = v;
+}
+
+static void flush_chunk(void) {
+    uLongf zlen = zbuf_size;
+    size_t raw = chunk_len - CHUNK_HEADER - KEY_SIZE;
+
+    if (chunk_records == 0)
+        return;
+    if (compress2(zbuf, &zlen, chunk + CHUNK_HEADER + KEY_SIZE, raw, 1) != Z_OK)
+        errx(1, "Can't compress trace");
+
+    put32(chunk, raw);
+    put32(chunk + 4, zlen);
+    put32(chunk + 8, chunk_records);
+    fwrite(chunk, CHUNK_HEADER + KEY_SIZE, 1, trace_file);
+    fwrite(zbuf, zlen, 1, trace_file);
+
+    chunk_len = 0;
+    chunk_records = 0;
+}
+
+static void put_record(const sm5_state_t *next) {
+    u8 *p;
+    unsigned i, bit, cells = 0;
+    uint16_t changed = 0;
+    sm5_pc_t pc = next_pc(prev.pc, pend_len);
+    sm5_state_t *c = (sm5_state_t *)next;   // only read
+    u8 flags = 0;
+
+    if (chunk_len == 0) {
+        key_pack(chunk + CHUNK_HEADER, &prev);
+        chunk_len = CHUNK_HEADER + KEY_SIZE;
+    }
+    p = chunk + chunk_len;
+
+    for (bit = 0; bit < 14; ++bit)
+        if (*field(c, bit) != *field(&prev, bit))
+            changed |= 1 << bit;
+    if (memcmp(c->stack, prev.stack, sizeof(c->stack)) != 0)
+        changed |= TR_STACK;
+
+    if (pend_len == 2)
+        flags |= TF_ARG;
+    if (next->pc.page != pc.page || next->pc.addr != pc.addr)
+        flags |= TF_PC;
+    if (next->cycle - prev.cycle != pend_len)
+        flags |= TF_CYCLE;
+    if (changed)
+        flags |= TF_REGS;
+    if (memcmp(next->ram, prev.ram, sizeof(prev.ram)) != 0
+            || memcmp(next->reg, prev.reg, sizeof(prev.reg)) != 0)
+        flags |= TF_CELLS;
+
+    *p++ = flags;
+    *p++ = pend_op;
+    if (flags & TF_ARG)
+        *p++ = pend_arg;
+    if (flags & TF_PC) {
+        *p++ = next->pc.page;
+        *p++ = next->pc.addr;
+    }
+    if (flags & TF_CYCLE)
+        put_varint(&p, next->cycle - prev.cycle);
+    if (flags & TF_REGS) {
+        *p++ = changed;
+        *p++ = changed >> 8;
+        for (bit = 0; bit < 14; ++bit)
+            if (changed & (1 << bit))
+                *p++ = *field(c, bit);
+        if (changed & TR_STACK)
+            for (i = 0; i < 4; ++i) {
+                *p++ = next->stack[i].page;
+                *p++ = next->stack[i].addr;
+            }
+    }
+    if (flags & TF_CELLS) {
+        for (i = 0; i < 0x100; ++i)
+            cells += sm5_ram_peek(next, i) != sm5_ram_peek(&prev, i);
+        for (i = 0; i < 0x10; ++i)
+            cells += sm5_reg_peek(next, i) != sm5_reg_peek(&prev, i);
+        put_varint(&p, cells);
+
+        for (i = 0; i < 0x100; ++i)
+            if (sm5_ram_peek(next, i) != sm5_ram_peek(&prev, i)) {
+                *p++ = i;
+                *p++ = sm5_ram_peek(next, i);
+            }
+        for (i = 0; i < 0x10; ++i)
+            if (sm5_reg_peek(next, i) != sm5_reg_peek(&prev, i)) {
+                *p++ = i;
+                *p++ = 0x10 | sm5_reg_peek(next, i);
+            }
+    }
+
+    chunk_len = p - chunk;
+    ++chunk_records;
+    if (chunk_len - CHUNK_HEADER - KEY_SIZE >= CHUNK_SIZE)
+        flush_chunk();
+}
+
+int trace_open(const char *name, const char *variant) {
+    size_t n = strlen(variant);
+
+    trace_file = fopen(name, "w");
+    if (trace_file == NULL)
+        return 0;
+
+    chunk = malloc(CHUNK_HEADER + KEY_SIZE + CHUNK_MAX);
+    zbuf_size = compressBound(CHUNK_MAX);
+    zbuf = malloc(zbuf_size);
+    if (chunk == NULL || zbuf == NULL)
+        err(1, "Can't allocate trace buffers");
+
+    fwrite(TRACE_MAGIC, 4, 1, trace_file);
+    fputc(TRACE_VERSION, trace_file);
+    fputc(n, trace_file);
+    fwrite(variant, n, 1, trace_file);
+
+    chunk_len = 0;
+    chunk_records = 0;
+    pend_len = 0;
+    return 1;
+}
+
+void trace_step(const sm5_state_t *state, u8 op, u8 arg, unsigned len) {
+    if (pend_len)
+        put_record(state);
+    prev = *state;
+    pend_op = op;
+    pend_arg = arg;
+    pend_len = len;
+}
+
+void trace_close(const sm5_state_t *state) {
+    if (trace_file == NULL)
+        return;
+
+    if (pend_len)
+        put_record(state);
+    flush_chunk();
+    fclose(trace_file);
+    trace_file = NULL;
+    free(chunk);
+    free(zbuf);
+}
+
+
+////////////////////////////////
+// reader
+//
+
+// A trace is checked as it's read: every length against what is left of
+// the file or chunk and against where it goes. Anything that doesn't fit
+// is an error rather than the end of the trace.
+static void corrupt(const char *what) {
+    errx(1, "Corrupt trace: %s", what);
+}
+
+// n more bytes of the current chunk
+static void need(trace_reader_t *r, size_t n) {
+    if (r->len - r->pos < n)
+        corrupt("record runs past the end of its chunk");
+}
+
+static unsigned get_varint(trace_reader_t *r) {
+    unsigned v = 0, shift = 0;
+    u8 b;
+
+    do {
+        if (shift > 28)
+            corrupt("varint too long");
+        need(r, 1);
+        b = r->buf[r->pos++];
+        v |= (unsigned)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+// 0 at the end of the file
+static int read_header(trace_reader_t *r, u8 *hdr) {
+    size_t n = fread(hdr, 1, CHUNK_HEADER + KEY_SIZE, r->file);
+
+    if (n == 0)
+        return 0;
+    if (n != CHUNK_HEADER + KEY_SIZE)
+        corrupt("truncated chunk header");
+    return 1;
+}
+
+// load the chunk whose header has just been read
+static int load_chunk(trace_reader_t *r, const u8 *hdr) {
+    uLongf raw = get32(hdr), out = raw;
+    uint32_t zlen = get32(hdr + 4);
+    u8 *z;
+    int ok;
+
+    if (raw > CHUNK_MAX || zlen > compressBound(CHUNK_MAX))
+        corrupt("chunk size out of range");
+    z = malloc(zlen ? zlen : 1);
+    free(r->buf);
+    r->buf = malloc(raw ? raw : 1);
+    if (z == NULL || r->buf == NULL)
+        err(1, "Can't allocate trace buffers");
+
+    if (fread(z, 1, zlen, r->file) != zlen)
+        corrupt("truncated chunk");
+    ok = uncompress(r->buf, &out, z, zlen) == Z_OK && out == raw;
+    free(z);
+    if (!ok)
+        corrupt("chunk doesn't inflate to its size");
+
+    key_unpack(&r->state, hdr + CHUNK_HEADER);
+    if (r->state.sp > 4)
+        corrupt("keyframe stack pointer out of range");
+    r->len = raw;
+    r->pos = 0;
+    return 1;
+}
+
+int trace_reader_open(trace_reader_t *r, const char *name) {
+    char magic[5];
+    int n;
+
+    memset(r, 0, sizeof(*r));
+    r->file = fopen(name, "r");
+    if (r->file == NULL)
+        return 0;
+
+    if (fread(magic, 5, 1, r->file) != 1
+            || memcmp(magic, TRACE_MAGIC, 4) != 0 || magic[4] != TRACE_VERSION)
+        return 0;
+    n = getc(r->file);
+    if (n == EOF || n >= sizeof(r->variant) || fread(r->variant, n, 1, r->file) != 1)
+        return 0;
+    r->variant[n] = 0;
+    return 1;
+}
+
+void trace_reader_close(trace_reader_t *r) {
+    if (r->file != NULL)
+        fclose(r->file);
+    free(r->buf);
+    r->file = NULL;
+    r->buf = NULL;
+}
+
+int trace_seek(trace_reader_t *r, unsigned cycle) {
+    u8 hdr[CHUNK_HEADER + KEY_SIZE];
+    long start = 5 + 1 + strlen(r->variant), at, best = -1;
+    uint64_t index = 0, best_index = 0;
+
+    fseek(r->file, start, SEEK_SET);
+    while (read_header(r, hdr)) {
+        at = ftell(r->file) - sizeof(hdr);
+        if (get32(hdr + CHUNK_HEADER + KEY_SIZE - 4) > cycle && best >= 0)
+            break;
+        best = at;
+        best_index = index;
+        index += get32(hdr + 8);
+        fseek(r->file, get32(hdr + 4), SEEK_CUR);
+    }
+    if (best < 0)
+        return 0;
+
+    fseek(r->file, best, SEEK_SET);
+    r->index = best_index;
+    r->done = 0;
+    return read_header(r, hdr) && load_chunk(r, hdr);
+}
+
+int trace_next(trace_reader_t *r, trace_rec_t *rec) {
+    u8 hdr[CHUNK_HEADER + KEY_SIZE];
+    sm5_state_t *c = &r->state;
+    unsigned i, bit, cycles;
+    u8 flags, a, v;
+
+    if (r->done)
+        return 0;
+    if (r->pos == r->len) {
+        if (!read_header(r, hdr) || !load_chunk(r, hdr)) {
+            r->done = 1;
+            return 0;
+        }
+    }
+
+    need(r, 2);
+    flags = r->buf[r->pos++];
+    rec->index = r->index++;
+    rec->pc = c->pc;
+    rec->cycle = c->cycle;
+    rec->op = r->buf[r->pos++];
+    if (flags & TF_ARG)
+        need(r, 1);
+    rec->arg = flags & TF_ARG ? r->buf[r->pos++] : 0;
+    rec->len = flags & TF_ARG ? 2 : 1;
+    rec->changed = 0;
+    rec->cells = 0;
+
+    c->frame_pc = c->pc;
+    if (flags & TF_PC) {
+        need(r, 2);
+        c->pc.page = r->buf[r->pos++];
+        c->pc.addr = r->buf[r->pos++];
+    } else {
+        c->pc = next_pc(c->pc, rec->len);
+    }
+    cycles = flags & TF_CYCLE ? get_varint(r) : rec->len;
+    c->cycle += cycles;
+
+    if (flags & TF_REGS) {
+        need(r, 2);
+        rec->changed = r->buf[r->pos] | r->buf[r->pos + 1] << 8;
+        r->pos += 2;
+        for (bit = 0; bit < 14; ++bit)
+            if (rec->changed & (1 << bit)) {
+                need(r, 1);
+                *field(c, bit) = r->buf[r->pos++];
+            }
+        if (c->sp > 4)
+            corrupt("stack pointer out of range");
+        if (rec->changed & TR_STACK) {
+            need(r, 8);
+            for (i = 0; i < 4; ++i) {
+                c->stack[i].page = r->buf[r->pos++];
+                c->stack[i].addr = r->buf[r->pos++];
+            }
+        }
+    }
+    if (flags & TF_CELLS) {
+        rec->cells = get_varint(r);
+        if (rec->cells > sizeof(rec->cell) / sizeof(rec->cell[0]))
+            corrupt("too many cells in a record");
+        need(r, 2 * rec->cells);
+        for (i = 0; i < rec->cells; ++i) {
+            a = r->buf[r->pos++];
+            v = r->buf[r->pos++];
+            if (v & 0x10) {
+                rec->cell[i].addr = TR_REG | (a & 0xf);
+                rec->cell[i].old = sm5_reg_peek(c, a);
+                sm5_reg_poke(c, a, v);
+            } else {
+                rec->cell[i].addr = a;
+                rec->cell[i].old = sm5_ram_peek(c, a);
+                sm5_ram_poke(c, a, v);
+            }
+            rec->cell[i].val = v & 0xf;
+        }
+    }
+
+    return 1;
+}
+
+int trace_info(trace_reader_t *r, trace_info_t *info) {
+    u8 hdr[CHUNK_HEADER + KEY_SIZE];
+    long start = 5 + 1 + strlen(r->variant);
+
+    memset(info, 0, sizeof(*info));
+    fseek(r->file, start, SEEK_SET);
+    while (read_header(r, hdr)) {
+        if (info->chunks == 0)
+            info->first_cycle = get32(hdr + CHUNK_HEADER + KEY_SIZE - 4);
+        ++info->chunks;
+        info->records += get32(hdr + 8);
+        info->raw_bytes += get32(hdr);
+        fseek(r->file, get32(hdr + 4), SEEK_CUR);
+    }
+    info->file_bytes = ftell(r->file);
+
+    // the last cycle needs the last chunk decoded
+    if (info->chunks > 0) {
+        trace_rec_t rec;
+
+        trace_seek(r, ~0u);
+        while (trace_next(r, &rec))
+            ;
+        info->last_cycle = r->state.cycle;
+    }
+    return info->chunks > 0;
+}
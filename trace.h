@@ -0,0 +1,81 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sm5.h"
+
+// changed fields in a trace record
+#define TR_A        0x0001
+#define TR_X        0x0002
+#define TR_BL       0x0004
+#define TR_BM       0x0008
+#define TR_SB       0x0010
+#define TR_C        0x0020
+#define TR_SKIP     0x0040
+#define TR_SP       0x0080
+#define TR_INT      0x0100
+#define TR_PORT0    0x0200      // ports 0-3 are consecutive bits
+#define TR_HIZ      0x2000
+#define TR_STACK    0x4000
+
+// RAM cells are 0x00-0xff, REG is 0x100-0x10f
+#define TR_REG      0x100
+
+// value of the TR_* field at bit, A to hiz
+uint8_t trace_field(const sm5_state_t *c, unsigned bit);
+
+typedef struct _trace_cell_t {
+    uint16_t addr;
+    uint8_t old, val;
+} trace_cell_t;
+
+// one instruction, with the state changes since the previous one
+typedef struct _trace_rec_t {
+    uint64_t index;
+    unsigned cycle;
+    sm5_pc_t pc;
+    uint8_t op, arg;
+    unsigned len;               // 0 on the end record
+    uint16_t changed;
+    unsigned cells;
+    trace_cell_t cell[0x110];
+} trace_rec_t;
+
+// write one record per instruction, before it runs
+int trace_open(const char *name, const char *variant);
+void trace_step(const sm5_state_t *state, uint8_t op, uint8_t arg, unsigned len);
+void trace_close(const sm5_state_t *state);
+
+typedef struct _trace_reader_t {
+    FILE *file;
+    char variant[32];
+    sm5_state_t state;          // state before the current record
+
+    // current chunk
+    uint8_t *buf;
+    size_t len, pos;
+    uint64_t index;
+    unsigned prev_len;
+    int done;
+} trace_reader_t;
+
+int trace_reader_open(trace_reader_t *r, const char *name);
+void trace_reader_close(trace_reader_t *r);
+// position at the last chunk starting at or before cycle
+int trace_seek(trace_reader_t *r, unsigned cycle);
+// apply the next record to r->state, returns 0 at the end
+int trace_next(trace_reader_t *r, trace_rec_t *rec);
+
+// chunk headers only, for a summary
+typedef struct _trace_info_t {
+    unsigned chunks;
+    uint64_t records;
+    unsigned first_cycle, last_cycle;
+    uint64_t raw_bytes, file_bytes;
+} trace_info_t;
+
+int trace_info(trace_reader_t *r, trace_info_t *info);
+
+#endif
@@ -0,0 +1,387 @@
+#include <curses.h>
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sched.h"
+#include "tui.h"
+
+// Text UI
+//
+// The emulator runs on the main thread as usual and the display on a
+// thread of its own, which is the only one to touch the terminal. Up to
+// FPS times a second the display asks for a frame; the emulator copies its
+// state into the frame between two run slices, under a lock it holds for
+// no longer than the copy, and carries on. So a frame is always a state the
+// machine was in at an instruction boundary, the emulator never waits on
+// the terminal, and a running session updates at the frame rate however
+// fast it runs.
+//
+// Keys go the other way, as commands the emulator picks up at the same
+// point. While paused it sleeps until a command or a frame request comes.
+
+#define FPS         30
+#define SLICE       2000        // cycles run between checks for requests
+#define HISTORY     64          // port 2 edges kept
+
+int tui_on = 0;
+
+typedef struct _edge_t {
+    unsigned cycle;
+    u8 level;
+} edge_t;
+
+// what the display draws
+typedef struct _frame_t {
+    sm5_state_t state;
+    sm5_stats_t stats;
+    edge_t edge[HISTORY];       // newest last
+    unsigned edges;
+    int running;
+    char message[64];
+    unsigned seq;
+} frame_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+// requests from the display, under lock
+static int want_frame = 0;
+static int want_step = 0;
+static int want_run = 0;        // toggle
+static int want_reset = 0;
+static int want_quit = 0;
+
+static frame_t frame;
+
+// emulator side
+static int running = 0;
+static char message[64] = "";
+static edge_t edge[HISTORY];
+static unsigned edges = 0;      // ever recorded
+static u8 port2_level = 1;
+
+
+////////////////////////////////
+// emulator thread
+//
+
+void tui_port_write(u8 reg) {
+    u8 level;
+
+    if (reg != 2 && reg != 0xf)
+        return;
+    level = sm5_port2_level(sm);
+    if (level == port2_level)
+        return;
+    port2_level = level;
+    edge[edges % HISTORY].cycle = cpu->cycle;
+    edge[edges % HISTORY].level = level;
+    ++edges;
+}
+
+// with lock held
+static void publish(void) {
+    unsigned i, n = edges < HISTORY ? edges : HISTORY;
+
+    sm5_snapshot(sm, &frame.state);
+    sm5_stats(sm, &frame.stats);
+    for (i = 0; i < n; ++i)
+        frame.edge[i] = edge[(edges - n + i) % HISTORY];
+    frame.edges = n;
+    frame.running = running;
+    snprintf(frame.message, sizeof(frame.message), "%s", message);
+    ++frame.seq;
+    want_frame = 0;
+}
+
+static void session_reset(void) {
+    reset_state();
+    edges = 0;
+    port2_level = 1;
+    running = 0;
+    snprintf(message, sizeof(message), "reset");
+}
+
+static void stopped(int status) {
+    running = 0;
+    if (finished)
+        snprintf(message, sizeof(message), "session over at cycle %u", cpu->cycle);
+    else if (status < 0)
+        snprintf(message, sizeof(message), "%x.%02x: %s", cpu->pc.page, cpu->pc.addr, sm5_strerror(status));
+    else
+        snprintf(message, sizeof(message), "%s", sm5_strerror(status));
+}
+
+static void emulate_tui(void) {
+    int step, status;
+    unsigned budget;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (!running && !want_step && !want_run && !want_reset && !want_quit && !want_frame)
+            pthread_cond_wait(&wake, &lock);
+        if (want_quit) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        if (want_reset) {
+            session_reset();
+            want_reset = 0;
+        }
+        if (want_run) {
+            running = !running && !finished;
+            message[0] = 0;
+            want_run = 0;
+        }
+        step = want_step && !running && !finished;
+        want_step = 0;
+        if (want_frame)
+            publish();
+        pthread_mutex_unlock(&lock);
+
+        if (running) {
+            budget = SLICE;
+            if (cycle_limit && cycle_limit - cpu->cycle < budget)
+                budget = cycle_limit - cpu->cycle;
+            status = sm5_run(sm, budget);
+            // checked without the lock: a request missed here is seen
+            // after the next slice
+            if (status != SM5_OK || finished || (cycle_limit && cpu->cycle >= cycle_limit)) {
+                pthread_mutex_lock(&lock);
+                stopped(status);
+                publish();
+                pthread_mutex_unlock(&lock);
+            }
+        } else if (step) {
+            status = sm5_step(sm);
+            pthread_mutex_lock(&lock);
+            message[0] = 0;
+            if (status != SM5_OK || finished)
+                stopped(status);
+            publish();
+            pthread_mutex_unlock(&lock);
+        }
+    }
+}
+
+
+////////////////////////////////
+// display thread
+//
+
+#define DIS_X       0
+#define RAM_X       28
+#define REGS_X      66
+#define TOP         2
+
+static frame_t shown, last;
+static int have_last = 0;
+static volatile sig_atomic_t interrupted = 0;
+
+static void request(int *what) {
+    pthread_mutex_lock(&lock);
+    *what = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+static void draw_disasm(int rows) {
+    unsigned page = shown.state.pc.page, addr = 0, pc_line = 0, n = 0, i, first, len;
+    u8 op, arg, at[0x40];
+    char buf[32];
+
+    // instruction boundaries come from a sweep of the page
+    while (addr < 0x40) {
+        if (addr <= shown.state.pc.addr)
+            pc_line = n;
+        at[n++] = addr;
+        addr += sm5_insn_len(sm5_rom_byte(sm, page, addr));
+    }
+    first = pc_line > rows / 2 ? pc_line - rows / 2 : 0;
+    if (first + rows > n)
+        first = n > rows ? n - rows : 0;
+
+    mvprintw(TOP - 1, DIS_X, "Disassembly");
+    for (i = 0; i < rows && first + i < n; ++i) {
+        addr = at[first + i];
+        op = sm5_rom_byte(sm, page, addr);
+        arg = sm5_rom_byte(sm, page, addr + 1);
+        len = sm5_insn_len(op);
+        sm5_disasm(op, arg, buf, sizeof(buf));
+        if (first + i == pc_line)
+            attron(A_REVERSE);
+        if (len == 2)
+            mvprintw(TOP + i, DIS_X, "%x.%02x  %02x %02x  %-12s", page, addr, op, arg, buf);
+        else
+            mvprintw(TOP + i, DIS_X, "%x.%02x  %02x     %-12s", page, addr, op, buf);
+        attroff(A_REVERSE);
+    }
+}
+
+// one hex row of nibbles, changes since the last frame highlighted
+static void draw_nibbles(int y, int x, u8 (*peek)(const sm5_state_t *, u8), unsigned base) {
+    unsigned i;
+    u8 val;
+
+    for (i = 0; i < 16; ++i) {
+        val = peek(&shown.state, base + i);
+        if (have_last && val != peek(&last.state, base + i))
+            attron(A_REVERSE | A_BOLD);
+        mvprintw(y, x + i * 2, "%x", val);
+        attroff(A_REVERSE | A_BOLD);
+    }
+}
+
+static void draw_memory(void) {
+    unsigned rows = sm5_variant(sm)->ram_size / 16, i;
+
+    mvprintw(TOP - 1, RAM_X, "RAM  0 1 2 3 4 5 6 7 8 9 a b c d e f");
+    for (i = 0; i < rows; ++i) {
+        mvprintw(TOP + i, RAM_X, " %x:", i);
+        draw_nibbles(TOP + i, RAM_X + 5, sm5_ram_peek, i * 16);
+    }
+    mvprintw(TOP + rows + 1, RAM_X, "REG");
+    draw_nibbles(TOP + rows + 1, RAM_X + 5, sm5_reg_peek, 0);
+}
+
+static void draw_registers(int rows) {
+    const sm5_state_t *c = &shown.state;
+    int y = TOP, i, n;
+
+    mvprintw(TOP - 1, REGS_X, "Registers");
+    mvprintw(y++, REGS_X, "PC %x.%02x", c->pc.page, c->pc.addr);
+    mvprintw(y++, REGS_X, "A %x  X %x", c->A, c->X);
+    mvprintw(y++, REGS_X, "BM %x BL %x", c->BM, c->BL);
+    mvprintw(y++, REGS_X, "SB %02x C %d", c->SB, c->C);
+    mvprintw(y++, REGS_X, "skip %d", c->skip);
+    mvprintw(y++, REGS_X, "P %x %x %x %s", c->port[0], c->port[1], c->port[2], c->port2_hiz ? "z" : "");
+
+    ++y;
+    mvprintw(y++, REGS_X, "Stack");
+    for (i = 0; i < sm5_variant(sm)->stack_depth; ++i) {
+        if (i < c->sp)
+            mvprintw(y, REGS_X, "%d %x.%02x", i, c->stack[i].page, c->stack[i].addr);
+        ++y;
+    }
+
+    ++y;
+    mvprintw(y++, REGS_X, "Port 2");
+    n = rows - (y - TOP);
+    for (i = 0; i < n && i < shown.edges; ++i) {
+        const edge_t *e = &shown.edge[shown.edges - 1 - i];
+        mvprintw(y++, REGS_X, "%9u %d", e->cycle, e->level);
+    }
+}
+
+static void draw(double rate) {
+    int rows = LINES - TOP - 1;
+
+    erase();
+    attron(A_BOLD);
+    mvprintw(0, 0, "sm5emu %s  %-7s cycle %-10u", sm5_variant(sm)->name,
+            shown.running ? "running" : "paused", shown.state.cycle);
+    attroff(A_BOLD);
+    if (shown.running)
+        printw(" %.2f Mcycles/s", rate / 1e6);
+    if (shown.message[0])
+        printw("  %s", shown.message);
+
+    draw_disasm(rows);
+    draw_memory();
+    draw_registers(rows);
+
+    mvprintw(LINES - 1, 0, "space step  r run/pause  R reset  q quit");
+    refresh();
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *display(void *arg) {
+    double next = now(), t, rate = 0, prev_t = 0;
+    unsigned seq = 0;
+    unsigned long long prev_cycles = 0;
+    int key, quit = 0;
+
+    while (!quit && !interrupted) {
+        request(&want_frame);
+
+        pthread_mutex_lock(&lock);
+        if (frame.seq != seq) {
+            last = shown;
+            have_last = seq != 0;
+            shown = frame;
+            seq = frame.seq;
+        }
+        pthread_mutex_unlock(&lock);
+
+        t = now();
+        if (shown.running && prev_t > 0 && t > prev_t)
+            rate = (shown.stats.cycles - prev_cycles) / (t - prev_t);
+        prev_t = t;
+        prev_cycles = shown.stats.cycles;
+        draw(rate);
+
+        // keys until the next frame is due
+        next += 1.0 / FPS;
+        while ((t = now()) < next) {
+            timeout((int)((next - t) * 1000) + 1);
+            key = getch();
+            if (key == ERR)
+                continue;
+            if (key == 'q') {
+                quit = 1;
+                break;
+            } else if (key == ' ' || key == '\n' || key == 's') {
+                request(&want_step);
+            } else if (key == 'r') {
+                request(&want_run);
+            } else if (key == 'R') {
+                request(&want_reset);
+            }
+        }
+        if (t > next + 1)
+            next = t;
+    }
+    request(&want_quit);
+    return NULL;
+}
+
+// the display notices within a frame
+static void interrupt(int signum) {
+    interrupted = 1;
+}
+
+void tui_run(void) {
+    pthread_t thread;
+
+    verbose = 0;
+    batch = 0;
+    tui_on = 1;
+    reset_state();
+
+    initscr();
+    cbreak();
+    noecho();
+    keypad(stdscr, TRUE);
+    curs_set(0);
+    signal(SIGINT, interrupt);
+
+    if (pthread_create(&thread, NULL, display, NULL) != 0) {
+        endwin();
+        err(1, "Can't start display thread");
+    }
+    emulate_tui();
+    pthread_join(thread, NULL);
+
+    endwin();
+    tui_on = 0;
+}
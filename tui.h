@@ -0,0 +1,14 @@
+#ifndef __TUI_H__
+#define __TUI_H__
+
+#include "emu.h"
+
+// set while the TUI owns the terminal
+extern int tui_on;
+
+// run the session under the TUI until it quits
+void tui_run(void);
+// from the port write callback, to keep the port 2 history
+void tui_port_write(u8 reg);
+
+#endif
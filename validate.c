@@ -0,0 +1,294 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+#include "validate.h"
+
+// Port 2 validation
+//
+// The capture is read as a stream of port 2 edges, one at a time, so traces
+// of any length validate in constant memory. Each level change of the
+// emulated port 2 output (1 while Hi-Z, else the value written to REG 2) is
+// paired with the next captured edge. The two must agree on the new level
+// and lie within the timing tolerance of each other.
+//
+// Captures are either a logic analyzer CSV (timestamp in ns, port 1, port
+// 2, ...) or a port I/O log written with -w.
+
+#define CONTEXT 8
+#define CSV_PORT2_COL 2
+
+typedef struct _edge_t {
+    unsigned cycle;
+    u8 val;
+} edge_t;
+
+static port_backend_t *inner = NULL;
+static FILE *trace_file = NULL;
+static const char *trace_name = NULL;
+static int trace_binary = 0;
+static unsigned tolerance = 0;
+
+static u8 trace_level = 1;
+static unsigned trace_cycle = 0;    // running cycle count for binary logs
+static u8 trace_reg2 = 0;
+static int trace_hiz = 1;
+
+static edge_t want;
+static int have_want = 0;
+static u8 emu_level = 1;
+
+static edge_t context_emu[CONTEXT], context_cap[CONTEXT];
+static unsigned edges = 0;
+static int diverged = 0;
+
+static int read_sample(unsigned *at, u8 *val) {
+    char line[256], *tok;
+    unsigned long long ts;
+    int col;
+    u8 tag, v;
+    unsigned delta;
+
+    if (trace_binary) {
+        while (log_get(trace_file, &tag, &v, &delta)) {
+            trace_cycle += delta;
+            if (tag == (EV_WRITE | 0xf))
+                trace_hiz = v ? 0 : 1;
+            else if (tag == (EV_WRITE | 2))
+                trace_reg2 = v;
+            else
+                continue;
+            *at = trace_cycle;
+            *val = trace_hiz ? 1 : trace_reg2 != 0;
+            return 1;
+        }
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), trace_file) != NULL) {
+        tok = strtok(line, ",");
+        if (tok == NULL)
+            continue;
+        ts = strtoull(tok, NULL, 10);
+        for (col = 1; col <= CSV_PORT2_COL && tok != NULL; ++col)
+            tok = strtok(NULL, ",");
+        if (tok == NULL)
+            continue;
+        *at = NS_TO_CYCLES(ts);
+        *val = strtoul(tok, NULL, 10) != 0;
+        return 1;
+    }
+    return 0;
+}
+
+// advance to the next level change in the capture
+static int next_edge(void) {
+    unsigned at;
+    u8 val;
+
+    while (read_sample(&at, &val)) {
+        if (val != trace_level) {
+            trace_level = val;
+            want.cycle = at;
+            want.val = val;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void print_edge(const char *prefix, edge_t *emu, edge_t *cap) {
+    printf("  %s", prefix);
+    if (emu)
+        printf("emu %10u -> %x   ", emu->cycle, emu->val);
+    else
+        printf("emu          -        ");
+    if (cap)
+        printf("capture %10u -> %x", cap->cycle, cap->val);
+    else
+        printf("capture          -");
+    if (emu && cap)
+        printf("   %+d", (int)(emu->cycle - cap->cycle));
+    printf("\n");
+}
+
+static void diverge(edge_t *emu, edge_t *cap) {
+    unsigned i, first;
+
+    printf("port 2 diverged from %s at edge %u\n", trace_name, edges);
+    first = edges > CONTEXT ? edges - CONTEXT : 0;
+    for (i = first; i < edges; ++i)
+        print_edge("   ", &context_emu[i % CONTEXT], &context_cap[i % CONTEXT]);
+    print_edge(">> ", emu, cap);
+    print_state();
+    save_state();
+    printf("state saved, load it in the debugger with restore\n");
+
+    diverged = 1;
+    if (batch)
+        finish();
+    else
+        run = 0;
+}
+
+// the emulator has run past the captured edge without producing it
+static void check_missing(void) {
+    if (diverged || !have_want)
+        return;
+    if (cpu->cycle > want.cycle + tolerance)
+        diverge(NULL, &want);
+}
+
+static void validate_reset(void) {
+    if (inner->reset)
+        inner->reset();
+    emu_level = 1;
+}
+
+static int validate_read(unsigned num) {
+    check_missing();
+    return inner->read(num);
+}
+
+static void validate_write(u8 reg, u8 val) {
+    edge_t got;
+    unsigned diff;
+
+    if (inner->write)
+        inner->write(reg, val);
+
+    if (diverged || (reg != 2 && reg != 0xf))
+        return;
+
+    got.cycle = cpu->cycle;
+    got.val = cpu->port2_hiz ? 1 : cpu->port[0] != 0;
+    if (got.val == emu_level)
+        return;
+    emu_level = got.val;
+
+    if (!have_want) {
+        diverge(&got, NULL);
+        return;
+    }
+
+    diff = got.cycle > want.cycle ? got.cycle - want.cycle : want.cycle - got.cycle;
+    if (got.val != want.val || diff > tolerance) {
+        diverge(&got, &want);
+        return;
+    }
+
+    context_emu[edges % CONTEXT] = got;
+    context_cap[edges % CONTEXT] = want;
+    ++edges;
+
+    have_want = next_edge();
+    if (!have_want && batch)
+        finish();
+}
+
+typedef struct _validate_state_t {
+    long pos;
+    u8 trace_level, trace_reg2;
+    int trace_hiz;
+    unsigned trace_cycle;
+    edge_t want;
+    int have_want;
+    u8 emu_level;
+    edge_t context_emu[CONTEXT], context_cap[CONTEXT];
+    unsigned edges;
+    int diverged;
+} validate_state_t;
+
+static void validate_save(void *buf) {
+    validate_state_t *vs = buf;
+
+    vs->pos = ftell(trace_file);
+    vs->trace_level = trace_level;
+    vs->trace_reg2 = trace_reg2;
+    vs->trace_hiz = trace_hiz;
+    vs->trace_cycle = trace_cycle;
+    vs->want = want;
+    vs->have_want = have_want;
+    vs->emu_level = emu_level;
+    memcpy(vs->context_emu, context_emu, sizeof(context_emu));
+    memcpy(vs->context_cap, context_cap, sizeof(context_cap));
+    vs->edges = edges;
+    vs->diverged = diverged;
+    if (inner->save)
+        inner->save(vs + 1);
+}
+
+static void validate_restore(const void *buf) {
+    const validate_state_t *vs = buf;
+
+    fseek(trace_file, vs->pos, SEEK_SET);
+    trace_level = vs->trace_level;
+    trace_reg2 = vs->trace_reg2;
+    trace_hiz = vs->trace_hiz;
+    trace_cycle = vs->trace_cycle;
+    want = vs->want;
+    have_want = vs->have_want;
+    emu_level = vs->emu_level;
+    memcpy(context_emu, vs->context_emu, sizeof(context_emu));
+    memcpy(context_cap, vs->context_cap, sizeof(context_cap));
+    edges = vs->edges;
+    diverged = vs->diverged;
+    if (inner->restore)
+        inner->restore(vs + 1);
+}
+
+port_backend_t validate_backend = {
+    .name = "validate",
+    .reset = validate_reset,
+    .read = validate_read,
+    .write = validate_write,
+    .save = validate_save,
+    .restore = validate_restore,
+};
+
+void validate_open(const char *name, unsigned tol) {
+    unsigned at;
+
+    trace_file = fopen(name, "r");
+    if (trace_file == NULL)
+        err(1, "Can't open %s", name);
+    trace_name = name;
+    tolerance = tol;
+
+    trace_binary = log_check_header(trace_file);
+    if (!trace_binary)
+        rewind(trace_file);
+    else
+        trace_level = 1;
+
+    // the first CSV sample sets the idle level
+    if (!trace_binary && !read_sample(&at, &trace_level))
+        errx(1, "%s: empty capture", name);
+
+    have_want = next_edge();
+
+    inner = backend;
+    validate_backend.state_size = sizeof(validate_state_t) + inner->state_size;
+    backend = &validate_backend;
+}
+
+int validate_report(void) {
+    if (trace_file == NULL)
+        return 1;
+
+    if (!diverged) {
+        if (have_want) {
+            printf("emulation stopped at cycle %u before capture edge %u\n", cpu->cycle, edges);
+            print_edge(">> ", NULL, &want);
+            diverged = 1;
+        } else {
+            printf("port 2 matches %s: %u edges, tolerance %u cycles\n", trace_name, edges, tolerance);
+        }
+    }
+
+    fclose(trace_file);
+    trace_file = NULL;
+    return !diverged;
+}
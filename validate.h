@@ -0,0 +1,12 @@
+#ifndef __VALIDATE_H__
+#define __VALIDATE_H__
+
+#include "emu.h"
+
+// compare port 2 output against a captured trace while running
+void validate_open(const char *name, unsigned tolerance);
+int validate_report(void);
+
+extern port_backend_t validate_backend;
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __VARIANTS_H__
+#define __VARIANTS_H__
+
+// SM5 variants
+//
+// Every variant gets its own copy of the interpreter (sm5core.c), compiled
+// with that variant's parameters as constants. Add a line here and the
+// name to VARIANTS in the Makefile to get a new core. The first entry is
+// the default.
+//
+// ROM pages and RAM size must be powers of two; addresses wrap around
+// them. Ports counts TPB's port numbers, port 0 included. The DTA table
+// is 64 bits, bit n read with BM = 4 + n / 16 and BL = n % 16.
+//
+// Plain SM5 and SM5A parts have no DTA table. Only the 6105 has been
+// dumped. The other CICs use its geometry and
+// secret table until someone reads theirs out.
+
+//  name     ROM pages  RAM  stack  ports  PAT page  TRS page  DTA table
+#define SM5_VARIANTS(X) \
+    X(cic6105,  16,  0x100,  4,  4,  4,  1,  0x9a1b8f036ca5fcfcULL) \
+    X(cic6101,  16,  0x100,  4,  4,  4,  1,  0x9a1b8f036ca5fcfcULL) \
+    X(cic6102,  16,  0x100,  4,  4,  4,  1,  0x9a1b8f036ca5fcfcULL) \
+    X(cic6103,  16,  0x100,  4,  4,  4,  1,  0x9a1b8f036ca5fcfcULL) \
+    X(cic6106,  16,  0x100,  4,  4,  4,  1,  0x9a1b8f036ca5fcfcULL) \
+    X(sm5,      16,  0x80,   4,  4,  4,  1,  0) \
+    X(sm5a,     16,  0x100,  4,  4,  4,  1,  0)
+
+#endif